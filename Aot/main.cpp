@@ -0,0 +1,48 @@
+#include <iostream>
+#include <string>
+#include "../Emulator/emulator.h"
+
+void ReadCmdArguments(int argc, char* argv[], std::string& inputFile, std::string& outputFile);
+
+// Translated program is a C++ file with its own main(). It is built together with emulator
+// library, and prints the same result as ./emulator program.hex.
+//
+int main(int argc, char* argv[])
+{
+	std::string inputFile = "";
+	std::string outputFile = "";
+
+	try
+	{
+		ReadCmdArguments(argc, argv, inputFile, outputFile);
+
+		Emulator emulator;
+
+		emulator.ReadMemoryContent(inputFile);
+		emulator.WriteTranslation(outputFile);
+	}
+	catch (EmulatorError& error)
+	{
+		std::cout << error.what() << "\n";
+		return -1;
+	}
+
+	return 0;
+}
+
+void ReadCmdArguments(int argc, char* argv[], std::string& inputFile, std::string& outputFile)
+{
+	// FORMAT:
+	// ./aot program.hex -o program.cpp
+	//
+	// Built together with emulator library, all of ../Emulator/*.cpp except main.cpp
+	//
+
+	if (argc != 4 || std::string(argv[2]) != "-o")
+	{
+		throw EmulatorError("Usage: aot program.hex -o program.cpp");
+	}
+
+	inputFile = argv[1];
+	outputFile = argv[3];
+}
\ No newline at end of file
@@ -0,0 +1,64 @@
+# file: bubble_sort.s
+# sorts array which starts in descending order, over and over
+
+.global my_start
+
+.section text
+my_start:
+  ldr sp, $0xFEFE
+  ldr r5, $10 # repetitions
+
+repeat:
+  # array[i] = 256 - i
+  ldr r0, $array
+  ldr r1, $array_end
+  ldr r2, $256
+fill:
+  str r2, [r0]
+  ldr r3, $1
+  sub r2, r3
+  ldr r3, $2
+  add r0, r3
+  cmp r0, r1
+  jne fill
+
+  # r1 -> last element of unsorted part
+  ldr r3, $2
+  sub r1, r3
+pass:
+  ldr r0, $array
+inner:
+  cmp r0, r1
+  jeq pass_end
+  ldr r2, [r0]
+  ldr r4, [r0 + 2]
+  cmp r2, r4
+  jgt swap
+  jmp next
+swap:
+  str r4, [r0]
+  str r2, [r0 + 2]
+next:
+  ldr r3, $2
+  add r0, r3
+  jmp inner
+pass_end:
+  ldr r3, $2
+  sub r1, r3
+  ldr r0, $array
+  cmp r1, r0
+  jne pass
+
+  ldr r3, $1
+  sub r5, r3
+  ldr r3, $0
+  cmp r5, r3
+  jne repeat
+
+  halt
+
+.section data
+array:
+  .skip 512
+array_end:
+.end
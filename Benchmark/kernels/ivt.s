@@ -0,0 +1,8 @@
+# file: ivt.s
+
+.extern my_start
+
+.section ivt
+.word my_start
+.skip 14
+.end
@@ -0,0 +1,50 @@
+# file: memcpy.s
+# copies block of words from src to dst, over and over
+
+.global my_start
+
+.section text
+my_start:
+  ldr sp, $0xFEFE
+
+  # src[i] = i
+  ldr r0, $src
+  ldr r1, $src_end
+  ldr r2, $0
+  ldr r3, $1
+  ldr r4, $2
+fill:
+  str r2, [r0]
+  add r2, r3
+  add r0, r4
+  cmp r0, r1
+  jne fill
+
+  ldr r5, $200 # repetitions
+repeat:
+  ldr r0, $src
+  ldr r1, $dst
+  ldr r3, $src_end
+copy:
+  ldr r2, [r0]
+  str r2, [r1]
+  add r0, r4
+  add r1, r4
+  cmp r0, r3
+  jne copy
+
+  ldr r3, $1
+  sub r5, r3
+  ldr r3, $0
+  cmp r5, r3
+  jne repeat
+
+  halt
+
+.section data
+src:
+  .skip 4096
+src_end:
+dst:
+  .skip 4096
+.end
@@ -0,0 +1,95 @@
+# file: sieve.s
+# sieve of Eratosthenes over 4096 numbers, over and over, r0 = number of primes
+
+.global my_start
+
+.section text
+my_start:
+  ldr sp, $0xFEFE
+  ldr r5, $20 # repetitions
+
+repeat:
+  # composite[i] = 0
+  ldr r0, $composite
+  ldr r1, $composite_end
+  ldr r2, $0
+  ldr r3, $2
+clear:
+  str r2, [r0]
+  add r0, r3
+  cmp r0, r1
+  jne clear
+
+  ldr r0, $2 # i
+outer:
+  # stop once i * i >= 4096
+  ldr r2, r0
+  mul r2, r0
+  ldr r3, $4096
+  cmp r2, r3
+  jeq count
+  jgt count
+
+  # skip i if already marked
+  ldr r3, r0
+  add r3, r0
+  ldr r4, $composite
+  add r3, r4
+  ldr r4, [r3]
+  ldr r1, $0
+  cmp r4, r1
+  jne outer_next
+
+  # mark i * i, i * i + i, ... r3 -> composite[j], r4 -> step of 2 * i
+  ldr r3, r2
+  add r3, r2
+  ldr r4, $composite
+  add r3, r4
+  ldr r4, r0
+  add r4, r0
+  ldr r1, $composite_end
+  ldr r2, $1
+mark:
+  str r2, [r3]
+  add r3, r4
+  cmp r3, r1
+  jeq outer_next
+  jgt outer_next
+  jmp mark
+outer_next:
+  ldr r3, $1
+  add r0, r3
+  jmp outer
+
+count:
+  ldr r0, $0 # primes
+  ldr r1, $composite
+  ldr r3, $4
+  add r1, r3 # from 2
+  ldr r2, $composite_end
+  ldr r4, $0
+count_next:
+  ldr r3, [r1]
+  cmp r3, r4
+  jne count_skip
+  ldr r3, $1
+  add r0, r3
+count_skip:
+  ldr r3, $2
+  add r1, r3
+  cmp r1, r2
+  jne count_next
+
+  ldr r3, $1
+  sub r5, r3
+  ldr r3, $0
+  cmp r5, r3
+  jne repeat
+
+  halt
+
+.section data
+composite:
+  .skip 8192
+composite_end:
+.end
@@ -0,0 +1,299 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <iterator>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include "../Emulator/emulator.h"
+
+#if defined(__unix__)
+#include <sys/resource.h>
+#endif
+
+enum RunMode { INTERPRETER_MODE, THREADED_MODE, BLOCKS_MODE, JIT_MODE, MODE_COUNT };
+
+const char* modeNames[MODE_COUNT] = { "interpreter", "threaded", "blocks", "jit" };
+
+struct BenchmarkOptions
+{
+	int iterations = 20;
+
+	// All modes unless some are given
+	//
+	std::vector<RunMode> modes;
+
+	// Empty for stdout
+	//
+	std::string outputFile;
+
+	std::vector<std::string> inputFiles;
+};
+
+// Totals of all runs of one program in one mode
+//
+struct BenchmarkResult
+{
+	std::string program;
+	RunMode mode;
+
+	// Of a single run, every run executes the same instructions
+	//
+	uint64_t instructions;
+
+	uint64_t runNanoseconds;
+	uint64_t bestRunNanoseconds;
+	uint64_t decodeNanoseconds;
+};
+
+void ReadCmdArguments(int argc, char* argv[], BenchmarkOptions& options);
+
+std::vector<uint8_t> ReadImage(const std::string& inputFile)
+{
+	std::ifstream input(inputFile, std::ios::binary | std::ios::in);
+
+	if (!input.is_open())
+	{
+		throw EmulatorError("Error opening " + inputFile);
+	}
+
+	return std::vector<uint8_t>(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+}
+
+// Each run gets a fresh processor, so that every run starts from the same memory and cold
+// caches. Only Run*() itself is timed.
+//
+BenchmarkResult RunBenchmark(const std::string& program, const std::vector<uint8_t>& image, RunMode mode, int iterations)
+{
+	BenchmarkResult result = { program, mode, 0, 0, UINT64_MAX, 0 };
+
+	for (int i = 0; i < iterations; i++)
+	{
+		Emulator emulator;
+
+		emulator.DisconnectTerminal();
+		emulator.LoadImage(image.data(), image.size(), program);
+		emulator.Init();
+
+		auto runBegin = std::chrono::steady_clock::now();
+
+		StopReason reason;
+
+		switch (mode)
+		{
+		case THREADED_MODE:
+			reason = emulator.RunThreaded();
+			break;
+		case BLOCKS_MODE:
+			reason = emulator.RunBlocks();
+			break;
+		case JIT_MODE:
+			reason = emulator.RunJit();
+			break;
+		default:
+			reason = emulator.Run();
+			break;
+		}
+
+		uint64_t runNanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - runBegin).count();
+
+		if (reason != STOP_HALT)
+		{
+			throw EmulatorError(program + " did not halt");
+		}
+
+		EmulatorStatistics statistics = emulator.GetStatistics();
+
+		result.instructions = statistics.instructions;
+		result.runNanoseconds += runNanoseconds;
+		result.bestRunNanoseconds = std::min(result.bestRunNanoseconds, runNanoseconds);
+		result.decodeNanoseconds += statistics.decodeNanoseconds;
+	}
+
+	return result;
+}
+
+std::string JsonString(const std::string& text)
+{
+	std::string quoted = "\"";
+
+	for (char character : text)
+	{
+		if (character == '"' || character == '\\')
+		{
+			quoted += '\\';
+		}
+
+		quoted += character;
+	}
+
+	return quoted + "\"";
+}
+
+// Peak resident set of whole benchmark in kilobytes, 0 where it is not known
+//
+long PeakResidentSetSize()
+{
+#if defined(__unix__)
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
+	{
+		return usage.ru_maxrss;
+	}
+#endif
+
+	return 0;
+}
+
+// Times are averages of one run. Decode time is host time spent filling decode cache,
+// execute time is the rest of the run.
+//
+void WriteResults(std::ostream& output, const BenchmarkOptions& options, const std::vector<BenchmarkResult>& results)
+{
+	output << std::fixed << std::setprecision(3);
+	output << "{\n";
+	output << "  \"iterations\": " << options.iterations << ",\n";
+	output << "  \"peak_rss_kb\": " << PeakResidentSetSize() << ",\n";
+	output << "  \"results\": [\n";
+
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const BenchmarkResult& result = results[i];
+
+		double runNanoseconds = (double)result.runNanoseconds / options.iterations;
+		double decodeNanoseconds = (double)result.decodeNanoseconds / options.iterations;
+		double instructions = result.instructions != 0 ? result.instructions : 1;
+
+		output << "    {\n";
+		output << "      \"program\": " << JsonString(result.program) << ",\n";
+		output << "      \"mode\": " << JsonString(modeNames[result.mode]) << ",\n";
+		output << "      \"instructions\": " << result.instructions << ",\n";
+		output << "      \"mips\": " << instructions * 1000.0 / runNanoseconds << ",\n";
+		output << "      \"best_mips\": " << instructions * 1000.0 / result.bestRunNanoseconds << ",\n";
+		output << "      \"ns_per_instruction\": " << runNanoseconds / instructions << ",\n";
+		output << "      \"run_ns\": " << runNanoseconds << ",\n";
+		output << "      \"decode_ns\": " << decodeNanoseconds << ",\n";
+		output << "      \"execute_ns\": " << std::max(runNanoseconds - decodeNanoseconds, 0.0) << "\n";
+		output << "    }" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+
+	output << "  ]\n";
+	output << "}\n";
+}
+
+int main(int argc, char* argv[])
+{
+	BenchmarkOptions options;
+
+	try
+	{
+		ReadCmdArguments(argc, argv, options);
+
+		std::vector<BenchmarkResult> results;
+
+		// Images are read once, every run loads them from memory
+		//
+		for (auto& inputFile : options.inputFiles)
+		{
+			std::vector<uint8_t> image = ReadImage(inputFile);
+
+			for (auto mode : options.modes)
+			{
+				results.push_back(RunBenchmark(inputFile, image, mode, options.iterations));
+			}
+		}
+
+		if (options.outputFile.empty())
+		{
+			WriteResults(std::cout, options, results);
+		}
+		else
+		{
+			std::ofstream output(options.outputFile);
+
+			if (!output.is_open())
+			{
+				throw EmulatorError("Error opening " + options.outputFile);
+			}
+
+			WriteResults(output, options, results);
+		}
+	}
+	catch (EmulatorError& error)
+	{
+		std::cout << error.what() << "\n";
+		return -1;
+	}
+
+	return 0;
+}
+
+void ReadCmdArguments(int argc, char* argv[], BenchmarkOptions& options)
+{
+	// FORMAT:
+	// ./benchmark [--iterations N] [--mode interpreter|threaded|blocks|jit]... [-o results.json] program.hex...
+	//
+	// Built together with emulator library, all of ../Emulator/*.cpp except main.cpp
+	//
+
+	const std::string usage = "Usage: benchmark [--iterations N] [--mode interpreter|threaded|blocks|jit]... [-o results.json] program.hex...";
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string argument = argv[i];
+
+		if (argument == "--iterations" && i + 1 < argc)
+		{
+			std::istringstream value(argv[++i]);
+
+			if (!(value >> options.iterations) || options.iterations <= 0)
+			{
+				throw EmulatorError("Wrong number of iterations " + std::string(argv[i]));
+			}
+		}
+		else if (argument == "--mode" && i + 1 < argc)
+		{
+			std::string name = argv[++i];
+			int mode = 0;
+
+			while (mode < MODE_COUNT && name != modeNames[mode])
+			{
+				mode++;
+			}
+
+			if (mode == MODE_COUNT)
+			{
+				throw EmulatorError("Unknown mode " + name);
+			}
+
+			options.modes.push_back((RunMode)mode);
+		}
+		else if (argument == "-o" && i + 1 < argc)
+		{
+			options.outputFile = argv[++i];
+		}
+		else if (!argument.empty() && argument[0] == '-')
+		{
+			throw EmulatorError(usage);
+		}
+		else
+		{
+			options.inputFiles.push_back(argument);
+		}
+	}
+
+	if (options.inputFiles.empty())
+	{
+		throw EmulatorError(usage);
+	}
+
+	if (options.modes.empty())
+	{
+		for (int mode = 0; mode < MODE_COUNT; mode++)
+		{
+			options.modes.push_back((RunMode)mode);
+		}
+	}
+}
\ No newline at end of file
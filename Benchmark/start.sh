@@ -0,0 +1,23 @@
+ASSEMBLER=../../assembler
+LINKER=../../linker
+BENCHMARK=../benchmark
+
+# Bundled programs are built by their own scripts
+for TEST in test test_gcd test_count_ones_zeroes test_greatest_prime_less_than_N
+do
+  (cd ../${TEST} && sh start.sh > /dev/null)
+done
+
+cd kernels
+
+${ASSEMBLER} -o ivt.o ivt.s
+
+for KERNEL in memcpy bubble_sort sieve
+do
+  ${ASSEMBLER} -o ${KERNEL}.o ${KERNEL}.s
+  ${LINKER} -hex -o ${KERNEL}.hex ivt.o ${KERNEL}.o
+done
+
+cd ..
+
+${BENCHMARK} -o benchmark.json ../test/program.hex ../test_gcd/program.hex ../test_count_ones_zeroes/program.hex ../test_greatest_prime_less_than_N/program.hex kernels/memcpy.hex kernels/bubble_sort.hex kernels/sieve.hex
\ No newline at end of file
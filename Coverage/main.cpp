@@ -0,0 +1,107 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../Emulator/emulator.h"
+
+struct CoverageOptions
+{
+	bool isMerge = false;
+
+	// Program whose symbols and code annotate coverage
+	//
+	std::string programFile;
+
+	std::vector<std::string> inputFiles;
+	std::string outputFile;
+};
+
+void ReadCmdArguments(int argc, char* argv[], CoverageOptions& options);
+
+// Merged coverage has every address which any of the runs executed
+//
+int main(int argc, char* argv[])
+{
+	CoverageOptions options;
+
+	try
+	{
+		ReadCmdArguments(argc, argv, options);
+
+		std::vector<uint8_t> coverage;
+
+		for (auto& inputFile : options.inputFiles)
+		{
+			Emulator::ReadCoverageFile(inputFile, coverage);
+		}
+
+		if (options.isMerge)
+		{
+			Emulator::WriteCoverageFile(options.outputFile, coverage);
+		}
+		else
+		{
+			Emulator emulator;
+
+			emulator.ReadMemoryContent(options.programFile);
+			emulator.WriteCoverageReport(options.outputFile, coverage, options.programFile + "_symbols.txt");
+		}
+	}
+	catch (EmulatorError& error)
+	{
+		std::cout << error.what() << "\n";
+		return -1;
+	}
+
+	return 0;
+}
+
+void ReadCmdArguments(int argc, char* argv[], CoverageOptions& options)
+{
+	// FORMAT:
+	// ./coverage merge -o all.cov a.cov b.cov ...
+	// ./coverage annotate program.hex -o report.txt a.cov b.cov ...
+	//
+	// Built together with emulator library, all of ../Emulator/*.cpp except main.cpp.
+	// Annotation takes symbols from program.hex_symbols.txt written by linker.
+	//
+
+	const std::string usage = "Usage: coverage merge -o all.cov a.cov... | coverage annotate program.hex -o report.txt a.cov...";
+
+	if (argc < 2)
+	{
+		throw EmulatorError(usage);
+	}
+
+	std::string command = argv[1];
+	int i = 2;
+
+	if (command == "merge")
+	{
+		options.isMerge = true;
+	}
+	else if (command == "annotate" && i < argc)
+	{
+		options.programFile = argv[i++];
+	}
+	else
+	{
+		throw EmulatorError(usage);
+	}
+
+	if (i + 1 >= argc || std::string(argv[i]) != "-o")
+	{
+		throw EmulatorError(usage);
+	}
+
+	options.outputFile = argv[i + 1];
+
+	for (i += 2; i < argc; i++)
+	{
+		options.inputFiles.push_back(argv[i]);
+	}
+
+	if (options.inputFiles.empty())
+	{
+		throw EmulatorError(usage);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,41 @@
+EMULATOR=../emulator
+
+# Every test program runs under each core. Its registers, exit code and final state with all
+# of memory have to be those of the basic interpreter.
+#
+FAILED=0
+
+for TEST in ../test*/
+do
+  TEST=${TEST%/}
+  NAME=${TEST#../}
+
+  (cd ${TEST} && sh start.sh > /dev/null < /dev/null)
+
+  for MODE in "" --threaded --blocks --jit
+  do
+    OUT=${NAME}${MODE:+.${MODE#--}}
+
+    ${EMULATOR} ${MODE} --snapshot-at end --snapshot-out ${OUT}.snap ${TEST}/program.hex < /dev/null > ${OUT}.out
+    echo "exit code $?" >> ${OUT}.out
+
+    # Blocks and jit add their cache statistics after the result
+    grep -E '^(Emulated|r[0-9]=|exit code)' ${OUT}.out > ${OUT}.result
+  done
+
+  for MODE in threaded blocks jit
+  do
+    if ! diff ${NAME}.result ${NAME}.${MODE}.result > /dev/null || ! cmp -s ${NAME}.snap ${NAME}.${MODE}.snap
+    then
+      echo "${NAME}: --${MODE} differs from interpreter"
+      FAILED=1
+    fi
+  done
+done
+
+if [ ${FAILED} -eq 0 ]
+then
+  echo "All cores agree"
+fi
+
+exit ${FAILED}
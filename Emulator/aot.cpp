@@ -0,0 +1,619 @@
+#include "emulator.h"
+#include "cpu.h"
+#include "disassembler.h"
+#include "error.h"
+#include <fstream>
+#include <sstream>
+#include <map>
+
+uint16_t ReadWord(CpuState& cpu, uint16_t address);
+bool EndsBasicBlock(const DecodedInstruction& instruction);
+
+// Translated code keeps guest registers in locals, so that host compiler can keep them in
+// host registers. They go back to CpuState whenever code outside of translation may look
+// at them. Flags are always in PSW, same as in code compiled by --jit.
+//
+const char* translationHeader = R"(#include "emulator.h"
+#include "cpu.h"
+#include "error.h"
+#include <cstring>
+#include <iostream>
+
+void WriteWord(CpuState& cpu, uint16_t address, uint16_t value);
+void MaterializeFlags(CpuState& cpu);
+
+#define SPILL_REGISTERS() memcpy(cpu.regs, regs, sizeof(regs))
+#define RELOAD_REGISTERS() memcpy(regs, cpu.regs, sizeof(regs))
+
+#define READ_WORD(address) (uint16_t)((uint8_t)cpu.memory[(uint16_t)(address)] | ((uint8_t)cpu.memory[(uint16_t)((address) + 1)] << 8))
+
+#define READ_OVERFLOW(pc) { regs[PC] = pc; SPILL_REGISTERS(); RaiseError("Cannot read memory at address 0xFFFF - overflow"); }
+
+// Next block runs right away, unless an event is due or a store has dropped its translation
+//
+#define CAN_CONTINUE(pc) (!cpu.stop && cpu.cycles < cpu.nextEventCycle && cpu.nativeBlockSizes[pc] != 0)
+
+#define LEAVE(pc) { regs[PC] = pc; SPILL_REGISTERS(); return; }
+#define GO_TO(pc, label) { if (CAN_CONTINUE(pc)) goto label; LEAVE(pc) }
+#define DISPATCH() { if (CAN_CONTINUE(regs[PC])) goto dispatch; SPILL_REGISTERS(); return; }
+
+// Stores to code and device registers go through WriteWord(), true if this one did
+//
+inline bool Store(CpuState& cpu, uint16_t address, uint16_t value)
+{
+	uint16_t next = address + 1;
+
+	if ((cpu.watchedBytes[address] | cpu.watchedBytes[next]) == 0)
+	{
+		cpu.memory[address] = value & 0x00FF;
+		cpu.memory[next] = (value >> 8) & 0x00FF;
+		return false;
+	}
+
+	WriteWord(cpu, address, value);
+	return true;
+}
+)";
+
+std::string BlockLabel(uint16_t address)
+{
+	return "block_" + Hex(address).substr(2);
+}
+
+std::string InstructionName(uint16_t address)
+{
+	return "instruction_" + Hex(address).substr(2);
+}
+
+// PC reads as address of next instruction
+//
+std::string RegisterValue(uint8_t reg, uint16_t next)
+{
+	return reg == PC ? Hex(next) : "regs[" + std::to_string(reg) + "]";
+}
+
+// Address of memory operand of ldr, str and jump instructions, same as in interpreter
+//
+std::string MemoryAddress(const DecodedInstruction& instruction, uint16_t next)
+{
+	switch (instruction.addrMode)
+	{
+	case MEMDIR_SYMBOL_PCREL:
+		return Hex(next + instruction.payload);
+	case REGIND:
+	case REGIND_JMP:
+		return RegisterValue(instruction.regS, next);
+	case REGIND_LITERAL:
+	case REGIND_SYMBOL:
+	case REGIND_LITERAL_JMP:
+	case REGIND_SYMBOL_JMP:
+		return "(uint16_t)(" + Hex(instruction.payload & 0xFF00) + " | (" + Hex(instruction.payload & 0x00FF) + " + " + RegisterValue(instruction.regS, next) + "))";
+	default:
+		return Hex(instruction.payload);
+	}
+}
+
+// Continues with translated block at target, or leaves native code
+//
+void EmitGoTo(std::ostream& output, uint16_t target, const std::map<uint16_t, BasicBlock*>& blocks, const std::string& indent = "\t")
+{
+	if (blocks.count(target) != 0)
+	{
+		output << indent << "GO_TO(" << Hex(target) << ", " << BlockLabel(target) << ")\n";
+	}
+	else
+	{
+		output << indent << "LEAVE(" << Hex(target) << ")\n";
+	}
+}
+
+void EmitStore(std::ostream& output, const BasicBlock* block, const std::string& address, const std::string& value, uint16_t next, size_t executed)
+{
+	output << "\tif (Store(cpu, " << address << ", " << value << ") && cpu.nativeBlockSizes[" << Hex(block->start) << "] == 0)\n";
+	output << "\t{\n";
+	output << "\t\tcpu.cycles += " << executed << ";\n";
+	output << "\t\tLEAVE(" << Hex(next) << ")\n";
+	output << "\t}\n";
+}
+
+// Rare instructions and the ones which leave the block through stack or IVT are executed
+// by interpreter
+//
+bool EmitInterpreterCall(std::ostream& output, const BasicBlock* block, const DecodedInstruction& instruction, uint16_t address, uint16_t next, size_t executed)
+{
+	output << "\tregs[PC] = " << Hex(next) << ";\n";
+	output << "\tSPILL_REGISTERS();\n";
+	output << "\tEmulator::ExecuteInstruction(cpu, " << InstructionName(address) << ");\n";
+	output << "\tMaterializeFlags(cpu);\n";
+	output << "\tRELOAD_REGISTERS();\n";
+
+	if (EndsBasicBlock(instruction))
+	{
+		output << "\tcpu.cycles += " << executed << ";\n";
+		output << "\tDISPATCH()\n";
+		return true;
+	}
+
+	output << "\tif (cpu.nativeBlockSizes[" << Hex(block->start) << "] == 0)\n";
+	output << "\t{\n";
+	output << "\t\tcpu.cycles += " << executed << ";\n";
+	output << "\t\tLEAVE(" << Hex(next) << ")\n";
+	output << "\t}\n";
+
+	return false;
+}
+
+// C++ of one instruction, true if it has already left the block
+//
+bool EmitInstruction(std::ostream& output, const BasicBlock* block, const DecodedInstruction& instruction, uint16_t address, uint16_t next, size_t executed, const std::map<uint16_t, BasicBlock*>& blocks)
+{
+	std::string regD = RegisterValue(instruction.regD, next);
+	std::string regS = RegisterValue(instruction.regS, next);
+	std::string target = "regs[" + std::to_string(instruction.regD) + "]";
+	const char* operation = nullptr;
+
+	switch (instruction.opCode)
+	{
+	case 0x70: operation = "+"; break;
+	case 0x71: operation = "-"; break;
+	case 0x72: operation = "*"; break;
+	case 0x73: operation = "/"; break;
+	case 0x81: operation = "&"; break;
+	case 0x82: operation = "|"; break;
+	case 0x83: operation = "^"; break;
+	}
+
+	switch (instruction.opCode)
+	{
+	case 0x70://add
+	case 0x71://sub
+	case 0x72://mul
+	case 0x73://div
+	case 0x81://and
+	case 0x82://or
+	case 0x83://xor
+		if (instruction.regD == PC)
+		{
+			return EmitInterpreterCall(output, block, instruction, address, next, executed);
+		}
+
+		// Division by zero traps on host, just as it does in interpreter
+		//
+		output << "\t" << target << " = (uint16_t)((uint32_t)" << regD << " " << operation << " " << regS << ");\n";
+		return false;
+	case 0x80://not
+		if (instruction.regD == PC)
+		{
+			return EmitInterpreterCall(output, block, instruction, address, next, executed);
+		}
+
+		output << "\t" << target << " = ~" << regD << ";\n";
+		return false;
+	case 0x60://xchg
+		if (instruction.regD == PC || instruction.regS == PC)
+		{
+			return EmitInterpreterCall(output, block, instruction, address, next, executed);
+		}
+
+		// Only low byte of first register makes it to second one
+		//
+		output << "\t{\n";
+		output << "\t\tuint8_t temp = " << regD << ";\n";
+		output << "\t\t" << target << " = " << regS << ";\n";
+		output << "\t\tregs[" << (int)instruction.regS << "] = temp;\n";
+		output << "\t}\n";
+		return false;
+	case 0x74://cmp
+		// Same flags as SetCmpFlags(), C is always cleared
+		//
+		output << "\t{\n";
+		output << "\t\tint16_t operandD = " << regD << ";\n";
+		output << "\t\tint16_t operandS = " << regS << ";\n";
+		output << "\t\tint16_t result = operandD - operandS;\n";
+		output << "\t\tbool overflow = (operandD < 0 && -operandS < 0 && result > 0) || (operandD > 0 && -operandS > 0 && result < 0);\n";
+		output << "\t\tregs[PSW] = (regs[PSW] & 0xFFF0) | (result == 0) | (overflow << 1) | ((result < 0) << 3);\n";
+		output << "\t}\n";
+		return false;
+	case 0x84://test
+		output << "\t{\n";
+		output << "\t\tuint16_t result = " << regD << " & " << regS << ";\n";
+		output << "\t\tregs[PSW] = (regs[PSW] & 0xFFF6) | (result == 0) | ((result >> 15) << 3);\n";
+		output << "\t}\n";
+		return false;
+	case 0xA0://ldr
+		if (instruction.regD == PC)
+		{
+			return EmitInterpreterCall(output, block, instruction, address, next, executed);
+		}
+
+		switch (instruction.addrMode)
+		{
+		case IMMEDIATE:
+		case IMMEDIATE_SYMBOL_VALUE:
+		case IMMEDIATE_JMP:
+		case IMMEDIATE_SYMBOL_VALUE_ABS_JMP:
+		case IMMEDIATE_SYMBOL_VALUE_PCREL_JMP:
+			output << "\t" << target << " = " << Hex(instruction.payload) << ";\n";
+			break;
+		case REGDIR:
+		case REGDIR_JMP:
+			output << "\t" << target << " = " << regS << ";\n";
+			break;
+		case MEMDIR_LITERAL:
+		case MEMDIR_SYMBOL_ABS:
+		case MEMDIR_SYMBOL_PCREL:
+		case MEMDIR_LITERAL_JMP:
+		case MEMDIR_SYMBOL_JMP:
+			output << "\t" << target << " = READ_WORD(" << MemoryAddress(instruction, next) << ");\n";
+			break;
+		default:
+			output << "\t{\n";
+			output << "\t\tuint16_t address = " << MemoryAddress(instruction, next) << ";\n";
+			output << "\n";
+			output << "\t\tif (address == 0xFFFF)\n";
+			output << "\t\t{\n";
+			output << "\t\t\tREAD_OVERFLOW(" << Hex(next) << ")\n";
+			output << "\t\t}\n";
+			output << "\n";
+			output << "\t\t" << target << " = READ_WORD(address);\n";
+			output << "\t}\n";
+			break;
+		}
+		return false;
+	case 0xB0://str
+		switch (instruction.addrMode)
+		{
+		case REGDIR:
+			if (instruction.regS == PC)
+			{
+				return EmitInterpreterCall(output, block, instruction, address, next, executed);
+			}
+
+			output << "\tregs[" << (int)instruction.regS << "] = " << regD << ";\n";
+			return false;
+		case MEMDIR_LITERAL:
+		case MEMDIR_SYMBOL_ABS:
+		case MEMDIR_SYMBOL_PCREL:
+		case REGIND:
+		case REGIND_LITERAL:
+		case REGIND_SYMBOL:
+			EmitStore(output, block, MemoryAddress(instruction, next), regD, next, executed);
+			return false;
+		default:
+			// Interpreter ignores other modes
+			//
+			return false;
+		}
+	case 0xE0://push
+		// Value is read before SP moves, in case of push sp
+		//
+		if (instruction.regD == SP)
+		{
+			output << "\tregs[SP] -= 2;\n";
+			EmitStore(output, block, "regs[SP]", "(uint16_t)(regs[SP] + 2)", next, executed);
+			return false;
+		}
+
+		output << "\tregs[SP] -= 2;\n";
+		EmitStore(output, block, "regs[SP]", regD, next, executed);
+		return false;
+	case 0xF0://pop
+		if (instruction.regD == PC)
+		{
+			return EmitInterpreterCall(output, block, instruction, address, next, executed);
+		}
+
+		output << "\t" << target << " = READ_WORD(regs[SP]);\n";
+		output << "\tregs[SP] += 2;\n";
+		return false;
+	case 0x53://jgt
+	case 0x52://jne
+	case 0x51://jeq
+	case 0x50://jmp
+		if (instruction.addrMode != IMMEDIATE_JMP && instruction.addrMode != IMMEDIATE_SYMBOL_VALUE_ABS_JMP)
+		{
+			return EmitInterpreterCall(output, block, instruction, address, next, executed);
+		}
+
+		output << "\tcpu.cycles += " << executed << ";\n";
+
+		if (instruction.opCode == 0x50)
+		{
+			EmitGoTo(output, instruction.payload, blocks);
+			return true;
+		}
+
+		// Z is bit 0, N is bit 3 of psw
+		//
+		switch (instruction.opCode)
+		{
+		case 0x51: output << "\tif (regs[PSW] & 0x1)\n"; break;
+		case 0x52: output << "\tif (!(regs[PSW] & 0x1))\n"; break;
+		case 0x53: output << "\tif (!(regs[PSW] & 0x9))\n"; break;
+		}
+
+		output << "\t{\n";
+		EmitGoTo(output, instruction.payload, blocks, "\t\t");
+		output << "\t}\n";
+		output << "\n";
+		EmitGoTo(output, next, blocks);
+		return true;
+	case 0x30://call
+		if (instruction.addrMode != IMMEDIATE_JMP && instruction.addrMode != IMMEDIATE_SYMBOL_VALUE_ABS_JMP)
+		{
+			return EmitInterpreterCall(output, block, instruction, address, next, executed);
+		}
+
+		output << "\tregs[SP] -= 2;\n";
+		output << "\tStore(cpu, regs[SP], " << Hex(next) << ");\n";
+		output << "\tcpu.cycles += " << executed << ";\n";
+		EmitGoTo(output, instruction.payload, blocks);
+		return true;
+	case 0x40://ret
+		output << "\tregs[PC] = READ_WORD(regs[SP]);\n";
+		output << "\tregs[SP] += 2;\n";
+		output << "\tcpu.cycles += " << executed << ";\n";
+		output << "\tDISPATCH()\n";
+		return true;
+	default:
+		return EmitInterpreterCall(output, block, instruction, address, next, executed);
+	}
+}
+
+// Interrupt handlers are entered through IVT, return addresses of call and int are
+// entered by ret and iret. Entry 0 holds IVT itself in images where it is not set.
+//
+std::map<uint16_t, BasicBlock*> Emulator::FindReachableBlocks(std::vector<uint16_t> pending)
+{
+	CpuState& cpu = *mState;
+
+	pending.push_back(cpu.entryPoint);
+
+	for (int entry = 0; entry < IVT_ENTRIES; entry++)
+	{
+		uint16_t handler = ReadWord(cpu, entry * 2);
+
+		if (handler != 0)
+		{
+			pending.push_back(handler);
+		}
+	}
+
+	std::map<uint16_t, BasicBlock*> blocks;
+
+	while (!pending.empty())
+	{
+		uint16_t address = pending.back();
+		pending.pop_back();
+
+		if (blocks.count(address) != 0)
+		{
+			continue;
+		}
+
+		BasicBlock* block = nullptr;
+
+		// Bytes which do not decode are left to interpreter, they may never be executed
+		//
+		try
+		{
+			block = TranslateBlock(address);
+		}
+		catch (EmulatorError&)
+		{
+		}
+
+		if (block == nullptr)
+		{
+			continue;
+		}
+
+		blocks[address] = block;
+
+		const DecodedInstruction& last = block->microOps.back();
+		bool isDirect = last.addrMode == IMMEDIATE_JMP || last.addrMode == IMMEDIATE_SYMBOL_VALUE_ABS_JMP;
+
+		switch (last.opCode)
+		{
+		case 0x53://jgt
+		case 0x52://jne
+		case 0x51://jeq
+		case 0x30://call
+			if (isDirect)
+			{
+				pending.push_back(last.payload);
+			}
+
+			pending.push_back(block->end);
+			break;
+		case 0x50://jmp
+			if (isDirect)
+			{
+				pending.push_back(last.payload);
+			}
+			break;
+		case 0x10://int
+			pending.push_back(block->end);
+			break;
+		default:
+			if (!EndsBasicBlock(last))
+			{
+				pending.push_back(block->end);
+			}
+			break;
+		}
+	}
+
+	return blocks;
+}
+
+void Emulator::WriteTranslation(const std::string& outputFile)
+{
+	CpuState& cpu = *mState;
+
+	std::map<uint16_t, BasicBlock*> blocks = FindReachableBlocks({});
+
+	// Blocks may overlap where a jump enters the middle of another block
+	//
+	std::map<uint16_t, std::string> instructions;
+	std::ostringstream code;
+
+	for (auto& entry : blocks)
+	{
+		const BasicBlock* block = entry.second;
+		uint16_t pc = block->start;
+		bool hasLeft = false;
+
+		code << "\n" << BlockLabel(block->start) << ":\n";
+		code << "\tcpu.coveredLengths[" << Hex(block->start) << "] = " << (uint16_t)(block->end - block->start) << ";\n";
+
+		for (size_t i = 0; i < block->microOps.size(); i++)
+		{
+			const DecodedInstruction& instruction = block->microOps[i];
+			uint16_t address = pc;
+			pc += instruction.size;
+
+			code << "\t// " << Hex(address) << "  " << Disassemble(instruction, pc) << "\n";
+
+			std::ostringstream constant;
+
+			constant << "const DecodedInstruction " << InstructionName(address) << " = { " << Hex(instruction.opCode) << ", " <<
+				(int)instruction.regD << ", " << (int)instruction.regS << ", " << (int)instruction.addrMode << ", " <<
+				Hex(instruction.payload) << ", " << (int)instruction.size << ", " << (instruction.touchesPSW ? "true" : "false") << " };\n";
+
+			instructions[address] = constant.str();
+
+			hasLeft = EmitInstruction(code, block, instruction, address, pc, i + 1, blocks);
+		}
+
+		// Block ended because it reached maximal length
+		//
+		if (!hasLeft)
+		{
+			code << "\tcpu.cycles += " << block->microOps.size() << ";\n";
+			EmitGoTo(code, block->end, blocks);
+		}
+	}
+
+	std::ofstream output(outputFile);
+
+	if (!output.is_open())
+	{
+		RaiseError("Error opening " + outputFile);
+	}
+
+	output << "// Written by aot from a linked image, build it together with emulator library\n";
+	output << "//\n";
+	output << translationHeader;
+
+	// Memory is embedded as its non-zero pages
+	//
+	std::vector<int> pages;
+
+	for (int page = 0; page < MEMORY_SIZE / 256; page++)
+	{
+		for (int i = 0; i < 256; i++)
+		{
+			if (cpu.memory[page * 256 + i] != 0)
+			{
+				pages.push_back(page);
+				break;
+			}
+		}
+	}
+
+	if (pages.empty())
+	{
+		pages.push_back(0);
+	}
+
+	output << "\nconst uint8_t memoryPageIndices[] = { ";
+
+	for (size_t i = 0; i < pages.size(); i++)
+	{
+		output << (i != 0 ? ", " : "") << pages[i];
+	}
+
+	output << " };\n\nconst uint8_t memoryPages[][256] =\n{\n";
+
+	for (int page : pages)
+	{
+		output << "\t{";
+
+		for (int i = 0; i < 256; i++)
+		{
+			output << (i % 16 == 0 ? "\n\t\t" : " ") << Hex((uint8_t)cpu.memory[page * 256 + i]).replace(2, 2, "") << ",";
+		}
+
+		output << "\n\t},\n";
+	}
+
+	output << "};\n\n";
+
+	for (auto& entry : instructions)
+	{
+		output << entry.second;
+	}
+
+	output << "\nconst NativeBlock nativeBlocks[] =\n{\n";
+
+	for (auto& entry : blocks)
+	{
+		output << "\t{ " << Hex(entry.first) << ", " << (uint16_t)(entry.second->end - entry.first) << " },\n";
+	}
+
+	output << "};\n\n";
+	output << "void RunTranslated(CpuState& cpu)\n";
+	output << "{\n";
+	output << "\tuint16_t regs[9];\n";
+	output << "\n";
+	output << "\tRELOAD_REGISTERS();\n";
+	output << "\n";
+	output << "dispatch:\n";
+	output << "\tswitch (regs[PC])\n";
+	output << "\t{\n";
+
+	for (auto& entry : blocks)
+	{
+		output << "\tcase " << Hex(entry.first) << ": goto " << BlockLabel(entry.first) << ";\n";
+	}
+
+	output << "\t}\n";
+	output << "\n";
+	output << "\tSPILL_REGISTERS();\n";
+	output << "\treturn;\n";
+	output << code.str();
+	output << "}\n";
+	output << "\n";
+	output << "int main(int argc, char* argv[])\n";
+	output << "{\n";
+	output << "\tEmulator emulator;\n";
+	output << "\n";
+	output << "\ttry\n";
+	output << "\t{\n";
+	output << "\t\tfor (size_t i = 0; i < sizeof(memoryPageIndices); i++)\n";
+	output << "\t\t{\n";
+	output << "\t\t\temulator.WriteMemory(memoryPageIndices[i] * 256, memoryPages[i], 256);\n";
+	output << "\t\t}\n";
+	output << "\n";
+	output << "\t\temulator.WriteRegister(PC, " << Hex(cpu.entryPoint) << ");\n";
+	output << "\t\temulator.SetNativeCode(RunTranslated, nativeBlocks, sizeof(nativeBlocks) / sizeof(NativeBlock));\n";
+	output << "\n";
+	output << "\t\tStopReason reason = emulator.RunNative();\n";
+	output << "\n";
+	output << "\t\temulator.OutputResult(std::cout);\n";
+	output << "\n";
+	output << "\t\treturn reason == STOP_HALT ? 0 : -1;\n";
+	output << "\t}\n";
+	output << "\tcatch (EmulatorError& error)\n";
+	output << "\t{\n";
+	output << "\t\tstd::cout << error.what();\n";
+	output << "\t\treturn -1;\n";
+	output << "\t}\n";
+	output << "}\n";
+
+	if (!output.good())
+	{
+		RaiseError("Error writing " + outputFile);
+	}
+}
\ No newline at end of file
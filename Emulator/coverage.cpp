@@ -0,0 +1,250 @@
+#include "emulator.h"
+#include "cpu.h"
+#include "disassembler.h"
+#include "error.h"
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <map>
+#include <iterator>
+#include <algorithm>
+#include <cstring>
+
+void FoldCoverage(CpuState& cpu);
+std::map<uint16_t, std::string> ReadSymbols(const std::string& symbolFile);
+std::string Percent(uint64_t count, uint64_t total);
+
+// Coverage file written by --coverage and merged by coverage tool
+//
+#define COVERAGE_MAGIC "SSCV"
+#define COVERAGE_VERSION 1
+
+// <magic> <version> <bitmap_size>, then bitmap
+//
+struct CoverageFileHeader
+{
+	char magic[4];
+	uint16_t version;
+	uint16_t bitmapSize;
+};
+
+bool IsCovered(const std::vector<uint8_t>& bitmap, uint16_t address)
+{
+	return (bitmap[address / 8] >> (address % 8)) & 1;
+}
+
+void Emulator::ReadCoverage(std::vector<uint8_t>& bitmap)
+{
+	CpuState& cpu = *mState;
+
+	FoldCoverage(cpu);
+
+	bitmap.resize(COVERAGE_BYTES, 0);
+
+	for (int i = 0; i < COVERAGE_BYTES; i++)
+	{
+		bitmap[i] |= cpu.coverage[i];
+	}
+}
+
+void Emulator::ReadCoverageFile(const std::string& inputFile, std::vector<uint8_t>& bitmap)
+{
+	std::ifstream input(inputFile, std::ios::binary | std::ios::in);
+
+	if (!input.is_open())
+	{
+		RaiseError("Error opening " + inputFile);
+	}
+
+	CoverageFileHeader header;
+
+	if (!input.read((char*)&header, sizeof(header)) || memcmp(header.magic, COVERAGE_MAGIC, 4) != 0)
+	{
+		RaiseError("Not a coverage file " + inputFile);
+	}
+
+	if (header.version != COVERAGE_VERSION || header.bitmapSize != COVERAGE_BYTES)
+	{
+		RaiseError("Unsupported coverage version " + std::to_string(header.version) + " in " + inputFile);
+	}
+
+	uint8_t covered[COVERAGE_BYTES];
+
+	if (!input.read((char*)covered, sizeof(covered)))
+	{
+		RaiseError("Truncated coverage " + inputFile);
+	}
+
+	bitmap.resize(COVERAGE_BYTES, 0);
+
+	for (int i = 0; i < COVERAGE_BYTES; i++)
+	{
+		bitmap[i] |= covered[i];
+	}
+}
+
+void Emulator::WriteCoverageFile(const std::string& outputFile, const std::vector<uint8_t>& bitmap)
+{
+	std::ofstream output(outputFile, std::ios::binary | std::ios::out);
+
+	if (!output.is_open())
+	{
+		RaiseError("Error opening " + outputFile);
+	}
+
+	CoverageFileHeader header;
+	memcpy(header.magic, COVERAGE_MAGIC, 4);
+	header.version = COVERAGE_VERSION;
+	header.bitmapSize = COVERAGE_BYTES;
+
+	std::vector<uint8_t> covered(bitmap);
+
+	covered.resize(COVERAGE_BYTES, 0);
+
+	output.write((const char*)&header, sizeof(header));
+	output.write((const char*)covered.data(), covered.size());
+
+	if (!output.good())
+	{
+		RaiseError("Error writing " + outputFile);
+	}
+}
+
+// Part of memory listed under one symbol
+//
+struct CoverageRange
+{
+	std::string name;
+	uint32_t start;
+	uint32_t end;
+};
+
+// Each symbol reaches to the next one, code before the first one is listed as ??
+//
+std::vector<CoverageRange> CoverageRanges(const std::map<uint16_t, std::string>& symbols)
+{
+	std::vector<CoverageRange> ranges;
+
+	if (symbols.empty() || symbols.begin()->first != 0)
+	{
+		uint32_t end = symbols.empty() ? MEMORY_SIZE : symbols.begin()->first;
+		ranges.push_back({ "??", 0, end });
+	}
+
+	for (auto symbol = symbols.begin(); symbol != symbols.end(); symbol++)
+	{
+		auto next = std::next(symbol);
+		uint32_t end = next == symbols.end() ? MEMORY_SIZE : next->first;
+		ranges.push_back({ symbol->second, symbol->first, end });
+	}
+
+	return ranges;
+}
+
+void Emulator::WriteCoverageReport(const std::string& outputFile, const std::vector<uint8_t>& bitmap, const std::string& symbolFile)
+{
+	std::ofstream output(outputFile);
+
+	if (!output.is_open() || !output.good())
+	{
+		RaiseError("Error opening " + outputFile);
+	}
+
+	std::vector<uint8_t> covered(bitmap);
+	covered.resize(COVERAGE_BYTES, 0);
+
+	// Code is what can be reached from entry point, IVT and executed instructions. Data,
+	// even where it would decode, and code reached only through pointers which never ran
+	// are not listed. Bitmap has all bytes of executed instructions, so instructions are
+	// decoded one after another through each covered run.
+	//
+	std::vector<uint16_t> executed;
+
+	for (uint32_t address = 0; address < MEMORY_SIZE;)
+	{
+		DecodedInstruction instruction;
+		bool isInstruction = false;
+
+		if (IsCovered(covered, address))
+		{
+			try
+			{
+				isInstruction = LoadInstruction(address, instruction);
+			}
+			catch (EmulatorError&)
+			{
+			}
+
+			executed.push_back(address);
+		}
+
+		address += isInstruction ? instruction.size : 1;
+	}
+
+	std::map<uint16_t, DecodedInstruction> code;
+
+	for (auto& entry : FindReachableBlocks(executed))
+	{
+		uint16_t address = entry.first;
+
+		// Operands of blocks are resolved, disassembly needs them as they are in memory
+		//
+		for (size_t i = 0; i < entry.second->microOps.size(); i++)
+		{
+			DecodedInstruction instruction;
+
+			LoadInstruction(address, instruction);
+			code.emplace(address, instruction);
+			address += instruction.size;
+		}
+	}
+
+	std::vector<CoverageRange> ranges = CoverageRanges(ReadSymbols(symbolFile));
+	std::vector<std::pair<uint64_t, uint64_t>> counts(ranges.size());
+	std::ostringstream listing;
+	uint64_t coveredTotal = 0;
+	uint64_t total = 0;
+
+	for (size_t i = 0; i < ranges.size(); i++)
+	{
+		for (auto next = code.lower_bound(ranges[i].start); next != code.end() && next->first < ranges[i].end; next++)
+		{
+			uint16_t address = next->first;
+			const DecodedInstruction& instruction = next->second;
+			bool isCovered = IsCovered(covered, address);
+
+			counts[i].first += isCovered;
+			counts[i].second++;
+
+			std::ostringstream locationText;
+			locationText << ranges[i].name << "+0x" << std::hex << std::uppercase << address - ranges[i].start;
+
+			listing << (isCovered ? "  + " : "  - ") << Hex(address) << "  " << std::left << std::setw(24) << locationText.str() << std::right;
+			listing << Disassemble(instruction, address + instruction.size) << "\n";
+		}
+
+		coveredTotal += counts[i].first;
+		total += counts[i].second;
+	}
+
+	output << "Covered instructions: " << coveredTotal << " of " << total << " (" << Percent(coveredTotal, total) << ")\n";
+	output << "\nFunctions:\n";
+	output << std::setw(10) << "covered" << std::setw(10) << "total" << std::setw(10) << "percent" << "  function\n";
+
+	for (size_t i = 0; i < ranges.size(); i++)
+	{
+		if (counts[i].second != 0)
+		{
+			output << std::setw(10) << counts[i].first << std::setw(10) << counts[i].second << std::setw(10) << Percent(counts[i].first, counts[i].second);
+			output << "  " << ranges[i].name << "\n";
+		}
+	}
+
+	output << "\nListing, + executed, - never executed:\n";
+	output << listing.str();
+
+	if (!output.good())
+	{
+		RaiseError("Error writing " + outputFile);
+	}
+}
\ No newline at end of file
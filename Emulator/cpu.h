@@ -0,0 +1,479 @@
+#ifndef _CPU_H
+#define _CPU_H
+
+#include <vector>
+#include <cstdint>
+#include <memory>
+#include <atomic>
+#include <exception>
+#include <chrono>
+#include "emulator.h"
+#include "devices.h"
+#include "trace.h"
+
+enum OperandType
+{
+	// Only for ldr/strinstructions
+	//
+	IMMEDIATE, // $<literal> -> value <literal>
+	IMMEDIATE_SYMBOL_VALUE, // $<symbol> -> address of symbol
+	MEMDIR_LITERAL, // <literal> -> MEM[literal]
+	MEMDIR_SYMBOL_ABS, // <symbol> -> MEM[address of symbol]
+	MEMDIR_SYMBOL_PCREL, // %<symbol> -> MEM[PC-address of symbol]
+	REGDIR, // <reg> -> value from register
+	REGIND, // [<reg>] -> MEM[value from reg]
+	REGIND_LITERAL, // [<reg> + <literal>] -> MEM[value from reg + literal]
+	REGIND_SYMBOL, // [<reg> + <symbol>] -> MEM[value from reg + address of symbol]
+
+
+	// Only for jump instructions
+	//
+	IMMEDIATE_JMP, // <literal> -> value <literal>
+	IMMEDIATE_SYMBOL_VALUE_ABS_JMP, // <symbol> -> address of symbol with absolute adressing
+	IMMEDIATE_SYMBOL_VALUE_PCREL_JMP, // %<symbol> -> address of symbol with pc relative adressing
+	MEMDIR_LITERAL_JMP, // *<literal> -> MEM[literal]
+	MEMDIR_SYMBOL_JMP, // *<symbol> -> MEM[address of symbol]
+	REGDIR_JMP, // *<reg> -> value from register
+	REGIND_JMP, // *[<reg>] -> MEM[value from reg]
+	REGIND_LITERAL_JMP, // *[<reg> + <literal>] -> MEM[value from reg + literal]
+	REGIND_SYMBOL_JMP, // *[<reg> + <symbol>] -> MEM[value from reg + address of symbol]
+};
+
+// Decoded form of one instruction. It is a plain value type, so decoding and
+// executing an instruction never allocates.
+//
+struct DecodedInstruction
+{
+	uint8_t opCode;
+
+	// High and low nibble of register descriptor byte
+	//
+	uint8_t regD;
+	uint8_t regS;
+
+	// OperandType of ldr/str/jump instructions
+	//
+	uint8_t addrMode;
+
+	// Literal/address from instruction payload, if instruction has one
+	//
+	uint16_t payload;
+
+	// Instruction length in bytes
+	//
+	uint8_t size;
+
+	// Instruction reads or overwrites whole PSW
+	//
+	bool touchesPSW;
+};
+
+// Straight-line run of instructions, ending with first instruction which can change PC.
+// PC relative operands of its micro-ops are already resolved to absolute addresses.
+//
+struct BasicBlock
+{
+	uint16_t start;
+
+	// Address right after last instruction of block
+	//
+	uint16_t end;
+
+	// Cleared when a store hits bytes of block
+	//
+	bool valid;
+
+	// Block changes nothing but flags, so once it jumps back to its own start it keeps
+	// doing so until an interrupt
+	//
+	bool idle;
+
+	// Number of times block was interpreted and its native code, used by --jit
+	//
+	uint32_t executions;
+	void (*compiled)();
+
+	// Runs, and runs which took branch at its end, since they were last added to counters
+	//
+	uint64_t runs;
+	uint64_t takenBranches;
+
+	// Micro-ops which ran when a store to code of block cut it short, set by the store
+	//
+	uint16_t executedMicroOps;
+
+	std::vector<DecodedInstruction> microOps;
+};
+
+// Byte is part of a decoded instruction, store to it invalidates caches
+//
+#define CODE_BYTE 1
+
+// Byte belongs to a memory mapped device register
+//
+#define DEVICE_BYTE 2
+
+enum FlagOperation { NO_FLAG_OPERATION, CMP_FLAGS, TEST_FLAGS, SHL_FLAGS, SHR_FLAGS };
+
+#define MEMORY_SIZE 65536
+
+// Start address of a processor which nobody has woken yet
+//
+#define PARKED_PROCESSOR 0x10000
+
+// Memory of one machine, shared by its processors. Aligned words which ldr, str, push and
+// pop access are single-copy atomic, with no ordering between processors. Interrupt sent
+// through ipi orders memory, handler sees everything sender stored before sending it, and
+// so does processor started by it. Instruction fetch, unaligned words, int, iret and code
+// compiled by --jit or aot access bytes one by one.
+//
+// Each processor caches code it has decoded and does not see stores of other processors
+// to that code. Code has to be in place before processors which run it are started,
+// changing it afterwards is not supported.
+//
+struct SharedMemory
+{
+	alignas(64) int8_t bytes[MEMORY_SIZE];
+
+	// Bit per IVT entry of each processor, set by other processors
+	//
+	std::atomic<uint16_t> interrupts[MAX_PROCESSORS];
+
+	// Where each parked processor starts, PARKED_PROCESSOR until another one wakes it
+	//
+	std::atomic<uint32_t> startAddresses[MAX_PROCESSORS];
+
+	// Processors started and still running. Parked ones give up once it drops to 0.
+	//
+	std::atomic<int> activeProcessors;
+};
+
+// Counters of GetStatistics(). Each processor has its own, starting on a cache line of its
+// own, so they are plain increments even while processors run on several host threads.
+//
+struct alignas(64) RunCounters
+{
+	// Executed instructions by opcode
+	//
+	uint64_t opCodes[256];
+
+	// Words of data read and written by instructions, their own code is not counted
+	//
+	uint64_t loads;
+	uint64_t stores;
+
+	// Conditional jumps only
+	//
+	uint64_t takenBranches;
+	uint64_t notTakenBranches;
+
+	// Device and injected interrupts, int instruction is not counted
+	//
+	uint64_t interrupts;
+
+	uint64_t decodeCacheHits;
+	uint64_t decodeCacheMisses;
+	uint64_t blockCacheHits;
+	uint64_t blockCacheMisses;
+	uint64_t blockInstructions;
+};
+
+// Everything processor and its caches need while running a program
+//
+struct CpuState
+{
+	// Bytes of shared memory
+	//
+	int8_t* memory;
+	std::shared_ptr<SharedMemory> shared;
+
+	// 0 unless processor is part of a machine with more than one
+	//
+	int processorIndex;
+	bool isMultiprocessor;
+
+	// Waits for ipi of another processor before it runs anything
+	//
+	bool isParked;
+
+	// [0-5] -> r0-r5
+	// [6] -> sp
+	// [7] -> pc
+	// [8] -> psw
+	//
+	uint16_t regs[9];
+
+	bool haltInstruction;
+
+	// Set when current run has to end, stopReason tells why
+	//
+	bool stop;
+	StopReason stopReason;
+
+	// Limits of current run. Both are checked only when cycles reach nextEventCycle.
+	//
+	uint64_t stopCycle;
+	uint64_t timeout;
+	uint64_t timeoutCheckCycle;
+	std::chrono::steady_clock::time_point deadline;
+
+	bool stopOnWrongOpCode;
+
+	bool breakpoints[65536];
+	uint32_t breakpointCount;
+
+	// Run does not stop at breakpoint it starts from
+	//
+	bool skipBreakpoint;
+
+	// Address of first instruction, IVT entry 0 in images without header
+	//
+	uint16_t entryPoint;
+
+	// Image was a snapshot, its registers are already in place
+	//
+	bool isSnapshotLoaded;
+
+	// Last flag setting instruction, its flags are not in PSW yet
+	//
+	FlagOperation pendingFlagOperation;
+	uint16_t flagOperandD;
+	uint16_t flagOperandS;
+	uint16_t flagResult;
+
+	// Decoded instructions indexed by address of their first byte, size 0 marks empty entry
+	//
+	DecodedInstruction decodeCache[65536];
+
+	// CODE_BYTE and DEVICE_BYTE flags, stores to bytes without flags skip all checks
+	//
+	uint8_t watchedBytes[65536];
+
+	// Stores to DEVICE_BYTE bytes are dispatched through page of their address
+	//
+	MemoryPage pages[MEMORY_PAGE_COUNT];
+
+	// Translated basic blocks indexed by address of their first instruction
+	//
+	BasicBlock* blockCache[65536];
+
+	// Invalidated blocks are freed at next block boundary, since one of them may still be running
+	//
+	std::vector<BasicBlock*> retiredBlocks;
+
+	RunCounters counters;
+
+	// Set by EnableStatistics(), Run() counts instructions one by one only then. Block based
+	// runs count whole blocks, which costs little enough to do always.
+	//
+	bool isCountingInstructions;
+
+	// Length of code run from each address by the last instruction or block which started
+	// there, 0 where nothing ran. It costs one store per block, so coverage stays on. Lengths
+	// are folded into coverage when code there changes and when coverage is read.
+	//
+	uint8_t coveredLengths[65536];
+	uint8_t coverage[COVERAGE_BYTES];
+
+	// Some lengths are of whole blocks, per instruction runs must not overwrite them
+	//
+	bool hasBlockCoverage;
+
+	// Executed instructions per address, allocated by EnableProfile() only
+	//
+	std::vector<uint64_t> profileCounts;
+
+	// Last executed instructions, nullptr unless EnableTrace() was called
+	//
+	TraceRing* trace;
+
+	// Cycles of idle loops which were skipped instead of executed
+	//
+	uint64_t idleCycles;
+
+	// Host time spent in decoding, for statistics
+	//
+	uint64_t decodeNanoseconds;
+
+	// Code size of translated block at each address, 0 where there is none. Empty until
+	// SetNativeCode() is called.
+	//
+	NativeCode nativeCode;
+	std::vector<uint16_t> nativeBlockSizes;
+
+	// Virtual time, one cycle per instruction. Devices are looked at only once cycles
+	// reach nextEventCycle.
+	//
+	uint64_t cycles;
+	uint64_t nextEventCycle;
+
+	// Bit per IVT entry of device interrupts waiting for delivery
+	//
+	uint16_t pendingInterrupts;
+
+	EventScheduler scheduler;
+	Terminal terminal;
+	Timer timer;
+	Semihost semihost;
+
+	// Error raised while compiled code was running, it cannot unwind through native code
+	//
+	std::exception_ptr jitError;
+};
+
+class Halt
+{
+public:
+	static void Execute(CpuState& cpu, const DecodedInstruction& instruction);
+};
+
+class Int
+{
+public:
+	static void Execute(CpuState& cpu, const DecodedInstruction& instruction);
+};
+
+class Iret
+{
+public:
+	static void Execute(CpuState& cpu, const DecodedInstruction& instruction);
+};
+
+class Call
+{
+public:
+	static void Execute(CpuState& cpu, const DecodedInstruction& instruction);
+};
+
+class Ret
+{
+public:
+	static void Execute(CpuState& cpu, const DecodedInstruction& instruction);
+};
+
+class Jmp
+{
+public:
+	static void Execute(CpuState& cpu, const DecodedInstruction& instruction);
+};
+
+class Jeq
+{
+public:
+	static void Execute(CpuState& cpu, const DecodedInstruction& instruction);
+};
+
+class Jne
+{
+public:
+	static void Execute(CpuState& cpu, const DecodedInstruction& instruction);
+};
+
+class Jgt
+{
+public:
+	static void Execute(CpuState& cpu, const DecodedInstruction& instruction);
+};
+
+class Push
+{
+public:
+	static void Execute(CpuState& cpu, const DecodedInstruction& instruction);
+};
+
+class Pop
+{
+public:
+	static void Execute(CpuState& cpu, const DecodedInstruction& instruction);
+};
+
+class Xchg
+{
+public:
+	static void Execute(CpuState& cpu, const DecodedInstruction& instruction);
+};
+
+class Add
+{
+public:
+	static void Execute(CpuState& cpu, const DecodedInstruction& instruction);
+};
+
+class Sub
+{
+public:
+	static void Execute(CpuState& cpu, const DecodedInstruction& instruction);
+};
+
+class Mul
+{
+public:
+	static void Execute(CpuState& cpu, const DecodedInstruction& instruction);
+};
+
+class Div
+{
+public:
+	static void Execute(CpuState& cpu, const DecodedInstruction& instruction);
+};
+
+class Cmp
+{
+public:
+	static void Execute(CpuState& cpu, const DecodedInstruction& instruction);
+};
+
+class Not
+{
+public:
+	static void Execute(CpuState& cpu, const DecodedInstruction& instruction);
+};
+
+class And
+{
+public:
+	static void Execute(CpuState& cpu, const DecodedInstruction& instruction);
+};
+
+class Or
+{
+public:
+	static void Execute(CpuState& cpu, const DecodedInstruction& instruction);
+};
+
+class Xor
+{
+public:
+	static void Execute(CpuState& cpu, const DecodedInstruction& instruction);
+};
+
+class Test
+{
+public:
+	static void Execute(CpuState& cpu, const DecodedInstruction& instruction);
+};
+
+class Shl
+{
+public:
+	static void Execute(CpuState& cpu, const DecodedInstruction& instruction);
+};
+
+class Shr
+{
+public:
+	static void Execute(CpuState& cpu, const DecodedInstruction& instruction);
+};
+
+class Ldr
+{
+public:
+	static void Execute(CpuState& cpu, const DecodedInstruction& instruction);
+};
+
+class Str
+{
+public:
+	static void Execute(CpuState& cpu, const DecodedInstruction& instruction);
+};
+#endif
\ No newline at end of file
@@ -0,0 +1,525 @@
+#include "devices.h"
+#include "cpu.h"
+#include "error.h"
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <mutex>
+#include <iostream>
+
+#if defined(__unix__)
+#include <unistd.h>
+#endif
+
+// Timer periods selected by tim_cfg, in milliseconds
+//
+const uint64_t timerPeriods[8] = { 500, 1000, 1500, 2000, 5000, 10000, 30000, 60000 };
+
+void DeliverPendingInterrupts(CpuState& cpu);
+void WriteWord(CpuState& cpu, uint16_t address, uint16_t value);
+void WriteTopPage(CpuState& cpu, uint16_t address, uint16_t value);
+void SendInterProcessorInterrupt(CpuState& cpu, uint8_t processor);
+uint16_t ReadDeviceRegister(CpuState& cpu, uint16_t address);
+
+// Bytes typed on host, filled by input thread. It is never freed, since input thread
+// may still be blocked in read when program exits.
+//
+RingBuffer* hostInput = nullptr;
+std::atomic<bool> hostInputClaimed(false);
+std::once_flag hostInputStarted;
+
+void ReadHostInput()
+{
+	for (;;)
+	{
+		uint8_t buffer[256];
+
+#if defined(__unix__)
+		ssize_t count = read(STDIN_FILENO, buffer, sizeof(buffer));
+#else
+		int character = std::getchar();
+		int count = character == EOF ? 0 : 1;
+		buffer[0] = character;
+#endif
+
+		if (count <= 0)
+		{
+			return;
+		}
+
+		for (int i = 0; i < count; i++)
+		{
+			while (!hostInput->Push(buffer[i]))
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+	}
+}
+
+void WriteHostOutput(Terminal* terminal)
+{
+	uint8_t buffer[TERMINAL_BUFFER_SIZE];
+
+	for (;;)
+	{
+		// Stop is read before draining, everything queued before it still gets written
+		//
+		bool stop = terminal->stopWriter.load(std::memory_order_acquire);
+		size_t count = terminal->output.Pop(buffer, sizeof(buffer));
+
+		if (count != 0)
+		{
+			terminal->hostOutput->write((const char*)buffer, count);
+			terminal->hostOutput->flush();
+		}
+		else if (stop)
+		{
+			return;
+		}
+		else
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}
+}
+
+EventScheduler::EventScheduler()
+{
+	for (int i = 0; i < DEVICE_COUNT; i++)
+	{
+		mGeneration[i] = 0;
+	}
+}
+
+void EventScheduler::Schedule(DeviceId device, uint64_t cycle)
+{
+	mGeneration[device]++;
+	mEvents.push({ cycle, device, mGeneration[device] });
+	DropStaleEvents();
+}
+
+void EventScheduler::Cancel(DeviceId device)
+{
+	mGeneration[device]++;
+	DropStaleEvents();
+}
+
+uint64_t EventScheduler::NextEventCycle() const
+{
+	return mEvents.empty() ? NO_EVENT : mEvents.top().cycle;
+}
+
+bool EventScheduler::PopDueEvent(uint64_t cycle, DeviceId& device)
+{
+	if (mEvents.empty() || mEvents.top().cycle > cycle)
+	{
+		return false;
+	}
+
+	device = mEvents.top().device;
+	mEvents.pop();
+	DropStaleEvents();
+
+	return true;
+}
+
+void EventScheduler::DropStaleEvents()
+{
+	while (!mEvents.empty() && mEvents.top().generation != mGeneration[mEvents.top().device])
+	{
+		mEvents.pop();
+	}
+}
+
+void InitDevices(CpuState& cpu)
+{
+	MapDeviceRegisters(cpu, TERM_OUT, 1, WriteTopPage);
+	MapDeviceRegisters(cpu, TERM_CFG, 1, WriteTopPage);
+	MapDeviceRegisters(cpu, TIM_CFG, 2, WriteTopPage);
+	MapDeviceRegisters(cpu, TIM_PERIOD, 2, WriteTopPage);
+
+	cpu.terminal.hostOutput = &std::cout;
+}
+
+void MapDeviceRegisters(CpuState& cpu, uint16_t address, uint16_t size, PageWriteHandler handler)
+{
+	for (uint32_t i = address; i < (uint32_t)address + size; i++)
+	{
+		MemoryPage& page = cpu.pages[i / MEMORY_PAGE_SIZE];
+
+		if (page.write != nullptr && page.write != handler)
+		{
+			RaiseError("Device registers at " + std::to_string(i) + " are on a page of another device");
+		}
+
+		page.write = handler;
+		cpu.watchedBytes[i] |= DEVICE_BYTE;
+	}
+}
+
+void InitInterProcessorInterrupts(CpuState& cpu)
+{
+	if (cpu.isMultiprocessor)
+	{
+		return;
+	}
+
+	cpu.isMultiprocessor = true;
+
+	MapDeviceRegisters(cpu, IPI, 1, WriteTopPage);
+	cpu.scheduler.Schedule(IPI_DEVICE, cpu.cycles + IPI_POLL_CYCLES);
+}
+
+// Release pairs with acquire of receiver, so that handler sees what sender has stored.
+// Parked processor is started instead. It counts as active before sender can stop, so
+// that processors still parked do not give up in between.
+//
+void SendInterProcessorInterrupt(CpuState& cpu, uint8_t processor)
+{
+	if (processor >= MAX_PROCESSORS)
+	{
+		return;
+	}
+
+	SharedMemory& shared = *cpu.shared;
+	uint32_t parked = PARKED_PROCESSOR;
+
+	if (shared.startAddresses[processor].compare_exchange_strong(parked, ReadDeviceRegister(cpu, CPU_START)))
+	{
+		shared.activeProcessors++;
+		return;
+	}
+
+	shared.interrupts[processor].fetch_or(1 << IPI_INTERRUPT, std::memory_order_release);
+}
+
+void ReceiveInterProcessorInterrupts(CpuState& cpu)
+{
+	cpu.pendingInterrupts |= cpu.shared->interrupts[cpu.processorIndex].exchange(0, std::memory_order_acquire);
+	cpu.scheduler.Schedule(IPI_DEVICE, cpu.cycles + IPI_POLL_CYCLES);
+}
+
+bool IsTerminalPolled(const Terminal& terminal)
+{
+	return terminal.isInputConnected && (terminal.ownsInput || terminal.isReplaying);
+}
+
+void ResetDevices(CpuState& cpu)
+{
+	StartTimer(cpu, 0);
+
+	cpu.pendingInterrupts = 0;
+
+	if (cpu.isMultiprocessor)
+	{
+		cpu.scheduler.Schedule(IPI_DEVICE, cpu.cycles + IPI_POLL_CYCLES);
+	}
+
+	if (IsTerminalPolled(cpu.terminal))
+	{
+		cpu.scheduler.Schedule(TERMINAL_DEVICE, cpu.cycles + TERMINAL_POLL_CYCLES);
+	}
+}
+
+// <magic> <version>, then <cycle> <interrupt> <byte> of each event
+//
+void StartInputRecording(CpuState& cpu, const std::string& logFile)
+{
+	Terminal& terminal = cpu.terminal;
+
+	terminal.recording.open(logFile, std::ios::binary | std::ios::out);
+
+	if (!terminal.recording.is_open() || !terminal.recording.good())
+	{
+		RaiseError("Error opening " + logFile);
+	}
+
+	uint16_t version = INPUT_LOG_VERSION;
+
+	terminal.recording.write(INPUT_LOG_MAGIC, 4);
+	terminal.recording.write((char*)&version, sizeof(uint16_t));
+	terminal.recording.flush();
+}
+
+void StartInputReplay(CpuState& cpu, const std::string& logFile)
+{
+	Terminal& terminal = cpu.terminal;
+
+	std::ifstream input(logFile, std::ios::binary | std::ios::in);
+
+	if (!input.is_open())
+	{
+		RaiseError("Error opening " + logFile);
+	}
+
+	char magic[4] = {};
+	uint16_t version = 0;
+
+	input.read(magic, 4);
+	input.read((char*)&version, sizeof(uint16_t));
+
+	if (!input || memcmp(magic, INPUT_LOG_MAGIC, 4) != 0)
+	{
+		RaiseError("Not an input log " + logFile);
+	}
+
+	if (version != INPUT_LOG_VERSION)
+	{
+		RaiseError("Unsupported input log version " + std::to_string(version) + " in " + logFile);
+	}
+
+	InputEvent event;
+
+	while (input.read((char*)&event.cycle, sizeof(uint64_t)) &&
+		input.read((char*)&event.interrupt, sizeof(uint8_t)) &&
+		input.read((char*)&event.byte, sizeof(uint8_t)))
+	{
+		terminal.replay.push_back(event);
+	}
+
+	terminal.isReplaying = true;
+	terminal.nextReplayed = 0;
+
+	if (IsTerminalPolled(terminal))
+	{
+		cpu.scheduler.Schedule(TERMINAL_DEVICE, cpu.cycles + TERMINAL_POLL_CYCLES);
+		cpu.nextEventCycle = 0;
+	}
+}
+
+// Logged event which is due now. Polls happen at the same cycles in every run of the
+// same program and mode, so an event which was missed means the run went another way.
+//
+bool NextReplayedInput(CpuState& cpu, uint8_t& byte)
+{
+	Terminal& terminal = cpu.terminal;
+
+	if (terminal.nextReplayed == terminal.replay.size() || terminal.replay[terminal.nextReplayed].cycle > cpu.cycles)
+	{
+		return false;
+	}
+
+	if (terminal.replay[terminal.nextReplayed].cycle < cpu.cycles)
+	{
+		RaiseError("Replay does not match program at cycle " + std::to_string(cpu.cycles));
+	}
+
+	byte = terminal.replay[terminal.nextReplayed++].byte;
+
+	return true;
+}
+
+void LogInput(CpuState& cpu, uint8_t byte)
+{
+	InputEvent event = { cpu.cycles, TERMINAL_INTERRUPT, byte };
+
+	// Log stays usable even if program is killed while it hangs
+	//
+	cpu.terminal.recording.write((char*)&event.cycle, sizeof(uint64_t));
+	cpu.terminal.recording.write((char*)&event.interrupt, sizeof(uint8_t));
+	cpu.terminal.recording.write((char*)&event.byte, sizeof(uint8_t));
+	cpu.terminal.recording.flush();
+}
+
+void DisconnectTerminal(CpuState& cpu)
+{
+	Terminal& terminal = cpu.terminal;
+
+	terminal.isDisconnected = true;
+
+	// Next processor may take host input
+	//
+	if (terminal.ownsInput)
+	{
+		terminal.ownsInput = false;
+		hostInputClaimed = false;
+	}
+}
+
+// Guest connects once it wants input, so that programs which never read term_in leave
+// host stdin alone. Polls start from the cycle of connect, replay repeats them exactly.
+//
+void ConnectTerminalInput(CpuState& cpu, bool connect)
+{
+	Terminal& terminal = cpu.terminal;
+
+	if (connect == terminal.isInputConnected)
+	{
+		return;
+	}
+
+	terminal.isInputConnected = connect;
+
+	if (!connect)
+	{
+		cpu.scheduler.Cancel(TERMINAL_DEVICE);
+		return;
+	}
+
+	if (!terminal.isReplaying && !terminal.isDisconnected && !terminal.ownsInput && !hostInputClaimed.exchange(true))
+	{
+		terminal.ownsInput = true;
+	}
+
+	if (IsTerminalPolled(terminal))
+	{
+		cpu.scheduler.Schedule(TERMINAL_DEVICE, cpu.cycles + TERMINAL_POLL_CYCLES);
+		cpu.nextEventCycle = 0;
+	}
+}
+
+void WriteTerminal(CpuState& cpu, uint8_t byte)
+{
+	Terminal& terminal = cpu.terminal;
+
+	if (terminal.isDisconnected)
+	{
+		return;
+	}
+
+	if (!terminal.writer.joinable())
+	{
+		terminal.stopWriter = false;
+		terminal.writer = std::thread(WriteHostOutput, &terminal);
+	}
+
+	// Only when host cannot keep up
+	//
+	while (!terminal.output.Push(byte))
+	{
+		std::this_thread::yield();
+	}
+}
+
+void FlushTerminal(CpuState& cpu)
+{
+	Terminal& terminal = cpu.terminal;
+
+	if (terminal.writer.joinable())
+	{
+		terminal.stopWriter.store(true, std::memory_order_release);
+		terminal.writer.join();
+	}
+}
+
+// Next typed byte goes to term_in once guest got the previous one
+//
+void PollTerminal(CpuState& cpu)
+{
+	Terminal& terminal = cpu.terminal;
+	uint8_t byte;
+	bool received = false;
+	bool waiting = (cpu.pendingInterrupts & (1 << TERMINAL_INTERRUPT)) != 0;
+
+	if (!waiting && terminal.isReplaying)
+	{
+		received = NextReplayedInput(cpu, byte);
+	}
+	else if (!waiting && terminal.ownsInput)
+	{
+		// Input thread starts with first poll, so that replayed runs and programs which
+		// never connected input do not read host stdin
+		//
+		std::call_once(hostInputStarted, []()
+		{
+			hostInput = new RingBuffer();
+			std::thread(ReadHostInput).detach();
+		});
+
+		received = hostInput->Pop(&byte, 1) == 1;
+	}
+
+	if (received)
+	{
+		if (terminal.recording.is_open())
+		{
+			LogInput(cpu, byte);
+		}
+
+		WriteWord(cpu, TERM_IN, byte);
+		cpu.pendingInterrupts |= 1 << TERMINAL_INTERRUPT;
+	}
+
+	cpu.scheduler.Schedule(TERMINAL_DEVICE, cpu.cycles + TERMINAL_POLL_CYCLES);
+}
+
+uint16_t ReadDeviceRegister(CpuState& cpu, uint16_t address)
+{
+	return ((uint16_t)cpu.memory[address] & 0x00FF) | (((uint16_t)cpu.memory[address + 1] << 8) & 0xFF00);
+}
+
+// Timer, terminal and ipi share the top page
+//
+void WriteTopPage(CpuState& cpu, uint16_t address, uint16_t value)
+{
+	if (address == TERM_OUT)
+	{
+		WriteTerminal(cpu, value & 0x00FF);
+	}
+	else if (address == TERM_CFG)
+	{
+		ConnectTerminalInput(cpu, (value & 1) != 0);
+	}
+	else if (address == IPI)
+	{
+		SendInterProcessorInterrupt(cpu, value & 0x00FF);
+	}
+	else if (address == TIM_CFG || address == TIM_CFG + 1)
+	{
+		StartTimer(cpu, timerPeriods[ReadDeviceRegister(cpu, TIM_CFG) % 8] * CYCLES_PER_MS);
+	}
+	else if (address == TIM_PERIOD || address == TIM_PERIOD + 1)
+	{
+		StartTimer(cpu, ReadDeviceRegister(cpu, TIM_PERIOD));
+	}
+}
+
+void StartTimer(CpuState& cpu, uint64_t period)
+{
+	cpu.timer.period = period;
+
+	if (period == 0)
+	{
+		cpu.timer.nextCycle = NO_EVENT;
+		cpu.scheduler.Cancel(TIMER_DEVICE);
+	}
+	else
+	{
+		cpu.timer.nextCycle = cpu.cycles + period;
+		cpu.scheduler.Schedule(TIMER_DEVICE, cpu.timer.nextCycle);
+	}
+
+	cpu.nextEventCycle = 0;
+}
+
+void ProcessDeviceEvents(CpuState& cpu)
+{
+	DeviceId device;
+
+	while (cpu.scheduler.PopDueEvent(cpu.cycles, device))
+	{
+		switch (device)
+		{
+		case TIMER_DEVICE:
+			cpu.pendingInterrupts |= 1 << TIMER_INTERRUPT;
+			cpu.timer.nextCycle += cpu.timer.period;
+			cpu.scheduler.Schedule(TIMER_DEVICE, cpu.timer.nextCycle);
+			break;
+		case TERMINAL_DEVICE:
+			PollTerminal(cpu);
+			break;
+		case IPI_DEVICE:
+			ReceiveInterProcessorInterrupts(cpu);
+			break;
+		case DEVICE_COUNT:
+			break;
+		}
+	}
+
+	DeliverPendingInterrupts(cpu);
+
+	// Masked interrupts are retried after every instruction until PSW lets them in
+	//
+	cpu.nextEventCycle = cpu.pendingInterrupts != 0 ? cpu.cycles + 1 : cpu.scheduler.NextEventCycle();
+}
\ No newline at end of file
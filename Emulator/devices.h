@@ -0,0 +1,323 @@
+#ifndef _DEVICES_H
+#define _DEVICES_H
+
+#include <cstdint>
+#include <algorithm>
+#include <queue>
+#include <vector>
+#include <functional>
+#include <atomic>
+#include <thread>
+#include <fstream>
+#include <string>
+#include <ostream>
+#include <cstdio>
+
+struct CpuState;
+
+// Memory mapped device registers. Rest of the top page is plain memory, programs
+// keep their stack there.
+//
+// term_out -> byte written is printed, term_in -> last byte typed on host
+// term_cfg -> 1 connects host input, 0 disconnects it. Host stdin is not read before then.
+// tim_cfg -> period from timerPeriods, tim_period -> period in cycles, 0 stops timer
+//
+#define TERM_OUT 0xFF00
+#define TERM_IN 0xFF02
+#define TERM_CFG 0xFF04
+#define TIM_CFG 0xFF10
+#define TIM_PERIOD 0xFF12
+
+// IVT entries of device interrupts. Interrupt whose entry is 0 is dropped.
+//
+#define TIMER_INTERRUPT 2
+#define TERMINAL_INTERRUPT 3
+
+#define IVT_ENTRIES 8
+
+// With semihosting enabled, int of this entry is a request to host instead of interrupt
+//
+#define SEMIHOST_INTERRUPT 7
+
+// Machine with more than one processor. Processors share memory, every other part of
+// state is their own, timer and terminal too. Processor 0 starts at entry point, every
+// other one is parked until a processor sends it ipi. It then starts at the address which
+// was in cpu_start when ipi was stored. Each processor starts with its index in r0.
+//
+// ipi -> processor whose index is written to low byte gets IPI_INTERRUPT, or starts if parked
+// cpu_start -> start address of processors woken by ipi
+//
+#define IPI 0xFF20
+#define CPU_START 0xFF22
+#define MAX_PROCESSORS 8
+#define IPI_INTERRUPT 6
+
+// Interrupts sent by other processors are looked at this often
+//
+#define IPI_POLL_CYCLES 100
+
+// Memory is divided into pages. A page holding device registers has a write handler,
+// every other page is plain memory. Registers stay backed by memory, devices keep their
+// bytes current, so loads never leave the RAM path.
+//
+#define MEMORY_PAGE_SIZE 256
+#define MEMORY_PAGE_COUNT 256
+
+// Value holds bytes stored from address on. Byte registers should take it from there,
+// since processors of one machine share registers and another one may store at once.
+//
+typedef void (*PageWriteHandler)(CpuState& cpu, uint16_t address, uint16_t value);
+
+struct MemoryPage
+{
+	// nullptr for plain memory
+	//
+	PageWriteHandler write;
+};
+
+// Virtual time, every instruction is one cycle of 1 MHz processor clock
+//
+#define CYCLES_PER_MS 1000
+
+#define NO_EVENT UINT64_MAX
+
+// Host input is looked at once per virtual millisecond
+//
+#define TERMINAL_POLL_CYCLES 1000
+
+#define TERMINAL_BUFFER_SIZE 4096
+
+// Log of terminal input written by --record and read by --replay
+//
+#define INPUT_LOG_MAGIC "SSRR"
+#define INPUT_LOG_VERSION 1
+
+enum DeviceId { TIMER_DEVICE, TERMINAL_DEVICE, IPI_DEVICE, DEVICE_COUNT };
+
+// Lock-free queue of bytes between exactly one producer and one consumer thread.
+// Each index is written by one side only.
+//
+class RingBuffer
+{
+public:
+	RingBuffer() : mHead(0), mTail(0) {}
+
+	// False if buffer is full
+	//
+	bool Push(uint8_t byte)
+	{
+		size_t tail = mTail.load(std::memory_order_relaxed);
+
+		if (tail - mHead.load(std::memory_order_acquire) == TERMINAL_BUFFER_SIZE)
+		{
+			return false;
+		}
+
+		mBytes[tail % TERMINAL_BUFFER_SIZE] = byte;
+		mTail.store(tail + 1, std::memory_order_release);
+
+		return true;
+	}
+
+	// Moves up to size bytes to output, returns how many
+	//
+	size_t Pop(uint8_t* output, size_t size)
+	{
+		size_t head = mHead.load(std::memory_order_relaxed);
+		size_t count = std::min(size, mTail.load(std::memory_order_acquire) - head);
+
+		for (size_t i = 0; i < count; i++)
+		{
+			output[i] = mBytes[(head + i) % TERMINAL_BUFFER_SIZE];
+		}
+
+		mHead.store(head + count, std::memory_order_release);
+
+		return count;
+	}
+private:
+	uint8_t mBytes[TERMINAL_BUFFER_SIZE];
+
+	// Consumer and producer side on separate cache lines
+	//
+	alignas(64) std::atomic<size_t> mHead;
+	alignas(64) std::atomic<size_t> mTail;
+};
+
+// Device events in a min-heap ordered by virtual cycle. Rescheduling a device only
+// bumps its generation, stale events are dropped once they reach the top.
+//
+class EventScheduler
+{
+public:
+	EventScheduler();
+
+	// Replaces pending event of device
+	//
+	void Schedule(DeviceId device, uint64_t cycle);
+	void Cancel(DeviceId device);
+
+	// NO_EVENT if nothing is scheduled
+	//
+	uint64_t NextEventCycle() const;
+
+	// Removes earliest event if it is due at cycle
+	//
+	bool PopDueEvent(uint64_t cycle, DeviceId& device);
+private:
+	struct Event
+	{
+		uint64_t cycle;
+		DeviceId device;
+		uint32_t generation;
+
+		bool operator>(const Event& other) const
+		{
+			return cycle != other.cycle ? cycle > other.cycle : device > other.device;
+		}
+	};
+
+	void DropStaleEvents();
+
+	std::priority_queue<Event, std::vector<Event>, std::greater<Event>> mEvents;
+	uint32_t mGeneration[DEVICE_COUNT];
+};
+
+// Input byte given to guest together with terminal interrupt. Timer needs no log, it
+// runs on virtual cycles and repeats exactly on its own.
+//
+struct InputEvent
+{
+	uint64_t cycle;
+	uint8_t interrupt;
+	uint8_t byte;
+};
+
+// Guest output is queued here and written to host output in batches by writer thread,
+// so that processor never waits for a write
+//
+struct Terminal
+{
+	RingBuffer output;
+	std::thread writer;
+	std::atomic<bool> stopWriter;
+
+	// std::cout, unless emulator was given a stream of its own. Only writer thread
+	// writes to it while processor runs.
+	//
+	std::ostream* hostOutput;
+
+	// Host stdin goes to the first processor which connects input
+	//
+	bool ownsInput;
+
+	// Set by guest through term_cfg, no input is given before
+	//
+	bool isInputConnected;
+
+	// Not connected to host at all
+	//
+	bool isDisconnected;
+
+	// Every byte given to guest is logged while recording. Replay takes bytes from
+	// log instead of host and gives them at the same cycles.
+	//
+	std::ofstream recording;
+	bool isReplaying;
+	std::vector<InputEvent> replay;
+	size_t nextReplayed;
+};
+
+struct Timer
+{
+	// 0 while timer is stopped
+	//
+	uint64_t period;
+	uint64_t nextCycle;
+};
+
+// Requests of semihosting. Guest puts operation and arguments in a block of words, which
+// r1 points to, and does int of SEMIHOST_INTERRUPT. Result is returned in r0, 0xFFFF if
+// request failed.
+//
+// write -> handle, buffer, length; returns bytes written
+// read -> handle, buffer, length; returns bytes read
+// open -> zero terminated path, mode from SemihostOpenMode; returns handle
+// close -> handle
+// time -> returns 0, host time in milliseconds since epoch is put in the three words
+//         after operation, lowest first
+// exit -> exit code; stops processor
+//
+enum SemihostOperation { SEMIHOST_WRITE = 1, SEMIHOST_READ, SEMIHOST_OPEN, SEMIHOST_CLOSE, SEMIHOST_TIME, SEMIHOST_EXIT };
+
+enum SemihostOpenMode { SEMIHOST_OPEN_READ, SEMIHOST_OPEN_WRITE, SEMIHOST_OPEN_APPEND };
+
+// Handle 1 is output of terminal, host stdout unless emulator was given another stream.
+// Handle 2 is host stderr, files opened by guest come after them.
+//
+#define SEMIHOST_STDOUT 1
+#define SEMIHOST_STDERR 2
+#define SEMIHOST_FIRST_FILE 3
+
+#define SEMIHOST_ERROR 0xFFFF
+
+struct Semihost
+{
+	bool isEnabled;
+
+	// Files opened by guest, nullptr once closed. Handle is index + SEMIHOST_FIRST_FILE.
+	//
+	std::vector<FILE*> files;
+
+	uint16_t exitCode;
+};
+
+// Maps registers of timer and terminal to the top page
+//
+void InitDevices(CpuState& cpu);
+
+// Marks bytes of registers, so that stores to them reach handler of their page. Other
+// bytes of the page stay plain memory. One page has only one handler.
+//
+void MapDeviceRegisters(CpuState& cpu, uint16_t address, uint16_t size, PageWriteHandler handler);
+
+// Timer stopped, pending interrupts dropped, terminal polled from cycle 0 again
+//
+void ResetDevices(CpuState& cpu);
+
+void StartTimer(CpuState& cpu, uint64_t period);
+
+void DisconnectTerminal(CpuState& cpu);
+
+// Starts or stops polling of host input, or of replayed log
+//
+void ConnectTerminalInput(CpuState& cpu, bool connect);
+
+// Maps ipi register and starts looking for interrupts from other processors
+//
+void InitInterProcessorInterrupts(CpuState& cpu);
+
+// Handles request which guest made by int of SEMIHOST_INTERRUPT
+//
+void HandleSemihostRequest(CpuState& cpu);
+
+// Closes files which guest left open
+//
+void CloseSemihostFiles(CpuState& cpu);
+
+// Waits until all queued output is on host output
+//
+void FlushTerminal(CpuState& cpu);
+
+// Replay gives input at the same cycles only if program runs in the same mode as
+// when it was recorded
+//
+void StartInputRecording(CpuState& cpu, const std::string& logFile);
+void StartInputReplay(CpuState& cpu, const std::string& logFile);
+
+// Handles events which are due and delivers pending interrupts, then sets cycle of
+// next check. Run loops call it only once cycle counter reaches that value.
+//
+void ProcessDeviceEvents(CpuState& cpu);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,131 @@
+#include "disassembler.h"
+#include <sstream>
+#include <iomanip>
+
+std::string RegisterName(uint8_t reg)
+{
+	return reg == PSW ? "psw" : "r" + std::to_string(reg);
+}
+
+std::string Hex(uint16_t value)
+{
+	std::ostringstream text;
+	text << "0x" << std::hex << std::uppercase << std::setw(4) << std::setfill('0') << value;
+
+	return text.str();
+}
+
+std::string OperandText(const DecodedInstruction& instruction, uint16_t next)
+{
+	std::string reg = RegisterName(instruction.regS);
+	std::string payload = Hex(instruction.payload);
+
+	switch (instruction.addrMode)
+	{
+	case IMMEDIATE:
+	case IMMEDIATE_SYMBOL_VALUE:
+		return "$" + payload;
+	case MEMDIR_LITERAL:
+	case MEMDIR_SYMBOL_ABS:
+	case IMMEDIATE_JMP:
+	case IMMEDIATE_SYMBOL_VALUE_ABS_JMP:
+		return payload;
+	case MEMDIR_SYMBOL_PCREL:
+	case IMMEDIATE_SYMBOL_VALUE_PCREL_JMP:
+		return "%" + Hex(instruction.payload + next);
+	case REGDIR:
+		return reg;
+	case REGIND:
+		return "[" + reg + "]";
+	case REGIND_LITERAL:
+	case REGIND_SYMBOL:
+		return "[" + reg + " + " + payload + "]";
+	case MEMDIR_LITERAL_JMP:
+	case MEMDIR_SYMBOL_JMP:
+		return "*" + payload;
+	case REGDIR_JMP:
+		return "*" + reg;
+	case REGIND_JMP:
+		return "*[" + reg + "]";
+	case REGIND_LITERAL_JMP:
+	case REGIND_SYMBOL_JMP:
+		return "*[" + reg + " + " + payload + "]";
+	}
+
+	return "?";
+}
+
+std::string Mnemonic(uint8_t opCode)
+{
+	switch (opCode)
+	{
+	case 0xB0: return "str";
+	case 0xA0: return "ldr";
+	case 0x91: return "shr";
+	case 0x90: return "shl";
+	case 0x84: return "test";
+	case 0x83: return "xor";
+	case 0x82: return "or";
+	case 0x81: return "and";
+	case 0x80: return "not";
+	case 0x74: return "cmp";
+	case 0x73: return "div";
+	case 0x72: return "mul";
+	case 0x71: return "sub";
+	case 0x70: return "add";
+	case 0x60: return "xchg";
+	case 0xF0: return "pop";
+	case 0xE0: return "push";
+	case 0x53: return "jgt";
+	case 0x52: return "jne";
+	case 0x51: return "jeq";
+	case 0x50: return "jmp";
+	case 0x40: return "ret";
+	case 0x30: return "call";
+	case 0x20: return "iret";
+	case 0x10: return "int";
+	case 0x00: return "halt";
+	}
+
+	return "?";
+}
+
+std::string Disassemble(const DecodedInstruction& instruction, uint16_t next)
+{
+	std::string mnemonic = Mnemonic(instruction.opCode);
+	std::string regD = RegisterName(instruction.regD);
+	std::string regS = RegisterName(instruction.regS);
+
+	switch (instruction.opCode)
+	{
+	case 0xB0://str
+	case 0xA0://ldr
+		return mnemonic + " " + regD + ", " + OperandText(instruction, next);
+	case 0x91://shr
+	case 0x90://shl
+	case 0x84://test
+	case 0x83://xor
+	case 0x82://or
+	case 0x81://and
+	case 0x74://cmp
+	case 0x73://div
+	case 0x72://mul
+	case 0x71://sub
+	case 0x70://add
+	case 0x60://xchg
+		return mnemonic + " " + regD + ", " + regS;
+	case 0x80://not
+	case 0xF0://pop
+	case 0xE0://push
+	case 0x10://int
+		return mnemonic + " " + regD;
+	case 0x53://jgt
+	case 0x52://jne
+	case 0x51://jeq
+	case 0x50://jmp
+	case 0x30://call
+		return mnemonic + " " + OperandText(instruction, next);
+	default:
+		return mnemonic;
+	}
+}
\ No newline at end of file
@@ -0,0 +1,22 @@
+#ifndef _DISASSEMBLER_H
+#define _DISASSEMBLER_H
+
+#include "cpu.h"
+#include <string>
+
+std::string RegisterName(uint8_t reg);
+
+// 0x1234 form used for all addresses and literals
+//
+std::string Hex(uint16_t value);
+
+// "?" for unknown opcode
+//
+std::string Mnemonic(uint8_t opCode);
+
+// Assembler syntax of decoded instruction. Next is address right after instruction,
+// PC relative operands are shown as absolute addresses.
+//
+std::string Disassemble(const DecodedInstruction& instruction, uint16_t next);
+
+#endif
\ No newline at end of file
@@ -1,1092 +1,2849 @@
 #include "emulator.h"
+#include "cpu.h"
 #include "error.h"
+#include "jit.h"
+#include "disassembler.h"
 #include <fstream>
+#include <cstring>
+#include <algorithm>
+
 #include <bitset>
 #include <iomanip>
+#include <chrono>
 
-#define PC 7
-#define SP 6
-#define PSW 8
+#if defined(__unix__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #define Z 0
 #define O 1
 #define C 2
 #define N 3
 
+#define TR 13
+#define TL 14
 #define I 15
 
-int8_t memory[65536];
+// Program image written by linker
+//
+#define IMAGE_MAGIC "SSIM"
+#define IMAGE_VERSION 1
+
+// Processor state saved by --snapshot-out, all-zero pages of memory are left out
+//
+#define SNAPSHOT_MAGIC "SSNP"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_PAGE_SIZE 256
+
+// Longest instruction is opcode, register byte, addressing mode and two bytes of payload
+//
+#define MAX_INSTRUCTION_SIZE 5
+
+#define MAX_BLOCK_INSTRUCTIONS 32
 
+#define JIT_THRESHOLD 50
 
-// [0-5] -> r0-r5
-// [6] -> pc
-// [7] -> sp
-// [8] -> psw
-uint16_t regs[9] = { 0,0,0,0,0,0,0,0,0 };
+// Instrumentation compiled into interpreter loop by RunInstrumented()
+//
+#define PROFILE_FEATURE 1
+#define TRACE_FEATURE 2
+#define BREAKPOINT_FEATURE 4
+#define STATISTICS_FEATURE 8
 
-bool haltInstruction = false;
+// Host clock is read once per this many cycles while run has a timeout
+//
+#define TIMEOUT_CHECK_CYCLES 65536
 
-void CheckPC()
+// Read one byte of instruction and move pc to the next one
+//
+uint8_t FetchByte(CpuState& cpu, uint16_t& pc)
 {
-	if (regs[PC] == 0xFFFF)
+	if (pc == 0xFFFF)
 	{
 		RaiseError("Cannot increment PC anymore - overflow");
 	}
+
+	return cpu.memory[pc++];
 }
 
-Operand* ReadSecondRegister()
+// Host with atomic 16-bit accesses in guest byte order, see SharedMemory
+//
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define ATOMIC_WORDS
+#endif
+
+uint16_t ReadWord(CpuState& cpu, uint16_t address)
 {
-	Operand* op = nullptr;
-	//CheckPC();
-	uint8_t regsDesc = memory[regs[PC] - 1];
+#if defined(ATOMIC_WORDS)
+	if ((address & 1) == 0)
+	{
+		return __atomic_load_n((uint16_t*)&cpu.memory[address], __ATOMIC_RELAXED);
+	}
+#endif
 
-	uint16_t registerNumber = (regsDesc) & 0x0F;
+	uint16_t lower = ((uint16_t)cpu.memory[address] & 0x00FF);
+	uint16_t higher = ((uint16_t)cpu.memory[(uint16_t)(address + 1)] & 0x00FF) << 8;
 
-	if (registerNumber <= 8)
+	return lower | higher;
+}
+
+// Marks bytes of code run from start as covered, and clears its length for the next run
+// from there. Block cut short by a store to its own code counts as run whole.
+//
+void FoldCoverage(CpuState& cpu, uint16_t start)
+{
+	for (uint32_t address = start; address < (uint32_t)start + cpu.coveredLengths[start] && address < MEMORY_SIZE; address++)
 	{
-		op = new Operand();
-		op->SetType(REGDIR);
-		op->SetRegister(registerNumber);
-		op->SetOperandValue(regs[registerNumber]);
+		cpu.coverage[address / 8] |= 1 << (address % 8);
 	}
 
-	return op;
+	cpu.coveredLengths[start] = 0;
 }
 
-
-Operand* ReadSecondOperand(bool isStr = false)
+void FoldCoverage(CpuState& cpu)
 {
-	Operand* op = nullptr;
-	CheckPC();
-	uint8_t addrMode = memory[regs[PC]++];
-	uint8_t dataLow = 0, dataHigh = 0;
-	uint8_t reg = 0;
+	for (int start = 0; start < MEMORY_SIZE; start++)
+	{
+		if (cpu.coveredLengths[start] != 0)
+		{
+			FoldCoverage(cpu, start);
+		}
+	}
 
+	cpu.hasBlockCoverage = false;
+}
+
+bool IsMemoryOperand(uint8_t addrMode)
+{
 	switch (addrMode)
 	{
-		// Address/literal is in instruction payload
+	case MEMDIR_LITERAL:
+	case MEMDIR_SYMBOL_ABS:
+	case MEMDIR_SYMBOL_PCREL:
+	case REGIND:
+	case REGIND_LITERAL:
+	case REGIND_SYMBOL:
+	case MEMDIR_LITERAL_JMP:
+	case MEMDIR_SYMBOL_JMP:
+	case REGIND_JMP:
+	case REGIND_LITERAL_JMP:
+	case REGIND_SYMBOL_JMP:
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool IsConditionalJump(uint8_t opCode)
+{
+	return opCode == 0x51 || opCode == 0x52 || opCode == 0x53;
+}
+
+// Adds instruction executed count times to opcode, load and store counters. Negative count
+// takes back instructions which were counted but did not run.
+//
+void CountInstruction(CpuState& cpu, const DecodedInstruction& instruction, int64_t count)
+{
+	RunCounters& counters = cpu.counters;
+
+	counters.opCodes[instruction.opCode] += count;
+
+	switch (instruction.opCode)
+	{
+	case 0xB0://str
+		counters.stores += IsMemoryOperand(instruction.addrMode) ? count : 0;
+		break;
+	case 0xE0://push
+		counters.stores += count;
+		break;
+	case 0xF0://pop
+	case 0x40://ret
+		counters.loads += count;
+		break;
+	case 0x30://call
+		counters.stores += count;
+		counters.loads += IsMemoryOperand(instruction.addrMode) ? count : 0;
+		break;
+	case 0x20://iret
+		counters.loads += 2 * count;
+		break;
+	case 0x10://int
+		counters.stores += 2 * count;
+		break;
+	default:
+		// ldr and jumps
 		//
-	case  IMMEDIATE:
-	case  IMMEDIATE_SYMBOL_VALUE:
-	case  IMMEDIATE_JMP:
-	case  IMMEDIATE_SYMBOL_VALUE_ABS_JMP:
-	case  IMMEDIATE_SYMBOL_VALUE_PCREL_JMP:
-		CheckPC();
-		dataLow = memory[regs[PC]++];
-		CheckPC();
-		dataHigh = memory[regs[PC]++];
-		op = new Operand();
-		op->SetType((OperandType)addrMode);
-		op->SetOperandValue(((uint16_t)dataHigh << 8) | ((uint16_t)dataLow & 0x00FF));
+		counters.loads += IsMemoryOperand(instruction.addrMode) ? count : 0;
 		break;
-	case  MEMDIR_LITERAL:
-	case  MEMDIR_SYMBOL_ABS:
-	case  MEMDIR_SYMBOL_PCREL:
-	case  MEMDIR_LITERAL_JMP:
-	case  MEMDIR_SYMBOL_JMP:
-		CheckPC();
-		dataLow = memory[regs[PC]++];
-		CheckPC();
-		dataHigh = memory[regs[PC]++];
-		if (isStr)
+	}
+}
+
+// Counts of block runs go to counters. Block cut short by a store to its own code counts
+// as run whole.
+//
+void CountBlockRuns(CpuState& cpu, BasicBlock* block)
+{
+	if (block->runs == 0)
+	{
+		return;
+	}
+
+	for (const DecodedInstruction& instruction : block->microOps)
+	{
+		CountInstruction(cpu, instruction, block->runs);
+	}
+
+	if (IsConditionalJump(block->microOps.back().opCode))
+	{
+		cpu.counters.takenBranches += block->takenBranches;
+		cpu.counters.notTakenBranches += block->runs - block->takenBranches;
+	}
+
+	block->runs = 0;
+	block->takenBranches = 0;
+}
+
+// Block which a store to its own code has cut short was counted as run whole when the store
+// retired it, though only its first executed micro-ops ran. PC cannot tell how many, since
+// the store may come from call or int at the end of block.
+//
+void UncountBlockRest(CpuState& cpu, const BasicBlock* block, size_t executed)
+{
+	for (size_t i = executed; i < block->microOps.size(); i++)
+	{
+		CountInstruction(cpu, block->microOps[i], -1);
+	}
+
+	if (IsConditionalJump(block->microOps.back().opCode) && executed < block->microOps.size())
+	{
+		cpu.counters.notTakenBranches--;
+	}
+}
+
+// Drop decoded instructions and translated blocks which contain byte at address
+//
+void InvalidateDecodeCache(CpuState& cpu, uint16_t address)
+{
+	for (int i = 0; i < MAX_INSTRUCTION_SIZE; i++)
+	{
+		uint16_t start = address - i;
+
+		if (cpu.decodeCache[start].size > i)
 		{
-			// In case of str, we store address as operand value
-			//
-			op = new Operand();
-			op->SetType((OperandType)addrMode);
-			op->SetOperandValue(((uint16_t)dataHigh << 8) | ((uint16_t)dataLow & 0x00FF));
+			cpu.decodeCache[start].size = 0;
 		}
-		else
+	}
+
+	for (int i = 0; i < MAX_BLOCK_INSTRUCTIONS * MAX_INSTRUCTION_SIZE; i++)
+	{
+		uint16_t start = address - i;
+		BasicBlock* block = cpu.blockCache[start];
+
+		if (block != nullptr && (uint16_t)(block->end - start) > i)
 		{
-			// In other cases, we store what it is on that address in memory operand value
-			//
-			uint16_t address = ((uint16_t)(dataHigh << 8)) | ((uint16_t)dataLow & 0x00FF);
-			
-			if (addrMode == MEMDIR_SYMBOL_PCREL)
-			{
-				address = regs[PC] + address;
-			}
-			uint16_t lower = ((uint16_t)memory[address] & 0x00FF);
-			uint16_t higher = ((uint16_t)memory[address + 1] & 0x00FF) << 8;
+			block->valid = false;
+			cpu.blockCache[start] = nullptr;
+			cpu.retiredBlocks.push_back(block);
 
-			uint16_t value = lower | higher;
-			op = new Operand();
-			op->SetType((OperandType)addrMode);
-			op->SetOperandValue(value);
+			CountBlockRuns(cpu, block);
 		}
-		break;
-	case  REGDIR:
-	case  REGDIR_JMP:
-		reg = memory[regs[PC] - 2] & 0x0F;
-		op = new Operand();
-		op->SetType((OperandType)addrMode);
-		op->SetRegister(reg);
-		op->SetOperandValue(regs[reg]);
-		break;
 
-	case  REGIND:
-	case  REGIND_JMP:
-		reg = memory[regs[PC] - 2] & 0x0F;
-		if (isStr)
+		// Code which ran there is covered, whatever replaces it
+		//
+		if (cpu.coveredLengths[start] > i)
 		{
-			op = new Operand();
-			op->SetType((OperandType)addrMode);
-			op->SetRegister(reg);
-			op->SetOperandValue(regs[reg]);
+			FoldCoverage(cpu, start);
 		}
-		else
+	}
+
+	if (!cpu.nativeBlockSizes.empty())
+	{
+		for (int i = 0; i < MAX_BLOCK_INSTRUCTIONS * MAX_INSTRUCTION_SIZE; i++)
 		{
-			if (regs[reg] == 0xFFFF)
+			uint16_t start = address - i;
+
+			if (cpu.nativeBlockSizes[start] > i)
 			{
-				RaiseError("Cannot read memory at address 0xFFFF - overflow");
+				cpu.nativeBlockSizes[start] = 0;
 			}
+		}
+	}
+
+	cpu.watchedBytes[address] &= ~CODE_BYTE;
+}
+
+void WriteWord(CpuState& cpu, uint16_t address, uint16_t value)
+{
+	uint16_t next = address + 1;
+
+	if (cpu.watchedBytes[address] & CODE_BYTE)
+	{
+		InvalidateDecodeCache(cpu, address);
+	}
+
+	if (cpu.watchedBytes[next] & CODE_BYTE)
+	{
+		InvalidateDecodeCache(cpu, next);
+	}
+
+#if defined(ATOMIC_WORDS)
+	if ((address & 1) == 0)
+	{
+		__atomic_store_n((uint16_t*)&cpu.memory[address], value, __ATOMIC_RELAXED);
+	}
+	else
+#endif
+	{
+		cpu.memory[address] = value & 0x00FF;
+		cpu.memory[next] = (value >> 8) & 0x00FF;
+	}
+
+	if (cpu.watchedBytes[address] & DEVICE_BYTE)
+	{
+		cpu.pages[address / MEMORY_PAGE_SIZE].write(cpu, address, value);
+	}
+	else if (cpu.watchedBytes[next] & DEVICE_BYTE)
+	{
+		cpu.pages[next / MEMORY_PAGE_SIZE].write(cpu, next, value >> 8);
+	}
+}
+
+bool HasPayload(uint8_t addrMode)
+{
+	return addrMode != REGDIR && addrMode != REGIND && addrMode != REGDIR_JMP && addrMode != REGIND_JMP;
+}
+
+bool UsesRegister(uint8_t addrMode)
+{
+	return addrMode == REGDIR || addrMode == REGIND || addrMode == REGIND_LITERAL || addrMode == REGIND_SYMBOL ||
+		addrMode == REGDIR_JMP || addrMode == REGIND_JMP || addrMode == REGIND_LITERAL_JMP || addrMode == REGIND_SYMBOL_JMP;
+}
 
-			uint16_t lower = ((uint16_t)memory[regs[reg]] & 0x00FF);
-			uint16_t higher = ((uint16_t)memory[regs[reg] + 1] & 0x00FF) << 8;
+// Read addressing mode and payload of ldr/str/jump instruction
+//
+bool ReadSecondOperand(CpuState& cpu, uint16_t& pc, DecodedInstruction& instruction)
+{
+	instruction.addrMode = FetchByte(cpu, pc);
+
+	if (instruction.addrMode > REGIND_SYMBOL_JMP)
+	{
+		return false;
+	}
+
+	if (HasPayload(instruction.addrMode))
+	{
+		uint8_t dataLow = FetchByte(cpu, pc);
+		uint8_t dataHigh = FetchByte(cpu, pc);
+		instruction.payload = ((uint16_t)dataHigh << 8) | ((uint16_t)dataLow & 0x00FF);
+	}
+
+	return !UsesRegister(instruction.addrMode) || instruction.regS <= 8;
+}
+
+uint16_t RegisterIndirectAddress(CpuState& cpu, const DecodedInstruction& instruction)
+{
+	return (instruction.payload & 0xFF00) | ((instruction.payload & 0x00FF) + cpu.regs[instruction.regS]);
+}
 
-			uint16_t value = lower | higher;
-			op = new Operand();
-			op->SetType((OperandType)addrMode);
-			op->SetRegister(reg);
-			op->SetOperandValue(value);
+// Value of second operand of ldr and jump instructions
+//
+uint16_t GetOperandValue(CpuState& cpu, const DecodedInstruction& instruction)
+{
+	uint16_t address = 0;
+
+	switch (instruction.addrMode)
+	{
+		// Literal is in instruction payload
+		//
+	case  IMMEDIATE:
+	case  IMMEDIATE_SYMBOL_VALUE:
+	case  IMMEDIATE_JMP:
+	case  IMMEDIATE_SYMBOL_VALUE_ABS_JMP:
+	case  IMMEDIATE_SYMBOL_VALUE_PCREL_JMP:
+		return instruction.payload;
+	case  MEMDIR_SYMBOL_PCREL:
+		// At this moment, PC points to next instruction
+		//
+		return ReadWord(cpu, cpu.regs[PC] + instruction.payload);
+	case  MEMDIR_LITERAL:
+	case  MEMDIR_SYMBOL_ABS:
+	case  MEMDIR_LITERAL_JMP:
+	case  MEMDIR_SYMBOL_JMP:
+		return ReadWord(cpu, instruction.payload);
+	case  REGDIR:
+	case  REGDIR_JMP:
+		return cpu.regs[instruction.regS];
+	case  REGIND:
+	case  REGIND_JMP:
+		if (cpu.regs[instruction.regS] == 0xFFFF)
+		{
+			RaiseError("Cannot read memory at address 0xFFFF - overflow");
 		}
-		break;
+		return ReadWord(cpu, cpu.regs[instruction.regS]);
 	case  REGIND_LITERAL:
 	case  REGIND_SYMBOL:
 	case  REGIND_LITERAL_JMP:
 	case  REGIND_SYMBOL_JMP:
-		reg = memory[regs[PC] - 2] & 0x0F;
-		CheckPC();
-		dataLow = memory[regs[PC]++];
-		CheckPC();
-		dataHigh = memory[regs[PC]++];
-		if (isStr)
-		{
-			op = new Operand();
-			op->SetRegister(reg);
-			op->SetType((OperandType)addrMode);
-			uint16_t address = ((uint16_t)dataHigh << 8) | ((uint16_t)dataLow) + regs[reg];
-			op->SetOperandValue(address);
-		}
-		else
+		address = RegisterIndirectAddress(cpu, instruction);
+		if (address == 0xFFFF)
 		{
-			op = new Operand();
-			op->SetRegister(reg);
-			op->SetType((OperandType)addrMode);
-			uint16_t address = ((uint16_t)dataHigh << 8) | ((uint16_t)dataLow)  + regs[reg];
-
-			uint16_t lower = ((uint16_t)memory[address] & 0x00FF);
-			uint16_t higher = ((uint16_t)memory[address + 1] & 0x00FF) << 8;
-
-			uint16_t value = lower | higher;
-			if (address == 0xFFFF)
-			{
-				RaiseError("Cannot read memory at address 0xFFFF - overflow");
-			}
-			op->SetOperandValue(value);
+			RaiseError("Cannot read memory at address 0xFFFF - overflow");
 		}
-		break;
+		return ReadWord(cpu, address);
 	}
 
-	return op;
+	return 0;
 }
 
-Operand* ReadFirstOperand()
+// Target of jump instruction, with PC pointing to next instruction
+//
+uint16_t GetJumpTarget(CpuState& cpu, const DecodedInstruction& instruction)
 {
-	Operand* op = nullptr;
-	CheckPC();
-	uint8_t regsDesc = memory[regs[PC]++]; 
-
-	uint16_t registerNumber = (regsDesc >> 4) & 0x0F;
+	uint16_t value = GetOperandValue(cpu, instruction);
 
-	if (registerNumber <= 8)
+	if (instruction.addrMode == IMMEDIATE_SYMBOL_VALUE_PCREL_JMP)
 	{
-		op = new Operand();
-		op->SetType(REGDIR);
-		op->SetRegister(registerNumber);
-		op->SetOperandValue(regs[registerNumber]);
+		uint32_t res = ((uint32_t)cpu.regs[PC] + (uint32_t)value) % 65536;
+		return (uint16_t)res;
 	}
 
-	return op;
+	return value;
 }
 
-void SetPSWFlag(int bit)
+void SetPSWFlag(CpuState& cpu, int bit)
 {
-	regs[PSW] |= (1 << bit);
+	cpu.regs[PSW] |= (1 << bit);
 }
 
-void UnsetPSWFlag(int bit)
+void UnsetPSWFlag(CpuState& cpu, int bit)
 {
-	regs[PSW] &= ~(1 << bit);
+	cpu.regs[PSW] &= ~(1 << bit);
 }
 
-bool TestPSWFlag(int bit)
+// Flag setting instructions only record their operands and result. Flags are written
+// to PSW once something needs whole PSW, while jumps take Z and N from the result.
+//
+// Flags written by each operation, other PSW bits keep their values
+//
+const uint16_t flagOperationMask[] =
 {
-	return (regs[PSW] & (1 << bit)) != 0;
+	0,
+	(1 << Z) | (1 << O) | (1 << C) | (1 << N),
+	(1 << Z) | (1 << N),
+	(1 << Z) | (1 << N) | (1 << C),
+	(1 << Z) | (1 << N) | (1 << C)
+};
+
+void SetZeroAndNegativeFlags(CpuState& cpu, uint16_t value)
+{
+	if (value == 0)
+	{
+		SetPSWFlag(cpu, Z);
+	}
+	else
+	{
+		UnsetPSWFlag(cpu, Z);
+	}
+
+	if (value & ((uint16_t)1 << 15))
+	{
+		SetPSWFlag(cpu, N);
+	}
+	else
+	{
+		UnsetPSWFlag(cpu, N);
+	}
 }
 
-void Emulator::ReadMemoryContent(std::string& inputFile)
+void SetCmpFlags(CpuState& cpu)
 {
-	std::ifstream input;
-	input.open(inputFile, std::ios::binary | std::ios::in);
+	int16_t regD = cpu.flagOperandD;
+	int16_t regS = cpu.flagOperandS;
+	int16_t temp = cpu.flagResult;
 
-	if (!input.is_open() || !input.good())
+	SetZeroAndNegativeFlags(cpu, cpu.flagResult);
+
+	// Update O
+	//
+	if ((regD < 0 && -regS < 0 && temp > 0) || (regD > 0 && -regS > 0 && temp < 0))
 	{
-		RaiseError("Error opening " + inputFile);
+		SetPSWFlag(cpu, O);
+	}
+	else
+	{
+		UnsetPSWFlag(cpu, O);
 	}
 
-	size_t size;
-	input.read((char*)&size, sizeof(size_t));
+	// Update carry
+	// Carry used to be computed bit by bit with int16_t partial sums. Bit 15 term is
+	// negative there, so the last step never carries and C always ends up cleared.
+	//
+	UnsetPSWFlag(cpu, C);
+}
+
+void SetShlFlags(CpuState& cpu)
+{
+	uint16_t operandD = cpu.flagOperandD;
+	uint16_t operandS = cpu.flagOperandS;
+
+	SetZeroAndNegativeFlags(cpu, cpu.flagResult);
 
-	for (int i = 0; i < size; i++)
+	if (operandS == 0 || operandS > 16)
 	{
-		uint16_t addr;
-		uint8_t byte;
-		input.read((char*)&addr, sizeof(uint16_t));
-		input.read((char*)&byte, sizeof(uint8_t));
+		UnsetPSWFlag(cpu, C);
+	}
 
-		memory[addr] = byte;
+	if (operandD & (1 << (16 - operandS)))
+	{
+		SetPSWFlag(cpu, C);
+	}
+	else
+	{
+		UnsetPSWFlag(cpu, C);
 	}
 }
 
-void Emulator::Init()
+void SetShrFlags(CpuState& cpu)
 {
-	regs[PC] = ((uint16_t)memory[0] & 0x00FF) | ((((uint16_t)memory[1]) << 8) & 0xFF00);
-}
+	uint16_t operandD = cpu.flagOperandD;
+	uint16_t operandS = cpu.flagOperandS;
 
-void Emulator::Run()
-{
-	while (!haltInstruction)
+	SetZeroAndNegativeFlags(cpu, cpu.flagResult);
+
+	if (operandS == 0)
 	{
-		Instruction* instruction = ReadInstruction();
-		
-		// In case of wrong opcode
-		//
-		if (instruction == nullptr)
+		UnsetPSWFlag(cpu, C);
+	}
+
+	if (operandS > 16)
+	{
+		if (operandD & 0x8000)
 		{
-			regs[PC] = ((uint16_t)memory[2] & 0x00FF) | ((((uint16_t)memory[3]) << 8) & 0xFF00);
+			SetPSWFlag(cpu, C);
 		}
 		else
 		{
-			// At this moment, PC points to next instruction
-			//
-			instruction->Execute();
+			UnsetPSWFlag(cpu, C);
 		}
 	}
+	
+	if (operandD & (1 << (operandS - 1)))
+	{
+		SetPSWFlag(cpu, C);
+	}
+	else
+	{
+		UnsetPSWFlag(cpu, C);
+	}
 }
 
-void Emulator::OutputResult()
+// Write flags of last flag setting instruction to PSW
+//
+void MaterializeFlags(CpuState& cpu)
 {
-	std::bitset<16> pswRepresentation = regs[PSW];
-	std::cout<<"\n---------------------------------------------------------\n";
-	std::cout<<"Emulated processor executed halt instruction\n";
-	std::cout<<"Emulated processor state: psw=0b"<<pswRepresentation<<"\n";
+	switch (cpu.pendingFlagOperation)
+	{
+	case CMP_FLAGS: SetCmpFlags(cpu); break;
+	case TEST_FLAGS: SetZeroAndNegativeFlags(cpu, cpu.flagResult); break;
+	case SHL_FLAGS: SetShlFlags(cpu); break;
+	case SHR_FLAGS: SetShrFlags(cpu); break;
+	case NO_FLAG_OPERATION: break;
+	}
 
-	for (int i=0;i<4;i++)
+	cpu.pendingFlagOperation = NO_FLAG_OPERATION;
+}
+
+void RecordFlagOperation(CpuState& cpu, FlagOperation operation, uint16_t operandD, uint16_t operandS, uint16_t result)
+{
+	// Pending flags which new operation does not overwrite have to reach PSW first
+	//
+	if (flagOperationMask[cpu.pendingFlagOperation] & ~flagOperationMask[operation])
 	{
-				std::cout<<"r"<<i<<"=";
-				char hex_string[20];
-				sprintf(hex_string, "%.4X", regs[i]);
-				std::string regHex = hex_string;
-				regHex = regHex.substr(regHex.size() - 4);
-				regHex.insert(0, "0x");
-				std::cout << std::setw(4) << regHex <<"\t";
+		MaterializeFlags(cpu);
 	}
 
-	std::cout<<'\n';
+	cpu.pendingFlagOperation = operation;
+	cpu.flagOperandD = operandD;
+	cpu.flagOperandS = operandS;
+	cpu.flagResult = result;
+}
 
-		for (int i=4;i<8;i++)
+bool TestPSWFlag(CpuState& cpu, int bit)
+{
+	if (cpu.pendingFlagOperation != NO_FLAG_OPERATION && (bit == Z || bit == N))
 	{
-				std::cout<<"r"<<i<<"=";
-				char hex_string[20];
-				sprintf(hex_string, "%.4X", regs[i]);
-				std::string regHex = hex_string;
-				regHex = regHex.substr(regHex.size() - 4);
-				regHex.insert(0, "0x");
-				std::cout << std::setw(4) << regHex <<"\t";
+		return bit == Z ? cpu.flagResult == 0 : (cpu.flagResult & ((uint16_t)1 << 15)) != 0;
 	}
 
-	std::cout<<'\n';
+	MaterializeFlags(cpu);
+
+	return (cpu.regs[PSW] & (1 << bit)) != 0;
 }
 
-Instruction* Emulator::ReadInstruction()
+Emulator::Emulator()
 {
-	CheckPC();
-	uint8_t opCode = memory[regs[PC]++];
-	Instruction* instruction = nullptr;
-	Operand* operand1 = nullptr;
-	Operand* operand2 = nullptr;
-	Operand* operand = nullptr;
+	mState = new CpuState();
+	mState->shared = std::make_shared<SharedMemory>();
+	mState->shared->activeProcessors = 1;
+	mState->memory = mState->shared->bytes;
+	mJit = nullptr;
 
-	switch (opCode)
+	InitDevices(*mState);
+}
+
+Emulator::~Emulator()
+{
+	FlushTerminal(*mState);
+	CloseSemihostFiles(*mState);
+
+	delete mJit;
+
+	// Trace is dumped however the program ended
+	//
+	if (mState->trace != nullptr)
 	{
-	case 0xB0://str rx, operand
-		operand1 = ReadFirstOperand();
-		operand2 = ReadSecondOperand(true);
-		if (operand1 && operand2 && operand2->GetType() != IMMEDIATE && operand2->GetType() != IMMEDIATE_SYMBOL_VALUE)
-		{
-			instruction = new Str();
-			instruction->AppendOperand(operand1);
-			instruction->AppendOperand(operand2);
-		}
-		break;
-	case 0xA0://ldr
-		operand1 = ReadFirstOperand();
-		operand2 = ReadSecondOperand();
-		if (operand1 && operand2)
-		{
-			instruction = new Ldr();
-			instruction->AppendOperand(operand1);
-			instruction->AppendOperand(operand2);
-		}
-		break;
-	case 0x91://shr
-		operand1 = ReadFirstOperand();
-		operand2 = ReadSecondRegister();
-		if (operand1 && operand2)
+		InstallTraceSignalHandler(nullptr);
+
+		if (!mState->trace->Dump())
 		{
-			instruction = new Shr();
-			instruction->AppendOperand(operand1);
-			instruction->AppendOperand(operand2);
+			std::cout << "Error writing trace\n";
 		}
+
+		delete mState->trace;
+	}
+
+	for (auto block : mState->blockCache)
+	{
+		delete block;
+	}
+
+	for (auto block : mState->retiredBlocks)
+	{
+		delete block;
+	}
+
+	delete mState;
+}
+
+// Image is mapped and segments are copied from mapping straight to emulated memory
+//
+void Emulator::ReadMemoryContent(const std::string& inputFile)
+{
+#if defined(__unix__)
+	int file = open(inputFile.c_str(), O_RDONLY);
+
+	if (file < 0)
+	{
+		RaiseError("Error opening " + inputFile);
+	}
+
+	struct stat fileStatus;
+
+	if (fstat(file, &fileStatus) != 0)
+	{
+		close(file);
+		RaiseError("Error opening " + inputFile);
+	}
+
+	size_t size = fileStatus.st_size;
+
+	if (size == 0)
+	{
+		close(file);
+		LoadImage(nullptr, 0, inputFile);
+		return;
+	}
+
+	void* image = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+	close(file);
+
+	if (image == MAP_FAILED)
+	{
+		RaiseError("Error mapping " + inputFile);
+	}
+
+	LoadImage((const uint8_t*)image, size, inputFile);
+
+	munmap(image, size);
+#else
+	std::ifstream input;
+	input.open(inputFile, std::ios::binary | std::ios::in | std::ios::ate);
+
+	if (!input.is_open() || !input.good())
+	{
+		RaiseError("Error opening " + inputFile);
+	}
+
+	std::vector<uint8_t> image((size_t)input.tellg());
+	input.seekg(0);
+	input.read((char*)image.data(), image.size());
+
+	LoadImage(image.data(), image.size(), inputFile);
+#endif
+}
+
+// Copy next field of image, false if image ends before it
+//
+bool ReadImageField(const uint8_t* image, size_t size, size_t& offset, void* field, size_t fieldSize)
+{
+	if (size - offset < fieldSize)
+	{
+		return false;
+	}
+
+	memcpy(field, image + offset, fieldSize);
+	offset += fieldSize;
+
+	return true;
+}
+
+void Emulator::LoadImage(const uint8_t* image, size_t size, const std::string& name)
+{
+	CpuState& cpu = *mState;
+
+	// Image may replace code of a program which already ran
+	//
+	for (int address = 0; address < MEMORY_SIZE; address++)
+	{
+		if (cpu.watchedBytes[address] & CODE_BYTE)
+		{
+			InvalidateDecodeCache(cpu, address);
+		}
+	}
+
+	cpu.isSnapshotLoaded = false;
+
+	if (size >= 4 && memcmp(image, IMAGE_MAGIC, 4) == 0)
+	{
+		LoadSegments(image, size, name);
+	}
+	else if (size >= 4 && memcmp(image, SNAPSHOT_MAGIC, 4) == 0)
+	{
+		LoadSnapshot(image, size, name);
+	}
+	else
+	{
+		// Older images have no header, they start with number of address/byte pairs
+		//
+		LoadAddressBytePairs(image, size);
+
+		cpu.entryPoint = ((uint16_t)cpu.memory[0] & 0x00FF) | ((((uint16_t)cpu.memory[1]) << 8) & 0xFF00);
+	}
+}
+
+// <magic> <version> <entry point> <number_of_segments>, then <load_address> <length> <bytes> of each segment
+//
+void Emulator::LoadSegments(const uint8_t* image, size_t size, const std::string& name)
+{
+	CpuState& cpu = *mState;
+
+	size_t offset = 4;
+	uint16_t version = 0;
+	uint16_t segmentCount = 0;
+
+	if (!ReadImageField(image, size, offset, &version, sizeof(uint16_t)) ||
+		!ReadImageField(image, size, offset, &cpu.entryPoint, sizeof(uint16_t)) ||
+		!ReadImageField(image, size, offset, &segmentCount, sizeof(uint16_t)))
+	{
+		RaiseError("Truncated program image " + name);
+	}
+
+	if (version != IMAGE_VERSION)
+	{
+		RaiseError("Unsupported program image version " + std::to_string(version) + " in " + name);
+	}
+
+	for (int i = 0; i < segmentCount; i++)
+	{
+		uint16_t address = 0;
+		uint32_t length = 0;
+
+		if (!ReadImageField(image, size, offset, &address, sizeof(uint16_t)) ||
+			!ReadImageField(image, size, offset, &length, sizeof(uint32_t)))
+		{
+			RaiseError("Truncated program image " + name);
+		}
+
+		if ((uint32_t)address + length > MEMORY_SIZE)
+		{
+			RaiseError("Segment at address " + std::to_string(address) + " does not fit in memory");
+		}
+
+		if (!ReadImageField(image, size, offset, &cpu.memory[address], length))
+		{
+			RaiseError("Truncated program image " + name);
+		}
+	}
+}
+
+// <number_of_bytes> <addr> <byte> <addr> <byte>......
+//
+void Emulator::LoadAddressBytePairs(const uint8_t* image, size_t size)
+{
+	CpuState& cpu = *mState;
+
+	size_t offset = 0;
+	size_t count = 0;
+
+	if (!ReadImageField(image, size, offset, &count, sizeof(size_t)))
+	{
+		return;
+	}
+
+	// Count from header is not trusted beyond end of image
+	//
+	count = std::min(count, (size - offset) / 3);
+
+	for (size_t i = 0; i < count; i++, offset += 3)
+	{
+		uint16_t addr = image[offset] | ((uint16_t)image[offset + 1] << 8);
+
+		cpu.memory[addr] = image[offset + 2];
+	}
+}
+
+// <magic> <version> <registers> <halt> <devices> <number_of_pages>, then <page_index> <bytes> of each non-zero page
+//
+// <devices> -> <cycles> <pending_interrupts> <timer_period> <timer_next_cycle>, missing in version 1
+//
+void Emulator::LoadSnapshot(const uint8_t* image, size_t size, const std::string& name)
+{
+	CpuState& cpu = *mState;
+
+	size_t offset = 4;
+	uint16_t version = 0;
+	uint16_t pageCount = 0;
+
+	if (!ReadImageField(image, size, offset, &version, sizeof(uint16_t)))
+	{
+		RaiseError("Truncated snapshot " + name);
+	}
+
+	if (version != 1 && version != SNAPSHOT_VERSION)
+	{
+		RaiseError("Unsupported snapshot version " + std::to_string(version) + " in " + name);
+	}
+
+	if (!ReadImageField(image, size, offset, cpu.regs, sizeof(cpu.regs)) ||
+		!ReadImageField(image, size, offset, &cpu.haltInstruction, sizeof(bool)))
+	{
+		RaiseError("Truncated snapshot " + name);
+	}
+
+	if (version >= 2 &&
+		(!ReadImageField(image, size, offset, &cpu.cycles, sizeof(uint64_t)) ||
+		!ReadImageField(image, size, offset, &cpu.pendingInterrupts, sizeof(uint16_t)) ||
+		!ReadImageField(image, size, offset, &cpu.timer.period, sizeof(uint64_t)) ||
+		!ReadImageField(image, size, offset, &cpu.timer.nextCycle, sizeof(uint64_t))))
+	{
+		RaiseError("Truncated snapshot " + name);
+	}
+
+	if (!ReadImageField(image, size, offset, &pageCount, sizeof(uint16_t)))
+	{
+		RaiseError("Truncated snapshot " + name);
+	}
+
+	memset(cpu.memory, 0, MEMORY_SIZE);
+
+	for (int i = 0; i < pageCount; i++)
+	{
+		uint8_t page = 0;
+
+		if (!ReadImageField(image, size, offset, &page, sizeof(uint8_t)) ||
+			!ReadImageField(image, size, offset, &cpu.memory[page * SNAPSHOT_PAGE_SIZE], SNAPSHOT_PAGE_SIZE))
+		{
+			RaiseError("Truncated snapshot " + name);
+		}
+	}
+
+	// Execution continues where snapshot was taken
+	//
+	cpu.entryPoint = cpu.regs[PC];
+	cpu.isSnapshotLoaded = true;
+
+	if (cpu.timer.period != 0)
+	{
+		cpu.scheduler.Schedule(TIMER_DEVICE, cpu.timer.nextCycle);
+	}
+
+	ConnectTerminalInput(cpu, (cpu.memory[TERM_CFG] & 1) != 0);
+
+	cpu.nextEventCycle = 0;
+}
+
+void Emulator::SaveSnapshot(const std::string& outputFile)
+{
+	CpuState& cpu = *mState;
+
+	std::ofstream output;
+	output.open(outputFile, std::ios::binary | std::ios::out);
+
+	if (!output.is_open() || !output.good())
+	{
+		RaiseError("Error opening " + outputFile);
+	}
+
+	MaterializeFlags(cpu);
+
+	std::vector<uint8_t> pages;
+
+	for (int page = 0; page < MEMORY_SIZE / SNAPSHOT_PAGE_SIZE; page++)
+	{
+		int8_t* begin = &cpu.memory[page * SNAPSHOT_PAGE_SIZE];
+
+		if (std::any_of(begin, begin + SNAPSHOT_PAGE_SIZE, [](int8_t byte) { return byte != 0; }))
+		{
+			pages.push_back(page);
+		}
+	}
+
+	uint16_t version = SNAPSHOT_VERSION;
+	uint16_t pageCount = pages.size();
+
+	output.write(SNAPSHOT_MAGIC, 4);
+	output.write((char*)&version, sizeof(uint16_t));
+	output.write((char*)cpu.regs, sizeof(cpu.regs));
+	output.write((char*)&cpu.haltInstruction, sizeof(bool));
+	output.write((char*)&cpu.cycles, sizeof(uint64_t));
+	output.write((char*)&cpu.pendingInterrupts, sizeof(uint16_t));
+	output.write((char*)&cpu.timer.period, sizeof(uint64_t));
+	output.write((char*)&cpu.timer.nextCycle, sizeof(uint64_t));
+	output.write((char*)&pageCount, sizeof(uint16_t));
+
+	for (auto page : pages)
+	{
+		output.write((char*)&page, sizeof(uint8_t));
+		output.write((char*)&cpu.memory[page * SNAPSHOT_PAGE_SIZE], SNAPSHOT_PAGE_SIZE);
+	}
+
+	if (!output.good())
+	{
+		RaiseError("Error writing " + outputFile);
+	}
+}
+
+void Emulator::RecordInput(const std::string& logFile)
+{
+	StartInputRecording(*mState, logFile);
+}
+
+void Emulator::ReplayInput(const std::string& logFile)
+{
+	StartInputReplay(*mState, logFile);
+}
+
+void Emulator::Init()
+{
+	CpuState& cpu = *mState;
+
+	if (cpu.isSnapshotLoaded)
+	{
+		return;
+	}
+
+	cpu.regs[0] = cpu.processorIndex;
+	cpu.regs[PC] = cpu.entryPoint;
+}
+
+void Emulator::Reset()
+{
+	CpuState& cpu = *mState;
+
+	memset(cpu.regs, 0, sizeof(cpu.regs));
+	cpu.regs[0] = cpu.processorIndex;
+	cpu.regs[PC] = cpu.entryPoint;
+
+	cpu.pendingFlagOperation = NO_FLAG_OPERATION;
+	cpu.haltInstruction = false;
+	cpu.stop = false;
+	cpu.stopReason = STOP_HALT;
+	cpu.semihost.exitCode = 0;
+	cpu.cycles = 0;
+	cpu.idleCycles = 0;
+	cpu.decodeNanoseconds = 0;
+	cpu.counters = RunCounters();
+
+	// Runs of cached blocks were counted before reset
+	//
+	for (auto block : cpu.blockCache)
+	{
+		if (block != nullptr)
+		{
+			block->runs = 0;
+			block->takenBranches = 0;
+		}
+	}
+
+	ResetDevices(cpu);
+}
+
+uint16_t Emulator::ReadRegister(int index)
+{
+	CpuState& cpu = *mState;
+
+	if (index < 0 || index > PSW)
+	{
+		RaiseError("Wrong register index " + std::to_string(index));
+	}
+
+	MaterializeFlags(cpu);
+
+	return cpu.regs[index];
+}
+
+void Emulator::WriteRegister(int index, uint16_t value)
+{
+	CpuState& cpu = *mState;
+
+	if (index < 0 || index > PSW)
+	{
+		RaiseError("Wrong register index " + std::to_string(index));
+	}
+
+	// Pending flags would otherwise overwrite new PSW
+	//
+	MaterializeFlags(cpu);
+
+	cpu.regs[index] = value;
+}
+
+void Emulator::ReadMemory(uint16_t address, void* buffer, size_t size)
+{
+	CpuState& cpu = *mState;
+
+	if (address + size > MEMORY_SIZE)
+	{
+		RaiseError("Memory access at " + std::to_string(address) + " does not fit in memory");
+	}
+
+	memcpy(buffer, &cpu.memory[address], size);
+}
+
+void Emulator::WriteMemory(uint16_t address, const void* data, size_t size)
+{
+	CpuState& cpu = *mState;
+
+	if (address + size > MEMORY_SIZE)
+	{
+		RaiseError("Memory access at " + std::to_string(address) + " does not fit in memory");
+	}
+
+	for (size_t i = 0; i < size; i++)
+	{
+		if (cpu.watchedBytes[address + i] & CODE_BYTE)
+		{
+			InvalidateDecodeCache(cpu, address + i);
+		}
+	}
+
+	memcpy(&cpu.memory[address], data, size);
+}
+
+void Emulator::InjectInterrupt(uint16_t entry)
+{
+	CpuState& cpu = *mState;
+
+	if (entry >= IVT_ENTRIES)
+	{
+		RaiseError("Wrong IVT entry " + std::to_string(entry));
+	}
+
+	cpu.pendingInterrupts |= 1 << entry;
+	cpu.nextEventCycle = 0;
+}
+
+void Emulator::DisconnectTerminal()
+{
+	::DisconnectTerminal(*mState);
+}
+
+void Emulator::SetTerminalOutput(std::ostream& output)
+{
+	FlushTerminal(*mState);
+
+	mState->terminal.hostOutput = &output;
+}
+
+void Emulator::JoinMachine(Emulator& first, int index)
+{
+	CpuState& cpu = *mState;
+
+	if (index < 1 || index >= MAX_PROCESSORS)
+	{
+		RaiseError("Wrong processor index " + std::to_string(index));
+	}
+
+	cpu.shared = first.mState->shared;
+	cpu.memory = cpu.shared->bytes;
+	cpu.processorIndex = index;
+	cpu.isParked = true;
+	cpu.shared->startAddresses[index] = PARKED_PROCESSOR;
+
+	InitInterProcessorInterrupts(cpu);
+	InitInterProcessorInterrupts(*first.mState);
+}
+
+bool Emulator::WaitForStart()
+{
+	CpuState& cpu = *mState;
+	SharedMemory& shared = *cpu.shared;
+
+	while (cpu.isParked)
+	{
+		// Last active processor may have woken this one right before it stopped
+		//
+		bool isMachineStopped = shared.activeProcessors == 0;
+		uint32_t start = shared.startAddresses[cpu.processorIndex];
+
+		if (start != PARKED_PROCESSOR)
+		{
+			cpu.isParked = false;
+			cpu.regs[PC] = start;
+		}
+		else if (isMachineStopped)
+		{
+			return false;
+		}
+		else
+		{
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+	}
+
+	return true;
+}
+
+void Emulator::LeaveMachine()
+{
+	CpuState& cpu = *mState;
+
+	if (cpu.isMultiprocessor && !cpu.isParked)
+	{
+		cpu.shared->activeProcessors--;
+	}
+}
+
+void Emulator::EnableSemihosting()
+{
+	mState->semihost.isEnabled = true;
+}
+
+uint16_t Emulator::GetExitCode()
+{
+	return mState->semihost.exitCode;
+}
+
+EmulatorStatistics Emulator::GetStatistics()
+{
+	CpuState& cpu = *mState;
+
+	for (auto block : cpu.blockCache)
+	{
+		if (block != nullptr)
+		{
+			CountBlockRuns(cpu, block);
+		}
+	}
+
+	const RunCounters& counters = cpu.counters;
+
+	EmulatorStatistics statistics;
+	statistics.cycles = cpu.cycles;
+	statistics.instructions = cpu.cycles - cpu.idleCycles;
+	statistics.decodeNanoseconds = cpu.decodeNanoseconds;
+
+	memcpy(statistics.opCodes, counters.opCodes, sizeof(statistics.opCodes));
+	statistics.loads = counters.loads;
+	statistics.stores = counters.stores;
+	statistics.takenBranches = counters.takenBranches;
+	statistics.notTakenBranches = counters.notTakenBranches;
+	statistics.interrupts = counters.interrupts;
+	statistics.decodeCacheHits = counters.decodeCacheHits;
+	statistics.decodeCacheMisses = counters.decodeCacheMisses;
+	statistics.blockCacheHits = counters.blockCacheHits;
+	statistics.blockCacheMisses = counters.blockCacheMisses;
+
+	return statistics;
+}
+
+// Wrong opcode is handled by routine from IVT entry 1
+//
+void JumpToErrorRoutine(CpuState& cpu)
+{
+	cpu.regs[PC] = ((uint16_t)cpu.memory[2] & 0x00FF) | ((((uint16_t)cpu.memory[3]) << 8) & 0xFF00);
+}
+
+void StopRun(CpuState& cpu, StopReason reason)
+{
+	cpu.stop = true;
+	cpu.stopReason = reason;
+}
+
+// Limits of current run are checked together with device events, so that they cost
+// nothing until one of them is due. Returns false when run has to stop.
+//
+bool ProcessEvents(CpuState& cpu)
+{
+	if (cpu.cycles >= cpu.stopCycle)
+	{
+		StopRun(cpu, STOP_BUDGET);
+		return false;
+	}
+
+	if (cpu.cycles >= cpu.timeoutCheckCycle)
+	{
+		if (std::chrono::steady_clock::now() >= cpu.deadline)
+		{
+			StopRun(cpu, STOP_TIMEOUT);
+			return false;
+		}
+
+		cpu.timeoutCheckCycle = cpu.cycles + TIMEOUT_CHECK_CYCLES;
+	}
+
+	ProcessDeviceEvents(cpu);
+
+	cpu.nextEventCycle = std::min({ cpu.nextEventCycle, cpu.stopCycle, cpu.timeoutCheckCycle });
+
+	return true;
+}
+
+// Devices are looked at only when some event is due, once per instruction or block
+//
+inline bool CheckDeviceEvents(CpuState& cpu)
+{
+	if (cpu.cycles >= cpu.nextEventCycle)
+	{
+		return ProcessEvents(cpu);
+	}
+
+	return true;
+}
+
+// Wrong opcode is handled by routine from IVT entry 1, unless embedder asked to stop
+// at it. PC stays at wrong instruction then.
+//
+inline void HandleWrongOpCode(CpuState& cpu)
+{
+	if (cpu.stopOnWrongOpCode)
+	{
+		StopRun(cpu, STOP_WRONG_OPCODE);
+		return;
+	}
+
+	JumpToErrorRoutine(cpu);
+	cpu.cycles++;
+}
+
+// Breakpoint at PC stops run, except at the instruction run started from
+//
+inline bool CheckBreakpoint(CpuState& cpu)
+{
+	if (cpu.breakpoints[cpu.regs[PC]] && !cpu.skipBreakpoint)
+	{
+		StopRun(cpu, STOP_BREAKPOINT);
+		return false;
+	}
+
+	cpu.skipBreakpoint = false;
+
+	return true;
+}
+
+// Address of memory operand of ldr, str and jumps, before instruction changes registers
+//
+inline bool MemoryOperandAddress(CpuState& cpu, const DecodedInstruction& instruction, uint16_t& address)
+{
+	switch (instruction.addrMode)
+	{
+	case MEMDIR_SYMBOL_PCREL:
+		address = cpu.regs[PC] + instruction.payload;
+		return true;
+	case MEMDIR_LITERAL:
+	case MEMDIR_SYMBOL_ABS:
+	case MEMDIR_LITERAL_JMP:
+	case MEMDIR_SYMBOL_JMP:
+		address = instruction.payload;
+		return true;
+	case REGIND:
+	case REGIND_JMP:
+		address = cpu.regs[instruction.regS];
+		return true;
+	case REGIND_LITERAL:
+	case REGIND_SYMBOL:
+	case REGIND_LITERAL_JMP:
+	case REGIND_SYMBOL_JMP:
+		address = RegisterIndirectAddress(cpu, instruction);
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Part of trace record known before instruction runs. Address is stack pointer unless
+// instruction has memory operand, so that pops can report where they read from.
+//
+inline void BeginTraceRecord(CpuState& cpu, TraceRecord& record, const DecodedInstruction& instruction, uint16_t pc)
+{
+	record.pc = pc;
+	record.opCode = instruction.opCode;
+	record.flags = TRACE_NO_REGISTER;
+	record.value = 0;
+	record.address = cpu.regs[SP];
+
+	uint16_t address;
+
+	if (MemoryOperandAddress(cpu, instruction, address))
+	{
+		record.flags |= TRACE_MEMORY;
+		record.address = address;
+	}
+}
+
+inline void EndTraceRecord(CpuState& cpu, TraceRecord& record, const DecodedInstruction& instruction)
+{
+	uint8_t reg = instruction.regD;
+
+	switch (instruction.opCode)
+	{
+	case 0xB0://str
+		if (instruction.addrMode == REGDIR)
+		{
+			reg = instruction.regS;
+			break;
+		}
+
+		record.value = cpu.regs[instruction.regD];
+		return;
+	case 0xE0://push
+		record.flags |= TRACE_MEMORY;
+		record.value = cpu.regs[instruction.regD];
+		record.address = cpu.regs[SP];
+		return;
+	case 0x30://call
+	case 0x10://int
+		record.address = cpu.regs[SP];
+		// fall through
+	case 0x40://ret
+	case 0x20://iret
+		record.flags |= TRACE_MEMORY;
+		// fall through
+	case 0x53://jgt
+	case 0x52://jne
+	case 0x51://jeq
+	case 0x50://jmp
+		reg = PC;
 		break;
-	case 0x90://shl
-		 operand1 = ReadFirstOperand();
-		 operand2 = ReadSecondRegister();
-		if (operand1 && operand2)
+	case 0xF0://pop
+		record.flags |= TRACE_MEMORY;
+		break;
+	case 0x84://test
+	case 0x74://cmp
+	case 0x00://halt
+		return;
+	}
+
+	record.flags = (record.flags & TRACE_MEMORY) | reg;
+	record.value = cpu.regs[reg];
+}
+
+// Execute one instruction, or jump to error routine in case of wrong opcode. Profiler,
+// trace and breakpoint code is compiled in only for run loops which ask for it.
+//
+template <int features>
+inline void Emulator::ExecuteNext()
+{
+	CpuState& cpu = *mState;
+
+	if (!CheckDeviceEvents(cpu))
+	{
+		return;
+	}
+
+	if ((features & BREAKPOINT_FEATURE) && !CheckBreakpoint(cpu))
+	{
+		return;
+	}
+
+	uint16_t pc = cpu.regs[PC];
+
+	if (features & PROFILE_FEATURE)
+	{
+		cpu.profileCounts[pc]++;
+	}
+
+	DecodedInstruction instruction = cpu.decodeCache[pc];
+	bool isDecoded = instruction.size != 0;
+
+	if (!isDecoded && !LoadInstruction(pc, instruction))
+	{
+		HandleWrongOpCode(cpu);
+
+		if ((features & TRACE_FEATURE) && !cpu.stop)
+		{
+			TraceRecord& record = cpu.trace->Next();
+			record = { pc, (uint8_t)cpu.memory[pc], PC, cpu.regs[PC], 0 };
+		}
+	}
+	else
+	{
+		// At this moment, PC points to next instruction
+		//
+		cpu.regs[PC] += instruction.size;
+		cpu.cycles++;
+		cpu.coveredLengths[pc] = instruction.size;
+
+		if (features & TRACE_FEATURE)
+		{
+			TraceRecord& record = cpu.trace->Next();
+
+			BeginTraceRecord(cpu, record, instruction, pc);
+			ExecuteInstruction(cpu, instruction);
+			EndTraceRecord(cpu, record, instruction);
+		}
+		else
+		{
+			ExecuteInstruction(cpu, instruction);
+		}
+
+		if (features & STATISTICS_FEATURE)
+		{
+			CountInstruction(cpu, instruction, 1);
+			cpu.counters.decodeCacheHits += isDecoded;
+
+			if (IsConditionalJump(instruction.opCode) && cpu.regs[PC] != (uint16_t)(pc + instruction.size))
+			{
+				cpu.counters.takenBranches++;
+			}
+			else if (IsConditionalJump(instruction.opCode))
+			{
+				cpu.counters.notTakenBranches++;
+			}
+		}
+	}
+}
+
+template <int features>
+void Emulator::RunInterpreter()
+{
+	CpuState& cpu = *mState;
+
+	while (!cpu.stop)
+	{
+		ExecuteNext<features>();
+	}
+}
+
+// Prepares limits of a run. Returns false if processor has already halted.
+//
+bool Emulator::BeginRun(uint64_t maxInstructions)
+{
+	CpuState& cpu = *mState;
+
+	cpu.stop = cpu.haltInstruction;
+	cpu.stopReason = STOP_HALT;
+	cpu.stopCycle = maxInstructions > NO_EVENT - cpu.cycles ? NO_EVENT : cpu.cycles + maxInstructions;
+	cpu.timeoutCheckCycle = NO_EVENT;
+	cpu.skipBreakpoint = true;
+
+	if (cpu.timeout != 0)
+	{
+		cpu.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(cpu.timeout);
+		cpu.timeoutCheckCycle = cpu.cycles + TIMEOUT_CHECK_CYCLES;
+	}
+
+	// Limits are taken into account by the first event check
+	//
+	cpu.nextEventCycle = 0;
+
+	return !cpu.stop;
+}
+
+StopReason Emulator::Run(uint64_t maxInstructions)
+{
+	CpuState& cpu = *mState;
+
+	if (!BeginRun(maxInstructions))
+	{
+		return cpu.stopReason;
+	}
+
+	// Lengths of single instructions would shorten those of blocks starting there
+	//
+	if (cpu.hasBlockCoverage)
+	{
+		FoldCoverage(cpu);
+	}
+
+	int features = (cpu.profileCounts.empty() ? 0 : PROFILE_FEATURE) |
+		(cpu.trace == nullptr ? 0 : TRACE_FEATURE) |
+		(cpu.breakpointCount == 0 ? 0 : BREAKPOINT_FEATURE) |
+		(cpu.isCountingInstructions ? STATISTICS_FEATURE : 0);
+
+	switch (features)
+	{
+	case 0: RunInterpreter<0>(); break;
+	case 1: RunInterpreter<1>(); break;
+	case 2: RunInterpreter<2>(); break;
+	case 3: RunInterpreter<3>(); break;
+	case 4: RunInterpreter<4>(); break;
+	case 5: RunInterpreter<5>(); break;
+	case 6: RunInterpreter<6>(); break;
+	case 7: RunInterpreter<7>(); break;
+	case 8: RunInterpreter<8>(); break;
+	case 9: RunInterpreter<9>(); break;
+	case 10: RunInterpreter<10>(); break;
+	case 11: RunInterpreter<11>(); break;
+	case 12: RunInterpreter<12>(); break;
+	case 13: RunInterpreter<13>(); break;
+	case 14: RunInterpreter<14>(); break;
+	case 15: RunInterpreter<15>(); break;
+	}
+
+	return cpu.stopReason;
+}
+
+StopReason Emulator::Step(uint64_t count)
+{
+	return Run(count);
+}
+
+// Run until instruction at address is about to execute
+//
+StopReason Emulator::RunToAddress(uint16_t address)
+{
+	CpuState& cpu = *mState;
+
+	if (cpu.regs[PC] == address)
+	{
+		return STOP_BREAKPOINT;
+	}
+
+	bool isSet = cpu.breakpoints[address];
+
+	AddBreakpoint(address);
+	StopReason reason = Run();
+
+	if (!isSet)
+	{
+		RemoveBreakpoint(address);
+	}
+
+	return reason;
+}
+
+void Emulator::AddBreakpoint(uint16_t address)
+{
+	CpuState& cpu = *mState;
+
+	if (cpu.breakpoints[address])
+	{
+		return;
+	}
+
+	cpu.breakpoints[address] = true;
+	cpu.breakpointCount++;
+
+	// Blocks are translated again, so that breakpoint starts a block
+	//
+	InvalidateDecodeCache(cpu, address);
+}
+
+void Emulator::RemoveBreakpoint(uint16_t address)
+{
+	CpuState& cpu = *mState;
+
+	if (cpu.breakpoints[address])
+	{
+		cpu.breakpoints[address] = false;
+		cpu.breakpointCount--;
+	}
+}
+
+void Emulator::SetTimeout(uint64_t milliseconds)
+{
+	CpuState& cpu = *mState;
+
+	cpu.timeout = milliseconds;
+}
+
+void Emulator::SetStopOnWrongOpCode(bool stop)
+{
+	CpuState& cpu = *mState;
+
+	cpu.stopOnWrongOpCode = stop;
+}
+
+void Emulator::EnableProfile()
+{
+	CpuState& cpu = *mState;
+
+	cpu.profileCounts.assign(65536, 0);
+}
+
+void Emulator::EnableTrace(size_t capacity, const std::string& outputFile)
+{
+	CpuState& cpu = *mState;
+
+	delete cpu.trace;
+	cpu.trace = new TraceRing(capacity, outputFile);
+
+	InstallTraceSignalHandler(cpu.trace);
+}
+
+void Emulator::EnableStatistics()
+{
+	CpuState& cpu = *mState;
+
+	cpu.isCountingInstructions = true;
+}
+
+// Same as Run(), but each handler jumps straight to handler of the next instruction
+// through table of label addresses, instead of returning to one shared switch. Programs
+// with breakpoints or instrumentation run on Run().
+//
+StopReason Emulator::RunThreaded(uint64_t maxInstructions)
+{
+	CpuState& cpu = *mState;
+
+	if (cpu.breakpointCount != 0 || !cpu.profileCounts.empty() || cpu.trace != nullptr || cpu.isCountingInstructions)
+	{
+		return Run(maxInstructions);
+	}
+
+	if (!BeginRun(maxInstructions))
+	{
+		return cpu.stopReason;
+	}
+
+	if (cpu.hasBlockCoverage)
+	{
+		FoldCoverage(cpu);
+	}
+
+#if defined(__GNUC__)
+	void* dispatchTable[256];
+
+	for (int i = 0; i < 256; i++)
+	{
+		dispatchTable[i] = &&wrongOpCode;
+	}
+
+	dispatchTable[0xB0] = &&str;
+	dispatchTable[0xA0] = &&ldr;
+	dispatchTable[0x91] = &&shr;
+	dispatchTable[0x90] = &&shl;
+	dispatchTable[0x84] = &&test;
+	dispatchTable[0x83] = &&xor_;
+	dispatchTable[0x82] = &&or_;
+	dispatchTable[0x81] = &&and_;
+	dispatchTable[0x80] = &&not_;
+	dispatchTable[0x74] = &&cmp;
+	dispatchTable[0x73] = &&div;
+	dispatchTable[0x72] = &&mul;
+	dispatchTable[0x71] = &&sub;
+	dispatchTable[0x70] = &&add;
+	dispatchTable[0x60] = &&xchg;
+	dispatchTable[0xF0] = &&pop;
+	dispatchTable[0xE0] = &&push;
+	dispatchTable[0x53] = &&jgt;
+	dispatchTable[0x52] = &&jne;
+	dispatchTable[0x51] = &&jeq;
+	dispatchTable[0x50] = &&jmp;
+	dispatchTable[0x40] = &&ret;
+	dispatchTable[0x30] = &&call;
+	dispatchTable[0x20] = &&iret;
+	dispatchTable[0x10] = &&int_;
+	dispatchTable[0x00] = &&halt;
+
+	DecodedInstruction instruction;
+
+#define DISPATCH() \
+	if (!CheckDeviceEvents(cpu)) \
+	{ \
+		return cpu.stopReason; \
+	} \
+	instruction = cpu.decodeCache[cpu.regs[PC]]; \
+	if (instruction.size == 0 && !LoadInstruction(cpu.regs[PC], instruction)) \
+	{ \
+		goto wrongOpCode; \
+	} \
+	cpu.cycles++; \
+	cpu.coveredLengths[cpu.regs[PC]] = instruction.size; \
+	if (instruction.touchesPSW) \
+	{ \
+		MaterializeFlags(cpu); \
+	} \
+	cpu.regs[PC] += instruction.size; \
+	goto *dispatchTable[instruction.opCode]
+
+	DISPATCH();
+
+wrongOpCode:
+	HandleWrongOpCode(cpu);
+
+	if (cpu.stop)
+	{
+		return cpu.stopReason;
+	}
+
+	DISPATCH();
+str:
+	Str::Execute(cpu, instruction);
+	DISPATCH();
+ldr:
+	Ldr::Execute(cpu, instruction);
+	DISPATCH();
+shr:
+	Shr::Execute(cpu, instruction);
+	DISPATCH();
+shl:
+	Shl::Execute(cpu, instruction);
+	DISPATCH();
+test:
+	Test::Execute(cpu, instruction);
+	DISPATCH();
+xor_:
+	Xor::Execute(cpu, instruction);
+	DISPATCH();
+or_:
+	Or::Execute(cpu, instruction);
+	DISPATCH();
+and_:
+	And::Execute(cpu, instruction);
+	DISPATCH();
+not_:
+	Not::Execute(cpu, instruction);
+	DISPATCH();
+cmp:
+	Cmp::Execute(cpu, instruction);
+	DISPATCH();
+div:
+	Div::Execute(cpu, instruction);
+	DISPATCH();
+mul:
+	Mul::Execute(cpu, instruction);
+	DISPATCH();
+sub:
+	Sub::Execute(cpu, instruction);
+	DISPATCH();
+add:
+	Add::Execute(cpu, instruction);
+	DISPATCH();
+xchg:
+	Xchg::Execute(cpu, instruction);
+	DISPATCH();
+pop:
+	Pop::Execute(cpu, instruction);
+	DISPATCH();
+push:
+	Push::Execute(cpu, instruction);
+	DISPATCH();
+jgt:
+	Jgt::Execute(cpu, instruction);
+	DISPATCH();
+jne:
+	Jne::Execute(cpu, instruction);
+	DISPATCH();
+jeq:
+	Jeq::Execute(cpu, instruction);
+	DISPATCH();
+jmp:
+	Jmp::Execute(cpu, instruction);
+	DISPATCH();
+ret:
+	Ret::Execute(cpu, instruction);
+	DISPATCH();
+call:
+	Call::Execute(cpu, instruction);
+	DISPATCH();
+iret:
+	Iret::Execute(cpu, instruction);
+	DISPATCH();
+int_:
+	Int::Execute(cpu, instruction);
+
+	// Semihosted exit
+	//
+	if (cpu.stop)
+	{
+		return cpu.stopReason;
+	}
+
+	DISPATCH();
+halt:
+	Halt::Execute(cpu, instruction);
+	return cpu.stopReason;
+
+#undef DISPATCH
+#else
+	// Labels as values are GCC/Clang extension
+	//
+	return Run(maxInstructions);
+#endif
+}
+
+// Jumps and compares, which write nothing but flags. Instructions reading whole PSW are
+// left out, since their result changes with flags.
+//
+bool IsIdleInstruction(const DecodedInstruction& instruction)
+{
+	switch (instruction.opCode)
+	{
+	case 0x84://test
+	case 0x74://cmp
+	case 0x53://jgt
+	case 0x52://jne
+	case 0x51://jeq
+	case 0x50://jmp
+		return !instruction.touchesPSW;
+	default:
+		return false;
+	}
+}
+
+// Instructions after which execution does not simply continue with next instruction
+//
+bool EndsBasicBlock(const DecodedInstruction& instruction)
+{
+	switch (instruction.opCode)
+	{
+	case 0x53://jgt
+	case 0x52://jne
+	case 0x51://jeq
+	case 0x50://jmp
+	case 0x40://ret
+	case 0x30://call
+	case 0x20://iret
+	case 0x10://int
+	case 0x00://halt
+		return true;
+	case 0xB0://str
+		return instruction.addrMode == REGDIR && instruction.regS == PC;
+	case 0x60://xchg
+		return instruction.regD == PC || instruction.regS == PC;
+	case 0xE0://push
+	case 0x84://test
+	case 0x74://cmp
+		return false;
+	default:
+		// Instruction writes to its first register
+		//
+		return instruction.regD == PC;
+	}
+}
+
+// Address of next instruction is known inside of block, so PC relative operands become absolute
+//
+void ResolvePCRelative(DecodedInstruction& instruction, uint16_t next)
+{
+	switch (instruction.opCode)
+	{
+	case 0xB0://str
+	case 0xA0://ldr
+		if (instruction.addrMode == MEMDIR_SYMBOL_PCREL)
 		{
-			instruction = new Shl();
-			instruction->AppendOperand(operand1);
-			instruction->AppendOperand(operand2);
+			instruction.addrMode = MEMDIR_SYMBOL_ABS;
+			instruction.payload += next;
 		}
 		break;
-	case 0x84://test
-		operand1 = ReadFirstOperand();
-		operand2 = ReadSecondRegister();
-		if (operand1 && operand2)
+	case 0x53://jgt
+	case 0x52://jne
+	case 0x51://jeq
+	case 0x50://jmp
+	case 0x30://call
+		if (instruction.addrMode == IMMEDIATE_SYMBOL_VALUE_PCREL_JMP)
 		{
-			instruction = new Test();
-			instruction->AppendOperand(operand1);
-			instruction->AppendOperand(operand2);
+			instruction.addrMode = IMMEDIATE_SYMBOL_VALUE_ABS_JMP;
+			instruction.payload += next;
 		}
 		break;
-	case 0x83://xor
-		operand1 = ReadFirstOperand();
-		operand2 = ReadSecondRegister();
-		if (operand1 && operand2)
+	}
+}
+
+BasicBlock* Emulator::TranslateBlock(uint16_t address)
+{
+	CpuState& cpu = *mState;
+
+	BasicBlock* block = new BasicBlock();
+	DecodedInstruction instruction;
+	uint16_t pc = address;
+
+	// Breakpoint is checked only at block starts, so it ends the block before it
+	//
+	while (block->microOps.size() < MAX_BLOCK_INSTRUCTIONS && !(cpu.breakpoints[pc] && !block->microOps.empty()) &&
+		LoadInstruction(pc, instruction))
+	{
+		pc += instruction.size;
+
+		ResolvePCRelative(instruction, pc);
+		block->microOps.push_back(instruction);
+
+		// Decoding near the end of memory could fail with error, which must happen only if
+		// that instruction is really executed
+		//
+		if (EndsBasicBlock(instruction) || pc > 0xFFFF - MAX_INSTRUCTION_SIZE)
 		{
-			instruction = new Xor();
-			instruction->AppendOperand(operand1);
-			instruction->AppendOperand(operand2);
+			break;
 		}
-		break;
-	case 0x82://or
-		operand1 = ReadFirstOperand();
-		operand2 = ReadSecondRegister();
-		if (operand1 && operand2)
+	}
+
+	if (block->microOps.empty())
+	{
+		delete block;
+		return nullptr;
+	}
+
+	block->start = address;
+	block->end = pc;
+	block->valid = true;
+	block->idle = std::all_of(block->microOps.begin(), block->microOps.end(), IsIdleInstruction);
+	block->executions = 0;
+	block->compiled = nullptr;
+
+	// Compiled valid checks lower it, a store by call or int at the end leaves it as is
+	//
+	block->executedMicroOps = block->microOps.size();
+
+	cpu.blockCache[address] = block;
+
+	return block;
+}
+
+// Translated block at PC, or nullptr in case of wrong opcode
+//
+BasicBlock* Emulator::LookupBlock()
+{
+	CpuState& cpu = *mState;
+
+	if (!cpu.retiredBlocks.empty())
+	{
+		for (auto block : cpu.retiredBlocks)
+		{
+			delete block;
+		}
+
+		cpu.retiredBlocks.clear();
+	}
+
+	BasicBlock* block = cpu.blockCache[cpu.regs[PC]];
+
+	if (block != nullptr)
+	{
+		cpu.counters.blockCacheHits++;
+		return block;
+	}
+
+	cpu.counters.blockCacheMisses++;
+
+	return TranslateBlock(cpu.regs[PC]);
+}
+
+void Emulator::InterpretBlock(BasicBlock* block)
+{
+	CpuState& cpu = *mState;
+
+	cpu.coveredLengths[block->start] = block->end - block->start;
+	block->runs++;
+
+	for (size_t i = 0; i < block->microOps.size(); i++)
+	{
+		const DecodedInstruction& instruction = block->microOps[i];
+
+		cpu.regs[PC] += instruction.size;
+		ExecuteInstruction(cpu, instruction);
+		cpu.counters.blockInstructions++;
+		cpu.cycles++;
+
+		// Store has overwritten code of this block, rest of it must be decoded again
+		//
+		if (!block->valid)
+		{
+			UncountBlockRest(cpu, block, i + 1);
+			break;
+		}
+	}
+
+	block->takenBranches += cpu.regs[PC] != block->end;
+}
+
+// Idle block which has just jumped back to itself would run the same way until next
+// device event, so clock moves there at once. It moves by whole runs of the block, so
+// that the event is seen at the same block boundary as without skipping.
+//
+inline void SkipIdleLoop(CpuState& cpu, const BasicBlock* block)
+{
+	if (!block->idle || cpu.regs[PC] != block->start || cpu.stop ||
+		cpu.nextEventCycle == NO_EVENT || cpu.nextEventCycle <= cpu.cycles)
+	{
+		return;
+	}
+
+	uint64_t length = block->microOps.size();
+	uint64_t skipped = (cpu.nextEventCycle - cpu.cycles + length - 1) / length * length;
+
+	cpu.cycles += skipped;
+	cpu.idleCycles += skipped;
+}
+
+// Executes whole translated blocks at a time, so that per instruction work is only
+// running micro-ops, while lookups happen once per block. Instruction budget is checked
+// once per block too, so run may end up to one block past it. Instrumented programs
+// run on Run().
+//
+StopReason Emulator::RunBlocks(uint64_t maxInstructions)
+{
+	CpuState& cpu = *mState;
+
+	if (!cpu.profileCounts.empty() || cpu.trace != nullptr)
+	{
+		return Run(maxInstructions);
+	}
+
+	if (!BeginRun(maxInstructions))
+	{
+		return cpu.stopReason;
+	}
+
+	cpu.hasBlockCoverage = true;
+
+	while (!cpu.stop)
+	{
+		if (!CheckDeviceEvents(cpu) || !CheckBreakpoint(cpu))
+		{
+			break;
+		}
+
+		BasicBlock* block = LookupBlock();
+
+		// In case of wrong opcode
+		//
+		if (block == nullptr)
+		{
+			HandleWrongOpCode(cpu);
+			continue;
+		}
+
+		InterpretBlock(block);
+		SkipIdleLoop(cpu, block);
+	}
+
+	return cpu.stopReason;
+}
+
+// Same as RunBlocks(), but blocks which are interpreted JIT_THRESHOLD times get compiled
+// to native code, which is used from then on. Compiled code stays valid between runs.
+//
+StopReason Emulator::RunJit(uint64_t maxInstructions)
+{
+	CpuState& cpu = *mState;
+
+	if (!cpu.profileCounts.empty() || cpu.trace != nullptr)
+	{
+		return Run(maxInstructions);
+	}
+
+	if (mJit == nullptr)
+	{
+		mJit = new JitCompiler(cpu);
+	}
+
+	JitCompiler& jit = *mJit;
+
+	if (!jit.IsAvailable())
+	{
+		return RunBlocks(maxInstructions);
+	}
+
+	if (!BeginRun(maxInstructions))
+	{
+		return cpu.stopReason;
+	}
+
+	cpu.hasBlockCoverage = true;
+
+	while (!cpu.stop)
+	{
+		if (!CheckDeviceEvents(cpu) || !CheckBreakpoint(cpu))
+		{
+			break;
+		}
+
+		BasicBlock* block = LookupBlock();
+
+		// In case of wrong opcode
+		//
+		if (block == nullptr)
+		{
+			HandleWrongOpCode(cpu);
+			continue;
+		}
+
+		if (block->compiled == nullptr && ++block->executions == JIT_THRESHOLD)
+		{
+			block->compiled = jit.Compile(block);
+
+			if (block->compiled == nullptr)
+			{
+				// Executable memory is full, start over
+				//
+				for (int i = 0; i < 65536; i++)
+				{
+					if (cpu.blockCache[i] != nullptr)
+					{
+						cpu.blockCache[i]->compiled = nullptr;
+						cpu.blockCache[i]->executions = 0;
+					}
+				}
+
+				jit.Reset();
+				block->compiled = jit.Compile(block);
+			}
+		}
+
+		if (block->compiled != nullptr)
+		{
+			// Compiled code keeps flags in PSW
+			//
+			MaterializeFlags(cpu);
+			cpu.coveredLengths[block->start] = block->end - block->start;
+			block->runs++;
+			block->compiled();
+
+			size_t executed = block->microOps.size();
+
+			if (block->valid)
+			{
+				block->takenBranches += cpu.regs[PC] != block->end;
+			}
+			else
+			{
+				executed = block->executedMicroOps;
+				UncountBlockRest(cpu, block, executed);
+			}
+
+			if (cpu.jitError)
+			{
+				std::exception_ptr error = cpu.jitError;
+				cpu.jitError = nullptr;
+				std::rethrow_exception(error);
+			}
+
+			cpu.counters.blockInstructions += executed;
+			cpu.cycles += executed;
+		}
+		else
+		{
+			InterpretBlock(block);
+		}
+
+		SkipIdleLoop(cpu, block);
+	}
+
+	return cpu.stopReason;
+}
+
+void Emulator::SetNativeCode(NativeCode code, const NativeBlock* blocks, size_t count)
+{
+	CpuState& cpu = *mState;
+
+	cpu.nativeCode = code;
+	cpu.nativeBlockSizes.assign(65536, 0);
+
+	// Stores to translated code have to find it, same as stores to decoded code
+	//
+	for (size_t i = 0; i < count; i++)
+	{
+		cpu.nativeBlockSizes[blocks[i].start] = blocks[i].size;
+
+		for (int j = 0; j < blocks[i].size; j++)
+		{
+			cpu.watchedBytes[(uint16_t)(blocks[i].start + j)] |= CODE_BYTE;
+		}
+	}
+}
+
+// Native code chains blocks on its own and comes back only when it leaves translated code
+// or an event is due. Programs with breakpoints or instrumentation run on Run().
+//
+StopReason Emulator::RunNative(uint64_t maxInstructions)
+{
+	CpuState& cpu = *mState;
+
+	if (cpu.nativeCode == nullptr || cpu.breakpointCount != 0 || !cpu.profileCounts.empty() || cpu.trace != nullptr)
+	{
+		return Run(maxInstructions);
+	}
+
+	if (!BeginRun(maxInstructions))
+	{
+		return cpu.stopReason;
+	}
+
+	cpu.hasBlockCoverage = true;
+
+	while (!cpu.stop)
+	{
+		if (!CheckDeviceEvents(cpu))
+		{
+			break;
+		}
+
+		if (cpu.nativeBlockSizes[cpu.regs[PC]] != 0)
+		{
+			// Native code keeps flags in PSW
+			//
+			MaterializeFlags(cpu);
+			cpu.nativeCode(cpu);
+			continue;
+		}
+
+		BasicBlock* block = LookupBlock();
+
+		// In case of wrong opcode
+		//
+		if (block == nullptr)
 		{
-			instruction = new Or();
-			instruction->AppendOperand(operand1);
-			instruction->AppendOperand(operand2);
+			HandleWrongOpCode(cpu);
+			continue;
 		}
+
+		InterpretBlock(block);
+		SkipIdleLoop(cpu, block);
+	}
+
+	return cpu.stopReason;
+}
+
+void Emulator::OutputResult(std::ostream& output)
+{
+	CpuState& cpu = *mState;
+
+	// Run may have stopped with guest output still queued, it comes before the report
+	//
+	FlushTerminal(cpu);
+
+	std::bitset<16> pswRepresentation = cpu.regs[PSW];
+	output<<"\n---------------------------------------------------------\n";
+
+	switch (cpu.stopReason)
+	{
+	case STOP_HALT:
+		output<<"Emulated processor executed halt instruction\n";
 		break;
-	case 0x81://and
-		operand1 = ReadFirstOperand();
-		operand2 = ReadSecondRegister();
-		if (operand1 && operand2)
+	case STOP_BUDGET:
+		output<<"Emulated processor stopped: instruction budget exhausted\n";
+		break;
+	case STOP_WRONG_OPCODE:
+		output<<"Emulated processor stopped: wrong operation code\n";
+		break;
+	case STOP_BREAKPOINT:
+		output<<"Emulated processor stopped: breakpoint at 0x"<<std::hex<<cpu.regs[PC]<<std::dec<<"\n";
+		break;
+	case STOP_TIMEOUT:
+		output<<"Emulated processor stopped: timeout\n";
+		break;
+	case STOP_EXIT:
+		output<<"Emulated program exited with code "<<cpu.semihost.exitCode<<"\n";
+		break;
+	}
+
+	output<<"Emulated processor state: psw=0b"<<pswRepresentation<<"\n";
+
+	for (int i=0;i<4;i++)
+	{
+				output<<"r"<<i<<"=";
+				char hex_string[20];
+				sprintf(hex_string, "%.4X", cpu.regs[i]);
+				std::string regHex = hex_string;
+				regHex = regHex.substr(regHex.size() - 4);
+				regHex.insert(0, "0x");
+				output << std::setw(4) << regHex <<"\t";
+	}
+
+	output<<'\n';
+
+		for (int i=4;i<8;i++)
+	{
+				output<<"r"<<i<<"=";
+				char hex_string[20];
+				sprintf(hex_string, "%.4X", cpu.regs[i]);
+				std::string regHex = hex_string;
+				regHex = regHex.substr(regHex.size() - 4);
+				regHex.insert(0, "0x");
+				output << std::setw(4) << regHex <<"\t";
+	}
+
+	output<<'\n';
+}
+
+void Emulator::OutputBlockStatistics(std::ostream& output)
+{
+	CpuState& cpu = *mState;
+
+	const RunCounters& counters = cpu.counters;
+
+	uint64_t blocks = counters.blockCacheHits + counters.blockCacheMisses;
+	double hitRate = blocks == 0 ? 0 : 100.0 * counters.blockCacheHits / blocks;
+	double averageLength = blocks == 0 ? 0 : (double)counters.blockInstructions / blocks;
+
+	output << "Block cache: hits=" << counters.blockCacheHits << " misses=" << counters.blockCacheMisses;
+	output << std::fixed << std::setprecision(2) << " hit rate=" << hitRate << "%";
+	output << " average block length=" << averageLength << "\n";
+	output << "Idle loops: skipped cycles=" << cpu.idleCycles << "\n";
+}
+
+void Emulator::OutputStatistics(std::ostream& output, uint64_t runNanoseconds)
+{
+	EmulatorStatistics statistics = GetStatistics();
+
+	double mips = runNanoseconds == 0 ? 0 : statistics.instructions * 1000.0 / runNanoseconds;
+
+	output << std::fixed << std::setprecision(3);
+	output << "{\n";
+	output << "  \"instructions\": " << statistics.instructions << ",\n";
+	output << "  \"cycles\": " << statistics.cycles << ",\n";
+	output << "  \"run_ns\": " << runNanoseconds << ",\n";
+	output << "  \"mips\": " << mips << ",\n";
+	output << "  \"loads\": " << statistics.loads << ",\n";
+	output << "  \"stores\": " << statistics.stores << ",\n";
+	output << "  \"taken_branches\": " << statistics.takenBranches << ",\n";
+	output << "  \"not_taken_branches\": " << statistics.notTakenBranches << ",\n";
+	output << "  \"interrupts\": " << statistics.interrupts << ",\n";
+	output << "  \"decode_cache_hits\": " << statistics.decodeCacheHits << ",\n";
+	output << "  \"decode_cache_misses\": " << statistics.decodeCacheMisses << ",\n";
+	output << "  \"block_cache_hits\": " << statistics.blockCacheHits << ",\n";
+	output << "  \"block_cache_misses\": " << statistics.blockCacheMisses << ",\n";
+	output << "  \"opcodes\": {";
+
+	// Only opcodes which were executed
+	//
+	bool isFirst = true;
+
+	for (int opCode = 0; opCode < 256; opCode++)
+	{
+		if (statistics.opCodes[opCode] != 0)
 		{
-			instruction = new And();
-			instruction->AppendOperand(operand1);
-			instruction->AppendOperand(operand2);
+			output << (isFirst ? "\n" : ",\n") << "    \"" << Mnemonic(opCode) << "\": " << statistics.opCodes[opCode];
+			isFirst = false;
 		}
+	}
+
+	output << (isFirst ? "}\n" : "\n  }\n");
+	output << "}\n";
+}
+
+// Decoded instruction at address, taken from decode cache when it is already there
+//
+bool Emulator::LoadInstruction(uint16_t address, DecodedInstruction& instruction)
+{
+	CpuState& cpu = *mState;
+
+	instruction = cpu.decodeCache[address];
+
+	if (instruction.size != 0)
+	{
+		cpu.counters.decodeCacheHits++;
+		return true;
+	}
+
+	cpu.counters.decodeCacheMisses++;
+
+	// Misses are rare enough that timing them costs nothing measurable
+	//
+	auto decodeBegin = std::chrono::steady_clock::now();
+
+	if (!ReadInstruction(address, instruction))
+	{
+		return false;
+	}
+
+	cpu.decodeCache[address] = instruction;
+
+	for (int i = 0; i < instruction.size; i++)
+	{
+		cpu.watchedBytes[(uint16_t)(address + i)] |= CODE_BYTE;
+	}
+
+	cpu.decodeNanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - decodeBegin).count();
+
+	return true;
+}
+
+bool Emulator::ReadInstruction(uint16_t address, DecodedInstruction& instruction)
+{
+	CpuState& cpu = *mState;
+
+	uint16_t pc = address;
+	bool valid = false;
+
+	instruction = {};
+	instruction.opCode = FetchByte(cpu, pc);
+
+	switch (instruction.opCode)
+	{
+	case 0xB0://str rx, operand
+		instruction.regD = (cpu.memory[pc] >> 4) & 0x0F;
+		instruction.regS = cpu.memory[pc] & 0x0F;
+		FetchByte(cpu, pc);
+		valid = ReadSecondOperand(cpu, pc, instruction) && instruction.regD <= 8 &&
+			instruction.addrMode != IMMEDIATE && instruction.addrMode != IMMEDIATE_SYMBOL_VALUE;
 		break;
-	case 0x80://not
-		operand1 = ReadFirstOperand();
-		if (operand1)
-		{
-			instruction = new Not();
-			instruction->AppendOperand(operand1);
-		}
+	case 0xA0://ldr
+		instruction.regD = (cpu.memory[pc] >> 4) & 0x0F;
+		instruction.regS = cpu.memory[pc] & 0x0F;
+		FetchByte(cpu, pc);
+		valid = ReadSecondOperand(cpu, pc, instruction) && instruction.regD <= 8;
 		break;
+	case 0x91://shr
+	case 0x90://shl
+	case 0x84://test
+	case 0x83://xor
+	case 0x82://or
+	case 0x81://and
 	case 0x74://cmp
-		operand1 = ReadFirstOperand();
-		operand2 = ReadSecondRegister();
-		if (operand1 && operand2)
-		{
-			instruction = new Cmp();
-			instruction->AppendOperand(operand1);
-			instruction->AppendOperand(operand2);
-		}
-		break;
 	case 0x73://div
-		operand1 = ReadFirstOperand();
-		operand2 = ReadSecondRegister();
-		if (operand1 && operand2)
-		{
-			instruction = new Div();
-			instruction->AppendOperand(operand1);
-			instruction->AppendOperand(operand2);
-		}
-		break;
 	case 0x72://mul
-		operand1 = ReadFirstOperand();
-		operand2 = ReadSecondRegister();
-		if (operand1 && operand2)
-		{
-			instruction = new Mul();
-			instruction->AppendOperand(operand1);
-			instruction->AppendOperand(operand2);
-		}
-		break;
 	case 0x71://sub
-		operand1 = ReadFirstOperand();
-		operand2 = ReadSecondRegister();
-		if (operand1 && operand2)
-		{
-			instruction = new Sub();
-			instruction->AppendOperand(operand1);
-			instruction->AppendOperand(operand2);
-		}
-		break;
 	case 0x70://add
-		operand1 = ReadFirstOperand();
-		operand2 = ReadSecondRegister();
-		if (operand1 && operand2)
-		{
-			instruction = new Add();
-			instruction->AppendOperand(operand1);
-			instruction->AppendOperand(operand2);
-		}
-		break;
 	case 0x60://xchg
-		operand1 = ReadFirstOperand();
-		operand2 = ReadSecondRegister();
-		if (operand1 && operand2)
-		{
-			instruction = new Xchg();
-			instruction->AppendOperand(operand1);
-			instruction->AppendOperand(operand2);
-		}
+		instruction.regD = (cpu.memory[pc] >> 4) & 0x0F;
+		instruction.regS = cpu.memory[pc] & 0x0F;
+		FetchByte(cpu, pc);
+		valid = instruction.regD <= 8 && instruction.regS <= 8;
 		break;
+	case 0x80://not
 	case 0xF0://pop
-		operand1 = ReadFirstOperand();
-		if (operand1)
-		{
-			instruction = new Pop();
-			instruction->AppendOperand(operand1);
-		}
-		break;
 	case 0xE0://push
-		operand1 = ReadFirstOperand();
-		if (operand1)
-		{
-			instruction = new Push();
-			instruction->AppendOperand(operand1);
-		}
+	case 0x10://int
+		instruction.regD = (cpu.memory[pc] >> 4) & 0x0F;
+		FetchByte(cpu, pc);
+		valid = instruction.regD <= 8;
 		break;
 	case 0x53://jgt
-		// Just to move PC
-		//
-		ReadFirstOperand();
-		operand = ReadSecondOperand();
-		if (operand && operand->GetType() >= 9)
-		{
-			instruction = new Jgt();
-			instruction->AppendOperand(operand);
-		}
-		break;
 	case 0x52://jne
-		ReadFirstOperand();
-		operand = ReadSecondOperand();
-		if (operand && operand->GetType() >= 9)
-		{
-			instruction = new Jne();
-			instruction->AppendOperand(operand);
-		}
-		break;
 	case 0x51://jeq
-		ReadFirstOperand();
-		operand = ReadSecondOperand();
-		if (operand && operand->GetType() >= 9)
-		{
-			instruction = new Jeq();
-			instruction->AppendOperand(operand);
-		}
-		break;
 	case 0x50://jmp
-		ReadFirstOperand();
-		operand = ReadSecondOperand();
-		if (operand && operand->GetType() >= 9)
-		{
-			instruction = new Jmp();
-			instruction->AppendOperand(operand);
-		}
-		break;
-	case 0x40://ret
-		instruction = new Ret();
-		break;
 	case 0x30://call
-		ReadFirstOperand();
-		operand = ReadSecondOperand();
-		if (operand && operand->GetType() >= 9)
-		{
-			instruction = new Call();
-			instruction->AppendOperand(operand);
-		}
+		// Register descriptor holds only register of second operand
+		//
+		instruction.regS = cpu.memory[pc] & 0x0F;
+		FetchByte(cpu, pc);
+		valid = ReadSecondOperand(cpu, pc, instruction) && instruction.addrMode >= IMMEDIATE_JMP;
 		break;
+	case 0x40://ret
 	case 0x20://iret
-		instruction = new Iret();
-		break;
-	case 0x10://int
-		operand = ReadFirstOperand();
-		if (operand)
-		{
-			instruction = new Int();
-			instruction->AppendOperand(operand);
-		}
-		break;
 	case 0x00://halt
-		instruction = new Halt();
+		valid = true;
 		break;
 	}
 
-	return instruction;
-}
+	if (!valid)
+	{
+		return false;
+	}
 
+	instruction.size = pc - address;
 
-void Operand::SetRegister(uint16_t reg)
-{
-	mRegister = reg;
-}
+	// Pending flags have to be in PSW before instruction reads or overwrites it
+	//
+	instruction.touchesPSW = instruction.regD == PSW || instruction.regS == PSW ||
+		instruction.opCode == 0x10 || instruction.opCode == 0x20;
 
-void Operand::SetOperandValue(uint16_t value)
-{
-	operandValue = value;
+	return true;
 }
 
-Operand::Operand()
+void Emulator::ExecuteInstruction(CpuState& cpu, const DecodedInstruction& instruction)
 {
-	mLiteral = 0;
-	mSymbol = "";
-	mRegister = 0;
-	operandValue = 0;
-}
+	if (instruction.touchesPSW)
+	{
+		MaterializeFlags(cpu);
+	}
 
-uint16_t Operand::GetLiteral() const
-{
-	return mLiteral;
+	switch (instruction.opCode)
+	{
+	case 0xB0: Str::Execute(cpu, instruction); break;
+	case 0xA0: Ldr::Execute(cpu, instruction); break;
+	case 0x91: Shr::Execute(cpu, instruction); break;
+	case 0x90: Shl::Execute(cpu, instruction); break;
+	case 0x84: Test::Execute(cpu, instruction); break;
+	case 0x83: Xor::Execute(cpu, instruction); break;
+	case 0x82: Or::Execute(cpu, instruction); break;
+	case 0x81: And::Execute(cpu, instruction); break;
+	case 0x80: Not::Execute(cpu, instruction); break;
+	case 0x74: Cmp::Execute(cpu, instruction); break;
+	case 0x73: Div::Execute(cpu, instruction); break;
+	case 0x72: Mul::Execute(cpu, instruction); break;
+	case 0x71: Sub::Execute(cpu, instruction); break;
+	case 0x70: Add::Execute(cpu, instruction); break;
+	case 0x60: Xchg::Execute(cpu, instruction); break;
+	case 0xF0: Pop::Execute(cpu, instruction); break;
+	case 0xE0: Push::Execute(cpu, instruction); break;
+	case 0x53: Jgt::Execute(cpu, instruction); break;
+	case 0x52: Jne::Execute(cpu, instruction); break;
+	case 0x51: Jeq::Execute(cpu, instruction); break;
+	case 0x50: Jmp::Execute(cpu, instruction); break;
+	case 0x40: Ret::Execute(cpu, instruction); break;
+	case 0x30: Call::Execute(cpu, instruction); break;
+	case 0x20: Iret::Execute(cpu, instruction); break;
+	case 0x10: Int::Execute(cpu, instruction); break;
+	case 0x00: Halt::Execute(cpu, instruction); break;
+	}
 }
 
-std::string Operand::GetSymbol() const
+void Halt::Execute(CpuState& cpu, const DecodedInstruction&)
 {
-	return mSymbol;
-}
+	// End execution
+	//
+	cpu.haltInstruction = true;
+	StopRun(cpu, STOP_HALT);
 
-OperandType Operand::GetType() const
-{
-	return mOperandType;
-}
+	// State is inspected once processor halts
+	//
+	MaterializeFlags(cpu);
 
-uint16_t Operand::GetRegister() const
-{
-	return mRegister;
+	// Guest output comes before report of processor state
+	//
+	FlushTerminal(cpu);
 }
 
-uint16_t Operand::GetOperandValue() const
+void Add::Execute(CpuState& cpu, const DecodedInstruction& instruction)
 {
-	return operandValue;
-}
+	uint8_t regD = instruction.regD;
 
-void Operand::SetType(OperandType type)
-{
-	mOperandType = type;
+	cpu.regs[regD] = cpu.regs[regD] + cpu.regs[instruction.regS];
 }
 
-void Operand::SetLiteral(uint16_t literal)
+void Sub::Execute(CpuState& cpu, const DecodedInstruction& instruction)
 {
-	mLiteral = literal;
-}
+	uint8_t regD = instruction.regD;
 
-void Operand::SetSymbol(std::string symbol)
-{
-	mSymbol = symbol;
+	cpu.regs[regD] = cpu.regs[regD] - cpu.regs[instruction.regS];
 }
 
-void Instruction::AppendOperand(Operand* operand)
+void Mul::Execute(CpuState& cpu, const DecodedInstruction& instruction)
 {
-	operands.push_back(operand);
-}
+	uint8_t regD = instruction.regD;
 
-void Halt::Execute()
-{
-	// End execution
-	//
-	haltInstruction = true;
+	cpu.regs[regD] = cpu.regs[regD] * cpu.regs[instruction.regS];
 }
 
-void Add::Execute()
+void Div::Execute(CpuState& cpu, const DecodedInstruction& instruction)
 {
-	uint8_t regD = operands[0]->GetRegister();
+	uint8_t regD = instruction.regD;
 
-	regs[regD] = operands[0]->GetOperandValue() + operands[1]->GetOperandValue();
+	cpu.regs[regD] = cpu.regs[regD] / cpu.regs[instruction.regS];
 }
 
-void Sub::Execute()
+void Not::Execute(CpuState& cpu, const DecodedInstruction& instruction)
 {
-	uint8_t regD = operands[0]->GetRegister();
+	uint8_t regD = instruction.regD;
 
-	regs[regD] = operands[0]->GetOperandValue() - operands[1]->GetOperandValue();
+	cpu.regs[regD] = ~cpu.regs[regD];
 }
 
-void Mul::Execute()
+void And::Execute(CpuState& cpu, const DecodedInstruction& instruction)
 {
-	uint8_t regD = operands[0]->GetRegister();
+	uint8_t regD = instruction.regD;
 
-	regs[regD] = operands[0]->GetOperandValue() * operands[1]->GetOperandValue();
+	cpu.regs[regD] = cpu.regs[regD] & cpu.regs[instruction.regS];
 }
 
-void Div::Execute()
+void Or::Execute(CpuState& cpu, const DecodedInstruction& instruction)
 {
-	uint8_t regD = operands[0]->GetRegister();
+	uint8_t regD = instruction.regD;
 
-	regs[regD] = operands[0]->GetOperandValue() / operands[1]->GetOperandValue();
+	cpu.regs[regD] = cpu.regs[regD] | cpu.regs[instruction.regS];
 }
 
-void Not::Execute()
+void Xor::Execute(CpuState& cpu, const DecodedInstruction& instruction)
 {
-	uint8_t regD = operands[0]->GetRegister();
+	uint8_t regD = instruction.regD;
 
-	regs[regD] = ~operands[0]->GetOperandValue();
+	cpu.regs[regD] = cpu.regs[regD] ^ cpu.regs[instruction.regS];
 }
 
-void And::Execute()
+void Xchg::Execute(CpuState& cpu, const DecodedInstruction& instruction)
 {
-	uint8_t regD = operands[0]->GetRegister();
+	uint8_t regD = instruction.regD;
+	uint8_t regS = instruction.regS;
 
-	regs[regD] = operands[0]->GetOperandValue() & operands[1]->GetOperandValue();
+	uint8_t temp = cpu.regs[regD];
+	cpu.regs[regD] = cpu.regs[regS];
+	cpu.regs[regS] = temp;
 }
 
-void Or::Execute()
+void Push::Execute(CpuState& cpu, const DecodedInstruction& instruction)
 {
-	uint8_t regD = operands[0]->GetRegister();
+	uint16_t value = cpu.regs[instruction.regD];
 
-	regs[regD] = operands[0]->GetOperandValue() | operands[1]->GetOperandValue();
+	cpu.regs[SP] -= 2;
+
+	WriteWord(cpu, cpu.regs[SP], value);
 }
 
-void Xor::Execute()
+void Pop::Execute(CpuState& cpu, const DecodedInstruction& instruction)
 {
-	uint8_t regD = operands[0]->GetRegister();
+	uint16_t regD = instruction.regD;
+
+	uint16_t value = ReadWord(cpu, cpu.regs[SP]);
 
-	regs[regD] = operands[0]->GetOperandValue() ^ operands[1]->GetOperandValue();
+	cpu.regs[regD] = value;
+
+	cpu.regs[SP] += 2;
 }
 
-void Xchg::Execute()
+void Test::Execute(CpuState& cpu, const DecodedInstruction& instruction)
 {
-	uint8_t regD = operands[0]->GetRegister();
-	uint8_t regS = operands[1]->GetRegister();
+	uint16_t operandD = cpu.regs[instruction.regD];
+	uint16_t operandS = cpu.regs[instruction.regS];
 
-	uint8_t temp = regs[regD];
-	regs[regD] = regs[regS];
-	regs[regS] = temp;
+	RecordFlagOperation(cpu, TEST_FLAGS, operandD, operandS, operandD & operandS);
 }
 
-void Push::Execute()
+void Shl::Execute(CpuState& cpu, const DecodedInstruction& instruction)
 {
-	regs[SP] -= 2;
+	uint8_t regD = instruction.regD;
+	uint16_t operandD = cpu.regs[instruction.regD];
+	uint16_t operandS = cpu.regs[instruction.regS];
+
+	uint16_t value = operandD << operandS;
 
-	uint8_t low = operands[0]->GetOperandValue() & 0x00FF;
-	uint8_t high = (operands[0]->GetOperandValue() >> 8) & 0x00FF;
+	cpu.regs[regD] = value;
 
-	memory[regs[SP]] = low;
-	memory[regs[SP] + 1] = high;
+	// Result is written again after flags, so shl psw leaves no flags behind
+	//
+	if (regD != PSW)
+	{
+		RecordFlagOperation(cpu, SHL_FLAGS, operandD, operandS, value);
+	}
 }
 
-void Pop::Execute()
+void Shr::Execute(CpuState& cpu, const DecodedInstruction& instruction)
 {
-	uint16_t regD = operands[0]->GetRegister();
+	uint8_t regD = instruction.regD;
+	uint16_t operandD = cpu.regs[instruction.regD];
+	uint16_t operandS = cpu.regs[instruction.regS];
 
-	uint16_t value = (((uint16_t)(memory[regs[SP]])) & 0x00FF) | (((uint16_t)memory[regs[SP] + 1] << 8)& 0xFF00);
+	uint16_t value = operandD >> operandS;
 	
-	regs[regD] = value;
+	cpu.regs[regD] = value;
 
-	regs[SP] += 2;
+	RecordFlagOperation(cpu, SHR_FLAGS, operandD, operandS, value);
 }
 
-void Test::Execute()
+void Cmp::Execute(CpuState& cpu, const DecodedInstruction& instruction)
 {
-	uint16_t value = (operands[0]->GetOperandValue()) & (operands[1]->GetOperandValue());
-
-	if (value == 0)
-	{
-		SetPSWFlag(Z);
-	}
-	else
-	{
-		UnsetPSWFlag(Z);
-	}
+	uint16_t operandD = cpu.regs[instruction.regD];
+	uint16_t operandS = cpu.regs[instruction.regS];
 
-	if (value & ((uint16_t)1 << 15))
-	{
-		SetPSWFlag(N);
-	}
-	else
-	{
-		UnsetPSWFlag(N);
-	}
+	RecordFlagOperation(cpu, CMP_FLAGS, operandD, operandS, operandD - operandS);
 }
 
-void Shl::Execute()
+void Iret::Execute(CpuState& cpu, const DecodedInstruction&)
 {
-	uint8_t regD = operands[0]->GetRegister();
+	// Pop PC
+	//
+	uint16_t value = ((uint16_t)(cpu.memory[cpu.regs[SP]]) & 0x00FF) | ((uint16_t)cpu.memory[cpu.regs[SP] + 1] << 8);
 
-	uint16_t value = operands[0]->GetOperandValue() << operands[1]->GetOperandValue();
+	cpu.regs[PC] = value;
 
-	regs[regD] = value;
+	cpu.regs[SP] += 2;
 
-	if (value == 0)
-	{
-		SetPSWFlag(Z);
-	}
-	else
 	{
-		UnsetPSWFlag(Z);
-	}
+		// Pop PSW
+		//
+		uint16_t regD = 6;
 
-	if (value & ((uint16_t)1 << 15))
-	{
-		SetPSWFlag(N);
-	}
-	else
-	{
-		UnsetPSWFlag(N);
-	}
+		uint16_t value = ((uint16_t)(cpu.memory[cpu.regs[SP]])) | ((uint16_t)cpu.memory[cpu.regs[SP] + 1] << 8);
 
-	if (operands[1]->GetOperandValue() == 0 || operands[1]->GetOperandValue() > 16)
-	{
-		UnsetPSWFlag(C);
-	}
+		cpu.regs[regD] = value;
 
-	if (operands[0]->GetOperandValue() & (1 << (16 - operands[1]->GetOperandValue())))
-	{
-		SetPSWFlag(C);
-	}
-	else
-	{
-		UnsetPSWFlag(C);
-	}
+		cpu.regs[PSW] += 2;
 
-	regs[regD] = value;
+		UnsetPSWFlag(cpu, I);
+	}
 }
 
-void Shr::Execute()
+// Shared by int instruction and device interrupts
+//
+void RaiseInterrupt(CpuState& cpu, uint16_t entry)
 {
-	uint8_t regD = operands[0]->GetRegister();
+	// Push PSW
+	//
+	cpu.regs[SP] -= 2;
 
-	uint16_t value = operands[0]->GetOperandValue() >> operands[1]->GetOperandValue();
-	
-	regs[regD] = value;
+	WriteWord(cpu, cpu.regs[SP], cpu.regs[PSW]);
 
-	if (value == 0)
 	{
-		SetPSWFlag(Z);
-	}
-	else
-	{
-		UnsetPSWFlag(Z);
-	}
+		// Push PC
+		//
+		cpu.regs[SP] -= 2;
 
-	if (value & ((uint16_t)1 << 15))
-	{
-		SetPSWFlag(N);
-	}
-	else
-	{
-		UnsetPSWFlag(N);
-	}
+		WriteWord(cpu, cpu.regs[SP], cpu.regs[PC]);
 
-	if (operands[1]->GetOperandValue() == 0)
-	{
-		UnsetPSWFlag(C);
-	}
+		SetPSWFlag(cpu, I);
 
-	if (operands[1]->GetOperandValue() > 16)
-	{
-		if (operands[0]->GetOperandValue() & 0x8000)
-		{
-			SetPSWFlag(C);
-		}
-		else
-		{
-			UnsetPSWFlag(C);
-		}
-	}
-	
-	if (operands[0]->GetOperandValue() & (1 << (operands[1]->GetOperandValue() - 1)))
-	{
-		SetPSWFlag(C);
-	}
-	else
-	{
-		UnsetPSWFlag(C);
+		uint16_t dLow = (uint16_t)(cpu.memory[(entry % 8) * 2]) & 0x00FF;
+		uint16_t dHigh = ((uint16_t)(cpu.memory[(entry % 8) * 2 + 1]) << 8) & 0xFF00;
+
+		cpu.regs[PC] = dLow | dHigh;
 	}
 }
 
-void Cmp::Execute()
+// Device interrupts wait while interrupts are masked as a whole or by their own PSW bit.
+// Timer goes first when both are pending, then injected ones.
+//
+void DeliverInterrupt(CpuState& cpu, uint16_t entry)
 {
-	int16_t regD = operands[0]->GetOperandValue();
-	int16_t regS = operands[1]->GetOperandValue();
-	int16_t temp = regD - regS;
+	cpu.pendingInterrupts &= ~(1 << entry);
 
-	// Update Z
+	// Jump to address 0 would start program over
 	//
-	if (temp == 0)
-	{
-		SetPSWFlag(Z);
-	}
-	else
+	if (ReadWord(cpu, entry * 2) == 0)
 	{
-		UnsetPSWFlag(Z);
+		return;
 	}
 
-	//Update N
-	// 
-	if (temp < 0)
-	{
-		SetPSWFlag(N);
-	}
-	else
-	{
-		UnsetPSWFlag(N);
-	}
+	cpu.counters.interrupts++;
 
-	// Update O
-	//
-	if ((regD < 0 && -regS < 0 && temp > 0) || (regD > 0 && -regS > 0 && temp < 0))
-	{
-		SetPSWFlag(O);
-	}
-	else
-	{
-		UnsetPSWFlag(O);
-	}
+	MaterializeFlags(cpu);
+	RaiseInterrupt(cpu, entry);
+}
 
-	// Update carry
-	//
-	int16_t carry_bit = 0;
-	for (int i = 0; i < 16; i++)
+void DeliverPendingInterrupts(CpuState& cpu)
+{
+	if (cpu.regs[PSW] & (1 << I))
 	{
-		int16_t regDbit = regD & (1 << i);
-		int16_t regSbit = regS & (1 << i);
-		if (regDbit + regSbit + carry_bit >= 2)
-		{
-			carry_bit = 1;
-		}
-		else
-		{
-			carry_bit = 0;
-		}
+		return;
 	}
 
-	if (carry_bit == 1)
+	if ((cpu.pendingInterrupts & (1 << TIMER_INTERRUPT)) && !(cpu.regs[PSW] & (1 << TR)))
 	{
-		SetPSWFlag(C);
+		DeliverInterrupt(cpu, TIMER_INTERRUPT);
 	}
-	else
+	else if ((cpu.pendingInterrupts & (1 << TERMINAL_INTERRUPT)) && !(cpu.regs[PSW] & (1 << TL)))
 	{
-		UnsetPSWFlag(C);
+		DeliverInterrupt(cpu, TERMINAL_INTERRUPT);
 	}
-}
-
-void Iret::Execute()
-{
-	// Pop PC
-	//
-	uint16_t value = ((uint16_t)(memory[regs[SP]]) & 0x00FF) | ((uint16_t)memory[regs[SP] + 1] << 8);
-
-	regs[PC] = value;
-
-	regs[SP] += 2;
-
+	else
 	{
-		// Pop PSW
+		// Injected interrupts are masked by I only, lowest entry goes first
 		//
-		uint16_t regD = 6;
+		uint16_t injected = cpu.pendingInterrupts & ~((1 << TIMER_INTERRUPT) | (1 << TERMINAL_INTERRUPT));
 
-		uint16_t value = ((uint16_t)(memory[regs[SP]])) | ((uint16_t)memory[regs[SP] + 1] << 8);
-
-		regs[regD] = value;
-
-		regs[PSW] += 2;
-
-		UnsetPSWFlag(I);
+		for (uint16_t entry = 0; entry < IVT_ENTRIES; entry++)
+		{
+			if (injected & (1 << entry))
+			{
+				DeliverInterrupt(cpu, entry);
+				break;
+			}
+		}
 	}
 }
 
-void Int::Execute()
+void Int::Execute(CpuState& cpu, const DecodedInstruction& instruction)
 {
-	// Push PSW
-	//
-	regs[SP] -= 2;
-
-	uint8_t low = regs[PSW] & 0x00FF;
-	uint8_t high = (regs[PSW] >> 8) & 0x00FF;
-
-	memory[regs[SP]] = low;
-	memory[regs[SP] + 1] = high;
+	uint16_t entry = cpu.regs[instruction.regD];
 
+	if (cpu.semihost.isEnabled && entry % IVT_ENTRIES == SEMIHOST_INTERRUPT)
 	{
-		// Push PC
-		//
-		regs[SP] -= 2;
-
-		uint8_t low = regs[PC] & 0x00FF;
-		uint8_t high = (regs[PC] >> 8) & 0x00FF;
-
-		memory[regs[SP]] = low;
-		memory[regs[SP] + 1] = high;
-
-		SetPSWFlag(I);
-
-		uint16_t dLow = (uint16_t)(memory[(operands[0]->GetOperandValue() % 8) * 2]) & 0x00FF;
-		uint16_t dHigh = ((uint16_t)(memory[(operands[0]->GetOperandValue() % 8) * 2 + 1]) << 8) & 0xFF00;
-
-		regs[PC] = dLow | dHigh;
+		HandleSemihostRequest(cpu);
+		return;
 	}
+
+	RaiseInterrupt(cpu, entry);
 }
 
-void Call::Execute()
+void Call::Execute(CpuState& cpu, const DecodedInstruction& instruction)
 {
+	uint16_t target = GetJumpTarget(cpu, instruction);
+
 	// Push PC
 	//
-	regs[SP] -= 2;
+	cpu.regs[SP] -= 2;
 
-	uint8_t low = regs[PC];
-	uint8_t high = regs[PC] >> 8;
+	WriteWord(cpu, cpu.regs[SP], cpu.regs[PC]);
 
-	memory[regs[SP]] = low;
-	memory[regs[SP] + 1] = high;
-
-	if (operands[0]->GetType() == IMMEDIATE_SYMBOL_VALUE_PCREL_JMP)
-	{
-		uint32_t res = ((uint32_t)regs[PC] + (uint32_t)operands[0]->GetOperandValue()) % 65536;
-		regs[PC] = (uint16_t)res;
-	}
-	else
-	{
-		regs[PC] = operands[0]->GetOperandValue();
-	}
+	cpu.regs[PC] = target;
 }
 
-void Ret::Execute()
+void Ret::Execute(CpuState& cpu, const DecodedInstruction&)
 {
-	uint16_t value = ((uint16_t)(memory[regs[SP]]) & 0x00FF) | ((uint16_t)memory[regs[SP] + 1] << 8);
+	uint16_t value = ReadWord(cpu, cpu.regs[SP]);
 
-	regs[PC] = value;
+	cpu.regs[PC] = value;
 
-	regs[SP] += 2;
+	cpu.regs[SP] += 2;
 }
 
-void Jmp::Execute()
+void Jmp::Execute(CpuState& cpu, const DecodedInstruction& instruction)
 {
-	if (operands[0]->GetType() == IMMEDIATE_SYMBOL_VALUE_PCREL_JMP )
-	{
-		uint32_t res = ((uint32_t)regs[PC] + (uint32_t)operands[0]->GetOperandValue()) % 65536;
-		regs[PC] = (uint16_t)res;
-	}
-	else
-	{
-		regs[PC] = operands[0]->GetOperandValue();
-	}
+	cpu.regs[PC] = GetJumpTarget(cpu, instruction);
 }
 
-void Jeq::Execute()
+void Jeq::Execute(CpuState& cpu, const DecodedInstruction& instruction)
 {
-	if (TestPSWFlag(Z))
+	if (TestPSWFlag(cpu, Z))
 	{
-		if (operands[0]->GetType() == IMMEDIATE_SYMBOL_VALUE_PCREL_JMP)
-		{
-			uint32_t res = ((uint32_t)regs[PC] + (uint32_t)operands[0]->GetOperandValue()) % 65536;
-			regs[PC] = (uint16_t)res;
-		}
-		else
-		{
-			regs[PC] = operands[0]->GetOperandValue();
-		}
+		cpu.regs[PC] = GetJumpTarget(cpu, instruction);
 	}
 }
 
-void Jne::Execute()
+void Jne::Execute(CpuState& cpu, const DecodedInstruction& instruction)
 {
-	if (!TestPSWFlag(Z))
+	if (!TestPSWFlag(cpu, Z))
 	{
-		if (operands[0]->GetType() == IMMEDIATE_SYMBOL_VALUE_PCREL_JMP)
-		{
-			uint32_t res = ((uint32_t)regs[PC] + (uint32_t)operands[0]->GetOperandValue()) % 65536;
-			regs[PC] = (uint16_t)res;
-		}
-		else
-		{
-			regs[PC] = operands[0]->GetOperandValue();
-		}
+		cpu.regs[PC] = GetJumpTarget(cpu, instruction);
 	}
 }
 
-void Jgt::Execute()
+void Jgt::Execute(CpuState& cpu, const DecodedInstruction& instruction)
 {
-	if (!TestPSWFlag(Z) && !TestPSWFlag(N))
+	if (!TestPSWFlag(cpu, Z) && !TestPSWFlag(cpu, N))
 	{
-		if (operands[0]->GetType() == IMMEDIATE_SYMBOL_VALUE_PCREL_JMP)
-		{
-			uint32_t res = ((uint32_t)regs[PC] + (uint32_t)operands[0]->GetOperandValue()) % 65536;
-			regs[PC] = (uint16_t)res;
-		}
-		else
-		{
-			regs[PC] = operands[0]->GetOperandValue();
-		}
+		cpu.regs[PC] = GetJumpTarget(cpu, instruction);
 	}
 }
 
-void Ldr::Execute()
+void Ldr::Execute(CpuState& cpu, const DecodedInstruction& instruction)
 {
-	uint8_t regD = operands[0]->GetRegister();
-	uint8_t addrMode = operands[1]->GetType();
+	uint8_t regD = instruction.regD;
 
-	if (addrMode == MEMDIR_SYMBOL_PCREL)
-	{
-		regs[regD] = operands[1]->GetOperandValue();//ipsravi ovo
-	}
-	else
-	{
-		regs[regD] = operands[1]->GetOperandValue();
-	}
+	cpu.regs[regD] = GetOperandValue(cpu, instruction);
 }
 
-void Str::Execute()
+void Str::Execute(CpuState& cpu, const DecodedInstruction& instruction)
 {
-	uint8_t regD = operands[0]->GetRegister();
+	uint8_t regD = instruction.regD;
 
-	uint8_t addrMode = operands[1]->GetType();
+	uint8_t addrMode = instruction.addrMode;
 
 	// Store regD to memory
 	//
 	if (addrMode == MEMDIR_SYMBOL_PCREL)
 	{
-		uint8_t dataLow = regs[regD] & 0x00FF;
-		uint8_t dataHigh = (regs[regD] >> 8) & 0x00FF;
-		memory[(regs[PC] + operands[1]->GetOperandValue()) % 65536] = dataLow;
-		memory[(regs[PC] + operands[1]->GetOperandValue() + 1) % 65536] = dataHigh;
+		WriteWord(cpu, cpu.regs[PC] + instruction.payload, cpu.regs[regD]);
+	}
+	else if (addrMode == MEMDIR_LITERAL || addrMode == MEMDIR_SYMBOL_ABS)
+	{
+		WriteWord(cpu, instruction.payload, cpu.regs[regD]);
+	}
+	else if (addrMode == REGIND)
+	{
+		WriteWord(cpu, cpu.regs[instruction.regS], cpu.regs[regD]);
 	}
-	else if (addrMode == MEMDIR_LITERAL || addrMode == MEMDIR_SYMBOL_ABS || addrMode == MEMDIR_SYMBOL_PCREL || addrMode == REGIND ||
-		addrMode == REGIND_LITERAL || addrMode == REGIND_SYMBOL)
+	else if (addrMode == REGIND_LITERAL || addrMode == REGIND_SYMBOL)
 	{
-		uint8_t dataLow = regs[regD] & 0x00FF;
-		uint8_t dataHigh = (regs[regD] >> 8) & 0x00FF;
-		memory[(operands[1]->GetOperandValue() % 65536)] = dataLow;
-		memory[(operands[1]->GetOperandValue() + 1) % 65536] = dataHigh;
+		WriteWord(cpu, RegisterIndirectAddress(cpu, instruction), cpu.regs[regD]);
 	}
 	else if (addrMode == REGDIR)
 	{
-		regs[operands[1]->GetRegister()] = regs[regD];
+		cpu.regs[instruction.regS] = cpu.regs[regD];
 	}
 }
\ No newline at end of file
@@ -2,242 +2,264 @@
 #define _EMULATOR_H
 
 #include <string>
+#include <cstdint>
+#include <ostream>
 #include <vector>
+#include <map>
+#include "error.h"
 
-class Operand;
-class Instruction;
+#define PC 7
+#define SP 6
+#define PSW 8
 
-class Emulator
-{
-public:
-	void ReadMemoryContent(std::string& inputFile);
+#define NO_INSTRUCTION_LIMIT UINT64_MAX
 
-	void Init();
+// Coverage bitmap has a bit per address, bit 0 of byte 0 is address 0
+//
+#define COVERAGE_BYTES 8192
 
-	void Run();
+struct DecodedInstruction;
+struct BasicBlock;
+struct CpuState;
+class JitCompiler;
 
-	void OutputResult();
-private:
-	Instruction* ReadInstruction();
-};
+enum StopReason { STOP_HALT, STOP_BUDGET, STOP_WRONG_OPCODE, STOP_BREAKPOINT, STOP_TIMEOUT, STOP_EXIT };
 
-enum OperandType
+// Counters since Init() or Reset()
+//
+struct EmulatorStatistics
 {
-	// Only for ldr/strinstructions
-	//
-	IMMEDIATE, // $<literal> -> value <literal>
-	IMMEDIATE_SYMBOL_VALUE, // $<symbol> -> address of symbol
-	MEMDIR_LITERAL, // <literal> -> MEM[literal]
-	MEMDIR_SYMBOL_ABS, // <symbol> -> MEM[address of symbol]
-	MEMDIR_SYMBOL_PCREL, // %<symbol> -> MEM[PC-address of symbol]
-	REGDIR, // <reg> -> value from register
-	REGIND, // [<reg>] -> MEM[value from reg]
-	REGIND_LITERAL, // [<reg> + <literal>] -> MEM[value from reg + literal]
-	REGIND_SYMBOL, // [<reg> + <symbol>] -> MEM[value from reg + address of symbol]
-
-
-	// Only for jump instructions
-	//
-	IMMEDIATE_JMP, // <literal> -> value <literal>
-	IMMEDIATE_SYMBOL_VALUE_ABS_JMP, // <symbol> -> address of symbol with absolute adressing
-	IMMEDIATE_SYMBOL_VALUE_PCREL_JMP, // %<symbol> -> address of symbol with pc relative adressing
-	MEMDIR_LITERAL_JMP, // *<literal> -> MEM[literal]
-	MEMDIR_SYMBOL_JMP, // *<symbol> -> MEM[address of symbol]
-	REGDIR_JMP, // *<reg> -> value from register
-	REGIND_JMP, // *[<reg>] -> MEM[value from reg]
-	REGIND_LITERAL_JMP, // *[<reg> + <literal>] -> MEM[value from reg + literal]
-	REGIND_SYMBOL_JMP, // *[<reg> + <symbol>] -> MEM[value from reg + address of symbol]
-};
+	// Cycles include skipped idle cycles, instructions only executed ones
+	//
+	uint64_t cycles;
+	uint64_t instructions;
 
-class Instruction
-{
-public:
-	virtual void Execute() = 0;
-	void AppendOperand(Operand* operand);
-protected:
-	std::vector<Operand*> operands;
-};
+	// Host time spent decoding instructions which were not in decode cache yet
+	//
+	uint64_t decodeNanoseconds;
 
-class Operand
-{
-public:
-	Operand();
-
-	uint16_t GetLiteral() const;
-	std::string GetSymbol() const;
-	OperandType GetType() const;
-	uint16_t GetRegister() const;
-	uint16_t GetOperandValue() const;
-
-	void SetType(OperandType type);
-	void SetLiteral(uint16_t literal);
-	void SetSymbol(std::string symbol);
-	void SetRegister(uint16_t reg);
-	void SetOperandValue(uint16_t value);
-private:
-	OperandType mOperandType;
-	uint16_t mLiteral;
-	std::string mSymbol;
-	uint16_t mRegister;
+	// Counted by Run() after EnableStatistics(), and by block based runs. Code run natively
+	// by RunNative() is not in them.
+	//
+	uint64_t opCodes[256];
+	uint64_t loads;
+	uint64_t stores;
+	uint64_t takenBranches;
+	uint64_t notTakenBranches;
 
-	// Operand value, regardless of type, will be placed here
+	// Counted by every run, except decode cache hits of RunThreaded()
 	//
-	uint16_t operandValue;
+	uint64_t interrupts;
+	uint64_t decodeCacheHits;
+	uint64_t decodeCacheMisses;
+	uint64_t blockCacheHits;
+	uint64_t blockCacheMisses;
 };
 
-class Halt : public Instruction
-{
-public:
-	void Execute() override;
-};
+// Code written by WriteTranslation(), compiled together with the program. It runs translated
+// blocks from PC on, until it reaches code which was not translated or an event is due.
+//
+typedef void (*NativeCode)(CpuState& cpu);
 
-class Int : public Instruction
+struct NativeBlock
 {
-public:
-	void Execute() override;
-};
+	uint16_t start;
 
-class Iret : public Instruction
-{
-public:
-	void Execute() override;
+	// Bytes of guest code
+	//
+	uint16_t size;
 };
 
-class Call : public Instruction
+// One emulated processor with its own memory. Separate instances share no state,
+// so each of them may run on its own thread.
+//
+// This is the whole interface of the emulator library, main.cpp uses nothing else.
+// Errors are thrown as EmulatorError.
+//
+class Emulator
 {
 public:
-	void Execute() override;
-};
+	Emulator();
+	~Emulator();
 
-class Ret : public Instruction
-{
-public:
-	void Execute() override;
-};
+	Emulator(const Emulator&) = delete;
+	Emulator& operator=(const Emulator&) = delete;
 
-class Jmp : public Instruction
-{
-public:
-	void Execute() override;
-};
+	void ReadMemoryContent(const std::string& inputFile);
 
-class Jeq : public Instruction
-{
-public:
-	void Execute() override;
-};
+	// Program image, old address/byte image or snapshot straight from memory, in the same
+	// formats as files. Name is only used in error messages.
+	//
+	void LoadImage(const uint8_t* image, size_t size, const std::string& name = "image");
 
-class Jne : public Instruction
-{
-public:
-	void Execute() override;
-};
+	// Processor starts from entry point of loaded image. Snapshot keeps registers it was taken with.
+	//
+	void Init();
 
-class Jgt : public Instruction
-{
-public:
-	void Execute() override;
-};
+	// Back to state right after Init(), with registers cleared and timer stopped. Memory
+	// is kept, so program may be run again without loading it.
+	//
+	void Reset();
 
-class Push : public Instruction
-{
-public:
-	void Execute() override;
-};
+	// r0-r5, SP, PC and PSW
+	//
+	uint16_t ReadRegister(int index);
+	void WriteRegister(int index, uint16_t value);
 
-class Pop : public Instruction
-{
-public:
-	void Execute() override;
-};
+	// Plain memory access, devices do not see it
+	//
+	void ReadMemory(uint16_t address, void* buffer, size_t size);
+	void WriteMemory(uint16_t address, const void* data, size_t size);
 
-class Xchg : public Instruction
-{
-public:
-	void Execute() override;
-};
+	// Entry of IVT is delivered before next instruction, once PSW lets it in the same
+	// way as device interrupts
+	//
+	void InjectInterrupt(uint16_t entry);
 
-class Add : public Instruction
-{
-public:
-	void Execute() override;
-};
+	// Guest output is dropped and host input is left to other processors
+	//
+	void DisconnectTerminal();
 
-class Sub : public Instruction
-{
-public:
-	void Execute() override;
-};
+	// Guest output goes to output instead of std::cout. Output has to outlive the emulator.
+	//
+	void SetTerminalOutput(std::ostream& output);
 
-class Mul : public Instruction
-{
-public:
-	void Execute() override;
-};
+	// Makes this processor number index of the machine of first one, sharing its memory.
+	// Called before anything is loaded, program loaded by first one is run by all of them.
+	// Each processor is run by its own host thread. It stays parked until another one
+	// sends it ipi, see devices.h.
+	//
+	void JoinMachine(Emulator& first, int index);
 
-class Div : public Instruction
-{
-public:
-	void Execute() override;
-};
+	// Blocks parked processor until it is started. False if every started processor left
+	// machine before anyone started this one.
+	//
+	bool WaitForStart();
 
-class Cmp : public Instruction
-{
-public:
-	void Execute() override;
-};
+	// Called once started processor is done with its last run
+	//
+	void LeaveMachine();
 
-class Not : public Instruction
-{
-public:
-	void Execute() override;
-};
+	EmulatorStatistics GetStatistics();
 
-class And : public Instruction
-{
-public:
-	void Execute() override;
-};
+	// Guest may write to host files and stdout, read host files, get host time and exit
+	// through int of entry 7, which is no longer an interrupt then
+	//
+	void EnableSemihosting();
 
-class Or : public Instruction
-{
-public:
-	void Execute() override;
-};
+	// Code given by guest which stopped with STOP_EXIT
+	//
+	uint16_t GetExitCode();
 
-class Xor : public Instruction
-{
-public:
-	void Execute() override;
-};
+	void SaveSnapshot(const std::string& outputFile);
 
-class Test : public Instruction
-{
-public:
-	void Execute() override;
-};
+	// Terminal input is logged, or taken from log of earlier run instead of host
+	//
+	void RecordInput(const std::string& logFile);
+	void ReplayInput(const std::string& logFile);
 
-class Shl : public Instruction
-{
-public:
-	void Execute() override;
-};
+	// Each run continues where previous one stopped, until halt or one of the limits.
+	// Budget counts cycles, which are instructions plus skipped idle cycles. Block based
+	// runs check it once per block.
+	//
+	StopReason Run(uint64_t maxInstructions = NO_INSTRUCTION_LIMIT);
+	StopReason RunThreaded(uint64_t maxInstructions = NO_INSTRUCTION_LIMIT);
+	StopReason RunBlocks(uint64_t maxInstructions = NO_INSTRUCTION_LIMIT);
+	StopReason RunJit(uint64_t maxInstructions = NO_INSTRUCTION_LIMIT);
 
-class Shr : public Instruction
-{
-public:
-	void Execute() override;
-};
+	// Runs translated blocks given to SetNativeCode() natively, rest is interpreted block by
+	// block. Translated block is dropped as soon as a store hits its code.
+	//
+	StopReason RunNative(uint64_t maxInstructions = NO_INSTRUCTION_LIMIT);
 
-class Ldr : public Instruction
-{
-public:
-	void Execute() override;
-};
+	void SetNativeCode(NativeCode code, const NativeBlock* blocks, size_t count);
 
-class Str : public Instruction
-{
-public:
-	void Execute() override;
+	// Exactly count instructions, unless processor stops earlier
+	//
+	StopReason Step(uint64_t count = 1);
+
+	StopReason RunToAddress(uint16_t address);
+
+	// Run stops before instruction at address is executed
+	//
+	void AddBreakpoint(uint16_t address);
+	void RemoveBreakpoint(uint16_t address);
+
+	// Host time limit of each following run, 0 for none
+	//
+	void SetTimeout(uint64_t milliseconds);
+
+	// Instead of jumping to routine from IVT entry 1
+	//
+	void SetStopOnWrongOpCode(bool stop);
+
+	// Instrumentation of Run(), other run modes fall back to it when some is enabled
+	//
+	void EnableProfile();
+	void EnableTrace(size_t capacity, const std::string& outputFile);
+
+	// Run() counts instructions of GetStatistics() one by one, RunThreaded() falls back
+	// to it for that, so command line rejects --stats with --threaded
+	//
+	void EnableStatistics();
+
+	void OutputResult(std::ostream& output);
+
+	void OutputBlockStatistics(std::ostream& output);
+
+	// GetStatistics() as one JSON object, with MIPS of a run which took runNanoseconds of
+	// host time
+	//
+	void OutputStatistics(std::ostream& output, uint64_t runNanoseconds);
+
+	// Report of profiled run by function and by hottest address, functions are taken from
+	// symbol file written by linker
+	//
+	void WriteProfile(const std::string& outputFile, const std::string& symbolFile);
+
+	// Coverage is always recorded. Bits of all bytes of each instruction executed since
+	// processor was created are ORed into bitmap, which is resized to COVERAGE_BYTES.
+	//
+	void ReadCoverage(std::vector<uint8_t>& bitmap);
+
+	// Coverage file written by --coverage, read one is ORed into bitmap
+	//
+	static void ReadCoverageFile(const std::string& inputFile, std::vector<uint8_t>& bitmap);
+	static void WriteCoverageFile(const std::string& outputFile, const std::vector<uint8_t>& bitmap);
+
+	// Listing of loaded image which marks executed instructions, with covered instructions
+	// per function. Functions are taken from symbol file written by linker.
+	//
+	void WriteCoverageReport(const std::string& outputFile, const std::vector<uint8_t>& bitmap, const std::string& symbolFile);
+
+	// C++ translation of loaded image, for RunNative(). Blocks are found statically from
+	// entry point and IVT, by following direct jumps and calls.
+	//
+	void WriteTranslation(const std::string& outputFile);
+
+	static void ExecuteInstruction(CpuState& cpu, const DecodedInstruction& instruction);
+private:
+	void LoadSegments(const uint8_t* image, size_t size, const std::string& name);
+	void LoadAddressBytePairs(const uint8_t* image, size_t size);
+	void LoadSnapshot(const uint8_t* image, size_t size, const std::string& name);
+	template <int features> void ExecuteNext();
+	template <int features> void RunInterpreter();
+	bool BeginRun(uint64_t maxInstructions);
+	BasicBlock* TranslateBlock(uint16_t address);
+
+	// Blocks found statically from entry point, IVT and further starts given in pending,
+	// by following direct jumps and calls
+	//
+	std::map<uint16_t, BasicBlock*> FindReachableBlocks(std::vector<uint16_t> pending);
+	BasicBlock* LookupBlock();
+	void InterpretBlock(BasicBlock* block);
+	bool LoadInstruction(uint16_t address, DecodedInstruction& instruction);
+	bool ReadInstruction(uint16_t address, DecodedInstruction& instruction);
+
+	CpuState* mState;
+
+	// Created by first RunJit()
+	//
+	JitCompiler* mJit;
 };
 #endif
\ No newline at end of file
@@ -2,6 +2,5 @@
 
 [[ noreturn ]] void RaiseError(std::string errorMessage)
 {
-	std::cout << errorMessage;
-	exit(-1);
+	throw EmulatorError(errorMessage);
 }
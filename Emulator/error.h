@@ -3,6 +3,16 @@
 
 #include <string>
 #include <iostream>
+#include <stdexcept>
+
+// Stops the emulated program. Each emulator instance reports its own error, so one
+// failing program does not stop others running in the same process.
+//
+class EmulatorError : public std::runtime_error
+{
+public:
+	EmulatorError(std::string errorMessage) : std::runtime_error(errorMessage) {}
+};
 
 [[ noreturn ]] void RaiseError(std::string errorMessage);
 #endif
\ No newline at end of file
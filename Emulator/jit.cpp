@@ -0,0 +1,865 @@
+#include "jit.h"
+#include "error.h"
+#include <cstring>
+
+#if defined(__x86_64__) && defined(__unix__)
+#include <sys/mman.h>
+#define JIT_SUPPORTED
+#endif
+
+// 16 MiB of native code, all of it is dropped when it fills up
+//
+#define EXECUTABLE_MEMORY_SIZE (16 * 1024 * 1024)
+
+void WriteWord(CpuState& cpu, uint16_t address, uint16_t value);
+bool EndsBasicBlock(const DecodedInstruction& instruction);
+void MaterializeFlags(CpuState& cpu);
+
+enum HostRegister { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+// x86 condition codes
+//
+#define CC_O 0x0
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_S 0x8
+
+// Host register of each guest register, PC never lives in a register. Guest r0-r5 are in
+// callee saved registers, so they survive calls into C++ code.
+//
+// R10 -> regs, R11 -> memory, RAX, RCX, RDX, RSI, RDI -> temporaries
+//
+const int guestToHost[9] = { RBX, RBP, R12, R13, R14, R15, R8, -1, R9 };
+
+// Interpreter may leave flags pending, while compiled code reads them from PSW. Errors
+// cannot unwind through native code, so they are kept until block returns. Only jumps
+// and call can raise an error and they all end the block.
+//
+void JitExecuteInstruction(CpuState* cpu, const DecodedInstruction* instruction)
+{
+	try
+	{
+		Emulator::ExecuteInstruction(*cpu, *instruction);
+	}
+	catch (...)
+	{
+		cpu->jitError = std::current_exception();
+	}
+
+	MaterializeFlags(*cpu);
+}
+
+void JitReadOverflow(CpuState* cpu)
+{
+	try
+	{
+		RaiseError("Cannot read memory at address 0xFFFF - overflow");
+	}
+	catch (...)
+	{
+		cpu->jitError = std::current_exception();
+	}
+}
+
+JitCompiler::JitCompiler(CpuState& cpu)
+{
+	mState = &cpu;
+	mExecutableMemory = nullptr;
+	mExecutableSize = 0;
+	mExecutableUsed = 0;
+
+#ifdef JIT_SUPPORTED
+	void* executableMemory = mmap(nullptr, EXECUTABLE_MEMORY_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (executableMemory != MAP_FAILED)
+	{
+		mExecutableMemory = (uint8_t*)executableMemory;
+		mExecutableSize = EXECUTABLE_MEMORY_SIZE;
+	}
+#endif
+}
+
+JitCompiler::~JitCompiler()
+{
+#ifdef JIT_SUPPORTED
+	if (mExecutableMemory != nullptr)
+	{
+		munmap(mExecutableMemory, mExecutableSize);
+	}
+#endif
+}
+
+bool JitCompiler::IsAvailable() const
+{
+	return mExecutableMemory != nullptr;
+}
+
+void JitCompiler::Reset()
+{
+	mExecutableUsed = 0;
+}
+
+CompiledBlock JitCompiler::Compile(BasicBlock* block)
+{
+	if (!IsAvailable())
+	{
+		return nullptr;
+	}
+
+	mCode.clear();
+	mSpillExits.clear();
+	mReturnExits.clear();
+
+	// Prologue, 6 pushes and 8 more bytes keep stack 16 byte aligned for calls
+	//
+	Push(RBX);
+	Push(RBP);
+	Push(R12);
+	Push(R13);
+	Push(R14);
+	Push(R15);
+	Rex(true, 0, 0, RSP);
+	Byte(0x83);
+	Byte(0xEC);
+	Byte(0x08);
+
+	EmitBasePointers();
+	EmitReload();
+
+	uint16_t pc = block->start;
+
+	for (const DecodedInstruction& instruction : block->microOps)
+	{
+		pc += instruction.size;
+		EmitMicroOp(block, instruction, pc);
+	}
+
+	// Block ended because it reached maximal length
+	//
+	EmitExit(pc);
+
+	size_t spillExit = mCode.size();
+	EmitSpill();
+
+	size_t returnExit = mCode.size();
+	Rex(true, 0, 0, RSP);
+	Byte(0x83);
+	Byte(0xC4);
+	Byte(0x08);
+	Pop(R15);
+	Pop(R14);
+	Pop(R13);
+	Pop(R12);
+	Pop(RBP);
+	Pop(RBX);
+	Byte(0xC3);
+
+	for (auto fixup : mSpillExits)
+	{
+		BindTo(fixup, spillExit);
+	}
+
+	for (auto fixup : mReturnExits)
+	{
+		BindTo(fixup, returnExit);
+	}
+
+	if (mExecutableUsed + mCode.size() > mExecutableSize)
+	{
+		return nullptr;
+	}
+
+	uint8_t* code = mExecutableMemory + mExecutableUsed;
+	memcpy(code, mCode.data(), mCode.size());
+
+	// Keep every block 16 byte aligned
+	//
+	mExecutableUsed += (mCode.size() + 15) & ~(size_t)15;
+
+	return (CompiledBlock)code;
+}
+
+void JitCompiler::EmitMicroOp(BasicBlock* block, const DecodedInstruction& instruction, uint16_t next)
+{
+	uint8_t regD = instruction.regD;
+	uint8_t regS = instruction.regS;
+	uint8_t aluOpCode = 0;
+	size_t skip = 0;
+
+	switch (instruction.opCode)
+	{
+	case 0x70://add
+	case 0x71://sub
+	case 0x72://mul
+	case 0x73://div
+	case 0x81://and
+	case 0x82://or
+	case 0x83://xor
+		if (regD == PC)
+		{
+			EmitInterpreterCall(block, instruction, next, true);
+			return;
+		}
+
+		EmitLoadGuestRegister(RAX, regD, next);
+		EmitLoadGuestRegister(RCX, regS, next);
+
+		switch (instruction.opCode)
+		{
+		case 0x70: aluOpCode = 0x01; break;
+		case 0x71: aluOpCode = 0x29; break;
+		case 0x81: aluOpCode = 0x21; break;
+		case 0x82: aluOpCode = 0x09; break;
+		case 0x83: aluOpCode = 0x31; break;
+		}
+
+		if (instruction.opCode == 0x72)
+		{
+			Imul(RAX, RCX);
+		}
+		else if (instruction.opCode == 0x73)
+		{
+			// Division by zero traps on host, just as it does in interpreter
+			//
+			AluRegReg(0x31, RDX, RDX);
+			Unary(6, RCX);
+		}
+		else
+		{
+			AluRegReg(aluOpCode, RAX, RCX);
+		}
+
+		Movzx16(RAX, RAX);
+		EmitStoreGuestRegister(regD, RAX);
+		break;
+	case 0x80://not
+		if (regD == PC)
+		{
+			EmitInterpreterCall(block, instruction, next, true);
+			return;
+		}
+
+		EmitLoadGuestRegister(RAX, regD, next);
+		Unary(2, RAX);
+		Movzx16(RAX, RAX);
+		EmitStoreGuestRegister(regD, RAX);
+		break;
+	case 0x60://xchg
+		if (regD == PC || regS == PC)
+		{
+			EmitInterpreterCall(block, instruction, next, true);
+			return;
+		}
+
+		// Only low byte of first register makes it to second one
+		//
+		EmitLoadGuestRegister(RAX, regD, next);
+		AluRegImm(4, RAX, 0xFF);
+		EmitLoadGuestRegister(RCX, regS, next);
+		EmitStoreGuestRegister(regD, RCX);
+		EmitStoreGuestRegister(regS, RAX);
+		break;
+	case 0x74://cmp
+		// Z, O and N come from 16 bit host compare, except that O stays clear when first
+		// operand is 0. C is always cleared.
+		//
+		EmitLoadGuestRegister(RSI, regD, next);
+		EmitLoadGuestRegister(RDI, regS, next);
+		Cmp16RegReg(RSI, RDI);
+		Setcc(CC_E, RAX);
+		Setcc(CC_O, RCX);
+		Setcc(CC_S, RDX);
+		AluRegReg(0x85, RSI, RSI);
+		skip = Jcc(CC_NE);
+		AluRegReg(0x31, RCX, RCX);
+		Bind(skip);
+		Movzx8(RAX, RAX);
+		Movzx8(RCX, RCX);
+		Movzx8(RDX, RDX);
+		ShiftImm(4, RCX, 1);
+		ShiftImm(4, RDX, 3);
+		AluRegReg(0x09, RAX, RCX);
+		AluRegReg(0x09, RAX, RDX);
+		AluRegImm(4, R9, 0xFFF0);
+		AluRegReg(0x09, R9, RAX);
+		break;
+	case 0x84://test
+		EmitLoadGuestRegister(RAX, regD, next);
+		EmitLoadGuestRegister(RCX, regS, next);
+		AluRegReg(0x21, RAX, RCX);
+		Setcc(CC_E, RDX);
+		Movzx8(RDX, RDX);
+		ShiftImm(5, RAX, 15);
+		ShiftImm(4, RAX, 3);
+		AluRegReg(0x09, RAX, RDX);
+		AluRegImm(4, R9, 0xFFF6);
+		AluRegReg(0x09, R9, RAX);
+		break;
+	case 0xA0://ldr
+		if (regD == PC)
+		{
+			EmitInterpreterCall(block, instruction, next, true);
+			return;
+		}
+
+		switch (instruction.addrMode)
+		{
+		case IMMEDIATE:
+		case IMMEDIATE_SYMBOL_VALUE:
+		case IMMEDIATE_JMP:
+		case IMMEDIATE_SYMBOL_VALUE_ABS_JMP:
+		case IMMEDIATE_SYMBOL_VALUE_PCREL_JMP:
+			MovRegImm(RAX, instruction.payload);
+			break;
+		case MEMDIR_LITERAL:
+		case MEMDIR_SYMBOL_ABS:
+		case MEMDIR_LITERAL_JMP:
+		case MEMDIR_SYMBOL_JMP:
+			EmitLoadWord(instruction.payload);
+			break;
+		case MEMDIR_SYMBOL_PCREL:
+			EmitLoadWord(next + instruction.payload);
+			break;
+		case REGDIR:
+		case REGDIR_JMP:
+			EmitLoadGuestRegister(RAX, regS, next);
+			break;
+		case REGIND:
+		case REGIND_JMP:
+			EmitLoadGuestRegister(RCX, regS, next);
+			EmitReadCheck(next - instruction.size);
+			LoadWord(RAX, R11, RCX, 0);
+			break;
+		default:
+			EmitRegisterIndirectAddress(instruction, next);
+			EmitReadCheck(next - instruction.size);
+			LoadWord(RAX, R11, RCX, 0);
+			break;
+		}
+
+		EmitStoreGuestRegister(regD, RAX);
+		break;
+	case 0xB0://str
+		switch (instruction.addrMode)
+		{
+		case REGDIR:
+			if (regS == PC)
+			{
+				EmitInterpreterCall(block, instruction, next, true);
+				return;
+			}
+
+			EmitLoadGuestRegister(RAX, regD, next);
+			EmitStoreGuestRegister(regS, RAX);
+			break;
+		case MEMDIR_LITERAL:
+		case MEMDIR_SYMBOL_ABS:
+			MovRegImm(RCX, instruction.payload);
+			EmitLoadGuestRegister(RAX, regD, next);
+			EmitStoreWord(block, next);
+			break;
+		case MEMDIR_SYMBOL_PCREL:
+			MovRegImm(RCX, (uint16_t)(next + instruction.payload));
+			EmitLoadGuestRegister(RAX, regD, next);
+			EmitStoreWord(block, next);
+			break;
+		case REGIND:
+			EmitLoadGuestRegister(RCX, regS, next);
+			EmitLoadGuestRegister(RAX, regD, next);
+			EmitStoreWord(block, next);
+			break;
+		case REGIND_LITERAL:
+		case REGIND_SYMBOL:
+			EmitRegisterIndirectAddress(instruction, next);
+			EmitLoadGuestRegister(RAX, regD, next);
+			EmitStoreWord(block, next);
+			break;
+		}
+		break;
+	case 0xE0://push
+		EmitLoadGuestRegister(RAX, regD, next);
+		AluRegImm(5, R8, 2);
+		Movzx16(R8, R8);
+		MovRegReg(RCX, R8);
+		EmitStoreWord(block, next);
+		break;
+	case 0xF0://pop
+		if (regD == PC)
+		{
+			EmitInterpreterCall(block, instruction, next, true);
+			return;
+		}
+
+		MovRegReg(RCX, R8);
+		EmitLoadWordWrapped();
+		EmitStoreGuestRegister(regD, RAX);
+		AluRegImm(0, R8, 2);
+		Movzx16(R8, R8);
+		break;
+	case 0x53://jgt
+	case 0x52://jne
+	case 0x51://jeq
+	case 0x50://jmp
+		if (instruction.addrMode != IMMEDIATE_JMP && instruction.addrMode != IMMEDIATE_SYMBOL_VALUE_ABS_JMP)
+		{
+			EmitInterpreterCall(block, instruction, next, true);
+			return;
+		}
+
+		if (instruction.opCode == 0x50)
+		{
+			EmitExit(instruction.payload);
+			return;
+		}
+
+		// Z is bit 0, N is bit 3 of psw
+		//
+		TestRegImm(R9, instruction.opCode == 0x53 ? 0x9 : 0x1);
+		skip = Jcc(instruction.opCode == 0x51 ? CC_E : CC_NE);
+		EmitExit(instruction.payload);
+		Bind(skip);
+		EmitExit(next);
+		break;
+	default:
+		// Rare instructions and the ones which leave the block through stack or IVT
+		// are executed by interpreter
+		//
+		EmitInterpreterCall(block, instruction, next, EndsBasicBlock(instruction));
+		break;
+	}
+}
+
+void JitCompiler::EmitInterpreterCall(BasicBlock* block, const DecodedInstruction& instruction, uint16_t next, bool endsBlock)
+{
+	EmitSpill();
+	StoreWordImm(R10, PC * 2, next);
+
+	MovRegImm64(RDI, (uint64_t)mState);
+	MovRegImm64(RSI, (uint64_t)&instruction);
+	MovRegImm64(RAX, (uint64_t)&JitExecuteInstruction);
+	CallReg(RAX);
+
+	if (endsBlock)
+	{
+		// Interpreter has already set PC and all registers
+		//
+		mReturnExits.push_back(Jmp());
+		return;
+	}
+
+	EmitBasePointers();
+	EmitReload();
+	EmitValidCheck(block, next);
+}
+
+void JitCompiler::EmitExit(uint16_t pc)
+{
+	StoreWordImm(R10, PC * 2, pc);
+	mSpillExits.push_back(Jmp());
+}
+
+// Leave block if a store has overwritten its code, recording how many of its micro-ops ran
+//
+void JitCompiler::EmitValidCheck(BasicBlock* block, uint16_t next)
+{
+	uint16_t pc = block->start;
+	uint16_t executed = 0;
+
+	while (pc != next)
+	{
+		pc += block->microOps[executed++].size;
+	}
+
+	MovRegImm64(RAX, (uint64_t)&block->valid);
+	CmpByteImm(RAX, -1, 0);
+	size_t valid = Jcc(CC_NE);
+	MovRegImm64(RAX, (uint64_t)&block->executedMicroOps);
+	StoreWordImm(RAX, 0, executed);
+	EmitExit(next);
+	Bind(valid);
+}
+
+void JitCompiler::EmitLoadGuestRegister(int host, uint8_t guest, uint16_t next)
+{
+	if (guest == PC)
+	{
+		MovRegImm(host, next);
+	}
+	else
+	{
+		MovRegReg(host, guestToHost[guest]);
+	}
+}
+
+void JitCompiler::EmitStoreGuestRegister(uint8_t guest, int host)
+{
+	MovRegReg(guestToHost[guest], host);
+}
+
+// ECX <- (payload & 0xFF00) | ((payload & 0x00FF) + regS), same as interpreter
+//
+void JitCompiler::EmitRegisterIndirectAddress(const DecodedInstruction& instruction, uint16_t next)
+{
+	EmitLoadGuestRegister(RCX, instruction.regS, next);
+	AluRegImm(0, RCX, instruction.payload & 0x00FF);
+	AluRegImm(1, RCX, instruction.payload & 0xFF00);
+	Movzx16(RCX, RCX);
+}
+
+// Register indirect reads at 0xFFFF stop the emulator, block is left at instruction
+// which made the read
+//
+void JitCompiler::EmitReadCheck(uint16_t address)
+{
+	AluRegImm(7, RCX, 0xFFFF);
+	size_t inRange = Jcc(CC_NE);
+	EmitSpill();
+	StoreWordImm(R10, PC * 2, address);
+	MovRegImm64(RDI, (uint64_t)mState);
+	MovRegImm64(RAX, (uint64_t)&JitReadOverflow);
+	CallReg(RAX);
+	mReturnExits.push_back(Jmp());
+	Bind(inRange);
+}
+
+// EAX <- word at constant address
+//
+void JitCompiler::EmitLoadWord(uint16_t address)
+{
+	LoadByte(RAX, R11, -1, address);
+	LoadByte(RCX, R11, -1, (uint16_t)(address + 1));
+	ShiftImm(4, RCX, 8);
+	AluRegReg(0x09, RAX, RCX);
+}
+
+// EAX <- word at ECX, wrapping around end of memory
+//
+void JitCompiler::EmitLoadWordWrapped()
+{
+	LoadByte(RAX, R11, RCX, 0);
+	MovRegReg(RDX, RCX);
+	AluRegImm(0, RDX, 1);
+	Movzx16(RDX, RDX);
+	LoadByte(RDX, R11, RDX, 0);
+	ShiftImm(4, RDX, 8);
+	AluRegReg(0x09, RAX, RDX);
+}
+
+// Word EAX -> ECX. Stores to decoded code and device registers go through WriteWord(),
+// which invalidates caches or notifies devices, and may end this block.
+//
+void JitCompiler::EmitStoreWord(BasicBlock* block, uint16_t next)
+{
+	MovRegReg(RSI, RCX);
+	AluRegImm(0, RSI, 1);
+	Movzx16(RSI, RSI);
+
+	MovRegImm64(RDX, (uint64_t)mState->watchedBytes);
+	CmpByteImm(RDX, RCX, 0);
+	size_t codeLow = Jcc(CC_NE);
+	CmpByteImm(RDX, RSI, 0);
+	size_t codeHigh = Jcc(CC_NE);
+
+	StoreByte(R11, RCX, 0, RAX);
+	ShiftImm(5, RAX, 8);
+	StoreByte(R11, RSI, 0, RAX);
+	size_t done = Jmp();
+
+	Bind(codeLow);
+	Bind(codeHigh);
+
+	// Guest sp and psw are in caller saved registers
+	//
+	Push(R8);
+	Push(R9);
+	MovRegReg(RSI, RCX);
+	MovRegReg(RDX, RAX);
+	MovRegImm64(RDI, (uint64_t)mState);
+	MovRegImm64(RAX, (uint64_t)&WriteWord);
+	CallReg(RAX);
+	Pop(R9);
+	Pop(R8);
+
+	EmitBasePointers();
+	EmitValidCheck(block, next);
+
+	Bind(done);
+}
+
+void JitCompiler::EmitSpill()
+{
+	for (int guest = 0; guest < 9; guest++)
+	{
+		if (guest != PC)
+		{
+			StoreWord(R10, -1, guest * 2, guestToHost[guest]);
+		}
+	}
+}
+
+void JitCompiler::EmitReload()
+{
+	for (int guest = 0; guest < 9; guest++)
+	{
+		if (guest != PC)
+		{
+			LoadWord(guestToHost[guest], R10, -1, guest * 2);
+		}
+	}
+}
+
+void JitCompiler::EmitBasePointers()
+{
+	MovRegImm64(R10, (uint64_t)mState->regs);
+	MovRegImm64(R11, (uint64_t)mState->memory);
+}
+
+void JitCompiler::Byte(uint8_t byte)
+{
+	mCode.push_back(byte);
+}
+
+void JitCompiler::Dword(uint32_t dword)
+{
+	for (int i = 0; i < 4; i++)
+	{
+		Byte((dword >> (i * 8)) & 0xFF);
+	}
+}
+
+void JitCompiler::Qword(uint64_t qword)
+{
+	Dword(qword & 0xFFFFFFFF);
+	Dword(qword >> 32);
+}
+
+void JitCompiler::Rex(bool wide, int reg, int index, int base, bool force)
+{
+	uint8_t rex = 0x40;
+
+	rex |= wide ? 0x08 : 0;
+	rex |= (reg & 8) ? 0x04 : 0;
+	rex |= (index >= 0 && (index & 8)) ? 0x02 : 0;
+	rex |= (base & 8) ? 0x01 : 0;
+
+	if (rex != 0x40 || force)
+	{
+		Byte(rex);
+	}
+}
+
+// [base + index + displacement], always encoded with SIB byte and 32 bit displacement
+//
+void JitCompiler::MemoryOperand(int reg, int base, int index, int32_t displacement)
+{
+	Byte(0x80 | ((reg & 7) << 3) | 4);
+	Byte((((index < 0 ? RSP : index) & 7) << 3) | (base & 7));
+	Dword(displacement);
+}
+
+void JitCompiler::MovRegReg(int dst, int src)
+{
+	AluRegReg(0x89, dst, src);
+}
+
+void JitCompiler::MovRegImm(int dst, uint32_t imm)
+{
+	Rex(false, 0, -1, dst);
+	Byte(0xB8 + (dst & 7));
+	Dword(imm);
+}
+
+void JitCompiler::MovRegImm64(int dst, uint64_t imm)
+{
+	Rex(true, 0, -1, dst);
+	Byte(0xB8 + (dst & 7));
+	Qword(imm);
+}
+
+// op r/m32, r32 with register operands
+//
+void JitCompiler::AluRegReg(uint8_t opCode, int dst, int src)
+{
+	Rex(false, src, -1, dst);
+	Byte(opCode);
+	Byte(0xC0 | ((src & 7) << 3) | (dst & 7));
+}
+
+// 81 /extension: 0 add, 1 or, 4 and, 5 sub, 6 xor, 7 cmp
+//
+void JitCompiler::AluRegImm(int extension, int dst, uint32_t imm)
+{
+	Rex(false, 0, -1, dst);
+	Byte(0x81);
+	Byte(0xC0 | (extension << 3) | (dst & 7));
+	Dword(imm);
+}
+
+void JitCompiler::Cmp16RegReg(int left, int right)
+{
+	Byte(0x66);
+	AluRegReg(0x39, left, right);
+}
+
+void JitCompiler::TestRegImm(int reg, uint32_t imm)
+{
+	Rex(false, 0, -1, reg);
+	Byte(0xF7);
+	Byte(0xC0 | (reg & 7));
+	Dword(imm);
+}
+
+void JitCompiler::Movzx16(int dst, int src)
+{
+	Rex(false, dst, -1, src);
+	Byte(0x0F);
+	Byte(0xB7);
+	Byte(0xC0 | ((dst & 7) << 3) | (src & 7));
+}
+
+// Source has to be AL, CL, DL or BL
+//
+void JitCompiler::Movzx8(int dst, int src)
+{
+	Rex(false, dst, -1, src);
+	Byte(0x0F);
+	Byte(0xB6);
+	Byte(0xC0 | ((dst & 7) << 3) | (src & 7));
+}
+
+void JitCompiler::Imul(int dst, int src)
+{
+	Rex(false, dst, -1, src);
+	Byte(0x0F);
+	Byte(0xAF);
+	Byte(0xC0 | ((dst & 7) << 3) | (src & 7));
+}
+
+// F7 /extension: 2 not, 6 div
+//
+void JitCompiler::Unary(int extension, int reg)
+{
+	Rex(false, 0, -1, reg);
+	Byte(0xF7);
+	Byte(0xC0 | (extension << 3) | (reg & 7));
+}
+
+// C1 /extension: 4 shl, 5 shr
+//
+void JitCompiler::ShiftImm(int extension, int reg, uint8_t count)
+{
+	Rex(false, 0, -1, reg);
+	Byte(0xC1);
+	Byte(0xC0 | (extension << 3) | (reg & 7));
+	Byte(count);
+}
+
+// Destination has to be AL, CL, DL or BL
+//
+void JitCompiler::Setcc(uint8_t condition, int dst)
+{
+	Byte(0x0F);
+	Byte(0x90 | condition);
+	Byte(0xC0 | (dst & 7));
+}
+
+void JitCompiler::LoadByte(int dst, int base, int index, int32_t displacement)
+{
+	Rex(false, dst, index, base);
+	Byte(0x0F);
+	Byte(0xB6);
+	MemoryOperand(dst, base, index, displacement);
+}
+
+void JitCompiler::LoadWord(int dst, int base, int index, int32_t displacement)
+{
+	Rex(false, dst, index, base);
+	Byte(0x0F);
+	Byte(0xB7);
+	MemoryOperand(dst, base, index, displacement);
+}
+
+// Source has to be AL, CL, DL or BL
+//
+void JitCompiler::StoreByte(int base, int index, int32_t displacement, int src)
+{
+	Rex(false, src, index, base);
+	Byte(0x88);
+	MemoryOperand(src, base, index, displacement);
+}
+
+void JitCompiler::StoreWord(int base, int index, int32_t displacement, int src)
+{
+	Byte(0x66);
+	Rex(false, src, index, base);
+	Byte(0x89);
+	MemoryOperand(src, base, index, displacement);
+}
+
+void JitCompiler::StoreWordImm(int base, int32_t displacement, uint16_t imm)
+{
+	Byte(0x66);
+	Rex(false, 0, -1, base);
+	Byte(0xC7);
+	MemoryOperand(0, base, -1, displacement);
+	Byte(imm & 0xFF);
+	Byte(imm >> 8);
+}
+
+void JitCompiler::CmpByteImm(int base, int index, uint8_t imm)
+{
+	Rex(false, 0, index, base);
+	Byte(0x80);
+	MemoryOperand(7, base, index, 0);
+	Byte(imm);
+}
+
+void JitCompiler::Push(int reg)
+{
+	Rex(false, 0, -1, reg);
+	Byte(0x50 + (reg & 7));
+}
+
+void JitCompiler::Pop(int reg)
+{
+	Rex(false, 0, -1, reg);
+	Byte(0x58 + (reg & 7));
+}
+
+void JitCompiler::CallReg(int reg)
+{
+	Rex(false, 0, -1, reg);
+	Byte(0xFF);
+	Byte(0xD0 | (reg & 7));
+}
+
+// Jumps return position of their 32 bit offset, which is set later by Bind()
+//
+size_t JitCompiler::Jcc(uint8_t condition)
+{
+	Byte(0x0F);
+	Byte(0x80 | condition);
+	Dword(0);
+
+	return mCode.size() - 4;
+}
+
+size_t JitCompiler::Jmp()
+{
+	Byte(0xE9);
+	Dword(0);
+
+	return mCode.size() - 4;
+}
+
+void JitCompiler::Bind(size_t fixup)
+{
+	BindTo(fixup, mCode.size());
+}
+
+void JitCompiler::BindTo(size_t fixup, size_t target)
+{
+	int32_t offset = (int32_t)(target - (fixup + 4));
+
+	memcpy(&mCode[fixup], &offset, sizeof(offset));
+}
\ No newline at end of file
@@ -0,0 +1,101 @@
+#ifndef _JIT_H
+#define _JIT_H
+
+#include "cpu.h"
+#include <vector>
+#include <cstdint>
+
+// Native code of one basic block. It runs the whole block on guest state and
+// leaves address of next block in PC.
+//
+typedef void (*CompiledBlock)();
+
+// Translates basic blocks of one processor into x86-64 code in executable memory.
+// Guest registers r0-r5, sp and psw stay in host registers while a block runs, PC is
+// known at every point of a block so it is written only when the block is left.
+//
+class JitCompiler
+{
+public:
+	JitCompiler(CpuState& cpu);
+	~JitCompiler();
+
+	// False if there is no executable memory or host is not x86-64
+	//
+	bool IsAvailable() const;
+
+	// Returns nullptr when executable memory is full, Reset() makes room again
+	//
+	CompiledBlock Compile(BasicBlock* block);
+
+	// Forget all compiled code
+	//
+	void Reset();
+private:
+	void EmitMicroOp(BasicBlock* block, const DecodedInstruction& instruction, uint16_t next);
+	void EmitInterpreterCall(BasicBlock* block, const DecodedInstruction& instruction, uint16_t next, bool endsBlock);
+	void EmitExit(uint16_t pc);
+	void EmitValidCheck(BasicBlock* block, uint16_t next);
+
+	void EmitLoadGuestRegister(int host, uint8_t guest, uint16_t next);
+	void EmitStoreGuestRegister(uint8_t guest, int host);
+	void EmitRegisterIndirectAddress(const DecodedInstruction& instruction, uint16_t next);
+	void EmitReadCheck(uint16_t address);
+	void EmitLoadWord(uint16_t address);
+	void EmitLoadWordWrapped();
+	void EmitStoreWord(BasicBlock* block, uint16_t next);
+	void EmitSpill();
+	void EmitReload();
+	void EmitBasePointers();
+
+	// x86-64 encoding
+	//
+	void Byte(uint8_t byte);
+	void Dword(uint32_t dword);
+	void Qword(uint64_t qword);
+	void Rex(bool wide, int reg, int index, int base, bool force = false);
+	void MemoryOperand(int reg, int base, int index, int32_t displacement);
+	void MovRegReg(int dst, int src);
+	void MovRegImm(int dst, uint32_t imm);
+	void MovRegImm64(int dst, uint64_t imm);
+	void AluRegReg(uint8_t opCode, int dst, int src);
+	void AluRegImm(int extension, int dst, uint32_t imm);
+	void Cmp16RegReg(int left, int right);
+	void TestRegImm(int reg, uint32_t imm);
+	void Movzx16(int dst, int src);
+	void Movzx8(int dst, int src);
+	void Imul(int dst, int src);
+	void Unary(int extension, int reg);
+	void ShiftImm(int extension, int reg, uint8_t count);
+	void Setcc(uint8_t condition, int dst);
+	void LoadByte(int dst, int base, int index, int32_t displacement);
+	void LoadWord(int dst, int base, int index, int32_t displacement);
+	void StoreByte(int base, int index, int32_t displacement, int src);
+	void StoreWord(int base, int index, int32_t displacement, int src);
+	void StoreWordImm(int base, int32_t displacement, uint16_t imm);
+	void CmpByteImm(int base, int index, uint8_t imm);
+	void Push(int reg);
+	void Pop(int reg);
+	void CallReg(int reg);
+	size_t Jcc(uint8_t condition);
+	size_t Jmp();
+	void Bind(size_t fixup);
+	void BindTo(size_t fixup, size_t target);
+
+	// Compiled code works directly on registers and memory of this processor
+	//
+	CpuState* mState;
+
+	std::vector<uint8_t> mCode;
+
+	// Jumps to common block exits, patched once whole block is emitted
+	//
+	std::vector<size_t> mSpillExits;
+	std::vector<size_t> mReturnExits;
+
+	uint8_t* mExecutableMemory;
+	size_t mExecutableSize;
+	size_t mExecutableUsed;
+};
+
+#endif
\ No newline at end of file
@@ -1,29 +1,669 @@
 #include <iostream>
+#include <sstream>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <memory>
 #include "emulator.h"
+#include "error.h"
 
-void ReadCmdArguments(int argc, char* argv[], std::string& inputFile)
+struct CommandLineOptions
 {
-	if (argc < 2)
+	std::vector<std::string> inputFiles;
+
+	// Number of host threads running programs of batch
+	//
+	int parallel = 1;
+
+	// Processors of emulated machine, each on its own host thread
+	//
+	int cpus = 1;
+
+	bool isThreadedSpecified = false;
+	bool isBlocksSpecified = false;
+	bool isJitSpecified = false;
+	bool isStartupTimeSpecified = false;
+	bool isSemihostingSpecified = false;
+
+	// Counters of the run as JSON, after its result
+	//
+	bool isStatsSpecified = false;
+
+	// Snapshot is taken before instruction at snapshotPC, after snapshotCount instructions,
+	// or of the final state once the run has stopped
+	//
+	bool isSnapshotSpecified = false;
+	bool isSnapshotAtPC = false;
+	bool isSnapshotAtEnd = false;
+	uint16_t snapshotPC = 0;
+	uint64_t snapshotCount = 0;
+	std::string snapshotFile = "";
+
+	// Profiled or traced program runs on the basic interpreter
+	//
+	std::string profileFile = "";
+	uint64_t traceCapacity = 0;
+	std::string traceFile = "trace.ring";
+
+	// Coverage is recorded in every mode, it is only written when asked for
+	//
+	std::string coverageFile = "";
+
+	// Terminal input log, replay needs the same execution mode as recording
+	//
+	std::string recordFile = "";
+	std::string replayFile = "";
+
+	// Program which runs longer than this is stopped and counts as failed
+	//
+	uint64_t maxInstructions = NO_INSTRUCTION_LIMIT;
+	uint64_t timeout = 0;
+};
+
+void ReadSnapshotPoint(std::string value, CommandLineOptions& options)
+{
+	try
 	{
-		return;
+		if (value == "end")
+		{
+			options.isSnapshotAtEnd = true;
+		}
+		else if (value.compare(0, 3, "pc:") == 0)
+		{
+			options.isSnapshotAtPC = true;
+			options.snapshotPC = std::stoul(value.substr(3), nullptr, 0);
+		}
+		else
+		{
+			if (value.compare(0, 6, "instr:") == 0)
+			{
+				value = value.substr(6);
+			}
+
+			options.snapshotCount = std::stoull(value, nullptr, 0);
+		}
+	}
+	catch (std::exception&)
+	{
+		RaiseError("Wrong snapshot point " + value);
 	}
 
-	inputFile = argv[1];
+	options.isSnapshotSpecified = true;
 }
 
-int main(int argc, char* argv[])
+void ReadCmdArguments(int argc, char* argv[], CommandLineOptions& options)
+{
+	// FORMAT:
+	// ./emulator [--threaded | --blocks | --jit | [--profile file] [--trace-ring N [--trace-out file]]] [--startup-time]
+	//            [--snapshot-at pc:<address> | [instr:]<count> | end --snapshot-out file] [--record file | --replay file]
+	//            [--max-instr N] [--timeout-ms T] [--semihosting] [--coverage file] [--stats json] (program.hex | --restore file)
+	// ./emulator [--threaded | --blocks | --jit] [--max-instr N] [--timeout-ms T] [--semihosting] [--stats json] [--parallel N] a.hex b.hex ...
+	// ./emulator [--threaded | --blocks] [--max-instr N] [--timeout-ms T] [--semihosting] [--coverage file] [--stats json] --cpus N program.hex
+	//
+	// Exit code of a single program is the one it gave to semihosted exit, 0 after halt,
+	// -1 after error or limit
+	//
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+
+		if (arg == "--threaded")
+		{
+			options.isThreadedSpecified = true;
+		}
+		else if (arg == "--blocks")
+		{
+			options.isBlocksSpecified = true;
+		}
+		else if (arg == "--jit")
+		{
+			options.isJitSpecified = true;
+		}
+		else if (arg == "--startup-time")
+		{
+			options.isStartupTimeSpecified = true;
+		}
+		else if (arg == "--semihosting")
+		{
+			options.isSemihostingSpecified = true;
+		}
+		else if ((arg == "--snapshot-at" || arg == "--snapshot-out" || arg == "--restore" || arg == "--parallel" || arg == "--cpus" ||
+			arg == "--profile" || arg == "--trace-ring" || arg == "--trace-out" || arg == "--coverage" ||
+			arg == "--record" || arg == "--replay" || arg == "--max-instr" || arg == "--timeout-ms" || arg == "--stats") && i + 1 == argc)
+		{
+			RaiseError("Missing value of " + arg);
+		}
+		else if (arg == "--snapshot-at")
+		{
+			ReadSnapshotPoint(argv[++i], options);
+		}
+		else if (arg == "--snapshot-out")
+		{
+			options.snapshotFile = argv[++i];
+		}
+		else if (arg == "--profile")
+		{
+			options.profileFile = argv[++i];
+		}
+		else if (arg == "--coverage")
+		{
+			options.coverageFile = argv[++i];
+		}
+		else if (arg == "--stats")
+		{
+			std::string format = argv[++i];
+
+			if (format != "json")
+			{
+				RaiseError("Unknown statistics format " + format);
+			}
+
+			options.isStatsSpecified = true;
+		}
+		else if (arg == "--trace-ring")
+		{
+			std::string value = argv[++i];
+
+			try
+			{
+				options.traceCapacity = std::stoull(value, nullptr, 0);
+			}
+			catch (std::exception&)
+			{
+				RaiseError("Wrong trace size " + value);
+			}
+
+			if (options.traceCapacity == 0)
+			{
+				RaiseError("Wrong trace size " + value);
+			}
+		}
+		else if (arg == "--trace-out")
+		{
+			options.traceFile = argv[++i];
+		}
+		else if (arg == "--max-instr" || arg == "--timeout-ms")
+		{
+			std::string value = argv[++i];
+			uint64_t limit = 0;
+
+			try
+			{
+				limit = std::stoull(value, nullptr, 0);
+			}
+			catch (std::exception&)
+			{
+				RaiseError("Wrong value of " + arg + " " + value);
+			}
+
+			if (arg == "--max-instr")
+			{
+				options.maxInstructions = limit;
+			}
+			else
+			{
+				options.timeout = limit;
+			}
+		}
+		else if (arg == "--record")
+		{
+			options.recordFile = argv[++i];
+		}
+		else if (arg == "--replay")
+		{
+			options.replayFile = argv[++i];
+		}
+		else if (arg == "--restore")
+		{
+			// Snapshot is loaded like any other program image
+			//
+			options.inputFiles.push_back(argv[++i]);
+		}
+		else if (arg == "--parallel")
+		{
+			std::string value = argv[++i];
+
+			try
+			{
+				options.parallel = std::stoi(value);
+			}
+			catch (std::exception&)
+			{
+				RaiseError("Wrong number of threads " + value);
+			}
+
+			if (options.parallel < 1)
+			{
+				RaiseError("Wrong number of threads " + value);
+			}
+		}
+		else if (arg == "--cpus")
+		{
+			std::string value = argv[++i];
+
+			try
+			{
+				options.cpus = std::stoi(value);
+			}
+			catch (std::exception&)
+			{
+				RaiseError("Wrong number of processors " + value);
+			}
+
+			if (options.cpus < 1)
+			{
+				RaiseError("Wrong number of processors " + value);
+			}
+		}
+		else
+		{
+			options.inputFiles.push_back(arg);
+		}
+	}
+
+	if (options.inputFiles.empty())
+	{
+		RaiseError("Missing program image");
+	}
+
+	if (options.isSnapshotSpecified && options.inputFiles.size() > 1)
+	{
+		RaiseError("--snapshot-at works with one program only");
+	}
+
+	bool isInstrumented = !options.profileFile.empty() || options.traceCapacity != 0;
+
+	if (isInstrumented && options.inputFiles.size() > 1)
+	{
+		RaiseError("--profile and --trace-ring work with one program only");
+	}
+
+	if (isInstrumented && (options.isThreadedSpecified || options.isBlocksSpecified || options.isJitSpecified))
+	{
+		RaiseError("--profile and --trace-ring cannot be combined with --threaded, --blocks or --jit");
+	}
+
+	if (options.isStatsSpecified && options.isThreadedSpecified)
+	{
+		RaiseError("--stats cannot be combined with --threaded");
+	}
+
+	if ((!options.recordFile.empty() || !options.replayFile.empty()) && options.inputFiles.size() > 1)
+	{
+		RaiseError("--record and --replay work with one program only");
+	}
+
+	if (!options.coverageFile.empty() && options.inputFiles.size() > 1)
+	{
+		RaiseError("--coverage works with one program only");
+	}
+
+	if (!options.recordFile.empty() && !options.replayFile.empty())
+	{
+		RaiseError("--record cannot be combined with --replay");
+	}
+
+	if (options.isSnapshotSpecified && options.snapshotFile.empty())
+	{
+		RaiseError("--snapshot-at requires --snapshot-out");
+	}
+
+	if (options.cpus > 1 && (options.inputFiles.size() > 1 || options.parallel > 1))
+	{
+		RaiseError("--cpus works with one program only");
+	}
+
+	// Compiled code accesses memory byte by byte, which breaks atomic words of shared memory
+	//
+	if (options.cpus > 1 && (options.isJitSpecified || isInstrumented || options.isSnapshotSpecified ||
+		!options.recordFile.empty() || !options.replayFile.empty()))
+	{
+		RaiseError("--cpus cannot be combined with --jit, --profile, --trace-ring, --snapshot-at, --record or --replay");
+	}
+}
+
+StopReason RunInSelectedMode(Emulator& emulator, const CommandLineOptions& options)
+{
+	if (options.isThreadedSpecified)
+	{
+		return emulator.RunThreaded(options.maxInstructions);
+	}
+	else if (options.isBlocksSpecified)
+	{
+		return emulator.RunBlocks(options.maxInstructions);
+	}
+	else if (options.isJitSpecified)
+	{
+		return emulator.RunJit(options.maxInstructions);
+	}
+
+	return emulator.Run(options.maxInstructions);
+}
+
+// Loads and runs one program on its own emulator, results and errors go to output.
+// Returns -1 if program was stopped by an error or did not halt within its limits,
+// otherwise its exit code.
+//
+int RunProgram(const std::string& inputFile, const CommandLineOptions& options, std::ostream& output)
+{
+	try
+	{
+		Emulator emulator;
+
+		// Batch keeps guest output with result of its program
+		//
+		emulator.SetTerminalOutput(output);
+
+		if (!options.profileFile.empty())
+		{
+			emulator.EnableProfile();
+		}
+
+		if (options.traceCapacity != 0)
+		{
+			emulator.EnableTrace(options.traceCapacity, options.traceFile);
+		}
+
+		if (!options.recordFile.empty())
+		{
+			emulator.RecordInput(options.recordFile);
+		}
+
+		if (!options.replayFile.empty())
+		{
+			emulator.ReplayInput(options.replayFile);
+		}
+
+		if (options.isSemihostingSpecified)
+		{
+			emulator.EnableSemihosting();
+		}
+
+		if (options.isStatsSpecified)
+		{
+			emulator.EnableStatistics();
+		}
+
+		auto startupBegin = std::chrono::steady_clock::now();
+
+		emulator.ReadMemoryContent(inputFile);
+
+		emulator.Init();
+
+		auto startupTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startupBegin);
+
+		emulator.SetTimeout(options.timeout);
+
+		auto runBegin = std::chrono::steady_clock::now();
+
+		if (options.isSnapshotSpecified && !options.isSnapshotAtEnd)
+		{
+			if (options.isSnapshotAtPC)
+			{
+				emulator.RunToAddress(options.snapshotPC);
+			}
+			else
+			{
+				emulator.Step(options.snapshotCount);
+			}
+
+			emulator.SaveSnapshot(options.snapshotFile);
+		}
+
+		StopReason reason = RunInSelectedMode(emulator, options);
+
+		auto runTime = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - runBegin);
+
+		emulator.OutputResult(output);
+
+		if (options.isSnapshotAtEnd)
+		{
+			emulator.SaveSnapshot(options.snapshotFile);
+		}
+
+		if (!options.profileFile.empty())
+		{
+			emulator.WriteProfile(options.profileFile, inputFile + "_symbols.txt");
+		}
+
+		if (!options.coverageFile.empty())
+		{
+			std::vector<uint8_t> coverage;
+			emulator.ReadCoverage(coverage);
+			Emulator::WriteCoverageFile(options.coverageFile, coverage);
+		}
+
+		if (options.isBlocksSpecified || options.isJitSpecified)
+		{
+			emulator.OutputBlockStatistics(output);
+		}
+
+		if (options.isStartupTimeSpecified)
+		{
+			output << "Startup time: " << startupTime.count() << " us\n";
+		}
+
+		if (options.isStatsSpecified)
+		{
+			emulator.OutputStatistics(output, runTime.count());
+		}
+
+		if (reason == STOP_EXIT)
+		{
+			return emulator.GetExitCode();
+		}
+
+		if (reason != STOP_HALT)
+		{
+			return -1;
+		}
+	}
+	catch (EmulatorError& error)
+	{
+		output << error.what();
+		return -1;
+	}
+
+	return 0;
+}
+
+// Runs independent programs on a pool of threads. Results are printed in order of
+// input files, no matter which program finishes first.
+//
+bool RunBatch(const CommandLineOptions& options)
+{
+	size_t count = options.inputFiles.size();
+
+	std::vector<std::string> results(count);
+	std::vector<char> succeeded(count, false);
+	std::atomic<size_t> nextProgram(0);
+
+	auto worker = [&]()
+	{
+		for (size_t i = nextProgram++; i < count; i = nextProgram++)
+		{
+			std::ostringstream output;
+			succeeded[i] = RunProgram(options.inputFiles[i], options, output) == 0;
+			results[i] = output.str();
+		}
+	};
+
+	std::vector<std::thread> threads;
+
+	for (size_t i = 0; i < (size_t)options.parallel && i < count; i++)
+	{
+		threads.emplace_back(worker);
+	}
+
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+
+	bool allSucceeded = true;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		std::cout << "==> " << options.inputFiles[i] << " <==\n" << results[i] << "\n";
+		allSucceeded = allSucceeded && succeeded[i];
+	}
+
+	return allSucceeded;
+}
+
+// Runs one program on a machine of several processors sharing memory. Results are printed
+// per processor once all of them have stopped. Processors other than 0 run only once
+// another one starts them.
+//
+bool RunMachine(const std::string& inputFile, const CommandLineOptions& options)
 {
-	std::string inputFile = "";
+	std::vector<std::unique_ptr<Emulator>> processors;
 
-	ReadCmdArguments(argc, argv, inputFile);
+	try
+	{
+		for (int i = 0; i < options.cpus; i++)
+		{
+			processors.emplace_back(new Emulator());
 
-	Emulator emulator;
+			if (i != 0)
+			{
+				processors[i]->JoinMachine(*processors[0], i);
+			}
 
-	emulator.ReadMemoryContent(inputFile);
+			if (options.isSemihostingSpecified)
+			{
+				processors[i]->EnableSemihosting();
+			}
 
-	emulator.Init();
+			if (options.isStatsSpecified)
+			{
+				processors[i]->EnableStatistics();
+			}
+		}
 
-	emulator.Run();
+		processors[0]->ReadMemoryContent(inputFile);
+
+		for (auto& processor : processors)
+		{
+			processor->Init();
+			processor->SetTimeout(options.timeout);
+		}
+	}
+	catch (EmulatorError& error)
+	{
+		std::cout << error.what();
+		return false;
+	}
+
+	std::vector<std::string> results(options.cpus);
+	std::vector<char> succeeded(options.cpus, false);
+	std::vector<std::thread> threads;
+
+	for (int i = 0; i < options.cpus; i++)
+	{
+		threads.emplace_back([&, i]()
+		{
+			std::ostringstream output;
+
+			if (!processors[i]->WaitForStart())
+			{
+				output << "\nEmulated processor was never started\n";
+				succeeded[i] = true;
+				results[i] = output.str();
+				return;
+			}
+
+			try
+			{
+				auto runBegin = std::chrono::steady_clock::now();
+
+				StopReason reason = RunInSelectedMode(*processors[i], options);
+
+				auto runTime = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - runBegin);
+
+				processors[i]->OutputResult(output);
+
+				if (options.isStatsSpecified)
+				{
+					processors[i]->OutputStatistics(output, runTime.count());
+				}
+
+				succeeded[i] = reason == STOP_HALT || (reason == STOP_EXIT && processors[i]->GetExitCode() == 0);
+			}
+			catch (EmulatorError& error)
+			{
+				output << error.what();
+			}
+
+			processors[i]->LeaveMachine();
+
+			results[i] = output.str();
+		});
+	}
+
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+
+	// Processors ran the same program, so their coverage is merged
+	//
+	if (!options.coverageFile.empty())
+	{
+		try
+		{
+			std::vector<uint8_t> coverage;
+
+			for (auto& processor : processors)
+			{
+				processor->ReadCoverage(coverage);
+			}
+
+			Emulator::WriteCoverageFile(options.coverageFile, coverage);
+		}
+		catch (EmulatorError& error)
+		{
+			std::cout << error.what();
+			return false;
+		}
+	}
+
+	bool allSucceeded = true;
+
+	for (int i = 0; i < options.cpus; i++)
+	{
+		std::cout << "==> cpu " << i << " <==" << results[i] << "\n";
+		allSucceeded = allSucceeded && succeeded[i];
+	}
+
+	return allSucceeded;
+}
+
+int main(int argc, char* argv[])
+{
+	CommandLineOptions options;
+
+	try
+	{
+		ReadCmdArguments(argc, argv, options);
+	}
+	catch (EmulatorError& error)
+	{
+		std::cout << error.what();
+		return -1;
+	}
+
+	if (options.cpus > 1)
+	{
+		return RunMachine(options.inputFiles[0], options) ? 0 : -1;
+	}
+
+	if (options.inputFiles.size() > 1 || options.parallel > 1)
+	{
+		return RunBatch(options) ? 0 : -1;
+	}
 
-	emulator.OutputResult();
+	return RunProgram(options.inputFiles[0], options, std::cout);
 }
\ No newline at end of file
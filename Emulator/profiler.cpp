@@ -0,0 +1,160 @@
+#include "emulator.h"
+#include "cpu.h"
+#include "disassembler.h"
+#include "error.h"
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <map>
+#include <algorithm>
+
+// Number of addresses listed in hot spot part of profile
+//
+#define PROFILE_TOP_ADDRESSES 20
+
+// Lines of <output>_symbols.txt are "<name> : <address>". Sections share addresses with
+// their first symbol, which comes first in file, so the first name at an address wins.
+//
+std::map<uint16_t, std::string> ReadSymbols(const std::string& symbolFile)
+{
+	std::map<uint16_t, std::string> symbols;
+	std::ifstream input(symbolFile);
+	std::string line;
+
+	while (std::getline(input, line))
+	{
+		std::istringstream fields(line);
+		std::string name;
+		std::string separator;
+		std::string address;
+
+		if (fields >> name >> separator >> address && separator == ":")
+		{
+			try
+			{
+				symbols.emplace(std::stoul(address, nullptr, 0), name);
+			}
+			catch (std::exception&)
+			{
+			}
+		}
+	}
+
+	return symbols;
+}
+
+// Closest symbol at or below address, with offset from it
+//
+std::string SymbolOf(const std::map<uint16_t, std::string>& symbols, uint16_t address, uint16_t& offset)
+{
+	auto symbol = symbols.upper_bound(address);
+
+	if (symbol == symbols.begin())
+	{
+		offset = address;
+		return "??";
+	}
+
+	symbol--;
+	offset = address - symbol->first;
+
+	return symbol->second;
+}
+
+std::string Percent(uint64_t count, uint64_t total)
+{
+	std::ostringstream text;
+	text << std::fixed << std::setprecision(2) << (total == 0 ? 0 : 100.0 * count / total) << "%";
+
+	return text.str();
+}
+
+void Emulator::WriteProfile(const std::string& outputFile, const std::string& symbolFile)
+{
+	CpuState& cpu = *mState;
+
+	std::ofstream output(outputFile);
+
+	if (!output.is_open() || !output.good())
+	{
+		RaiseError("Error opening " + outputFile);
+	}
+
+	std::map<uint16_t, std::string> symbols = ReadSymbols(symbolFile);
+	std::map<std::string, uint64_t> functions;
+	std::vector<uint16_t> addresses;
+	uint64_t total = 0;
+
+	for (int address = 0; address < (int)cpu.profileCounts.size(); address++)
+	{
+		uint64_t count = cpu.profileCounts[address];
+
+		if (count != 0)
+		{
+			uint16_t offset;
+			functions[SymbolOf(symbols, address, offset)] += count;
+			addresses.push_back(address);
+			total += count;
+		}
+	}
+
+	std::vector<std::pair<std::string, uint64_t>> byFunction(functions.begin(), functions.end());
+
+	std::stable_sort(byFunction.begin(), byFunction.end(), [](const std::pair<std::string, uint64_t>& a, const std::pair<std::string, uint64_t>& b)
+	{
+		return a.second > b.second;
+	});
+
+	std::stable_sort(addresses.begin(), addresses.end(), [&cpu](uint16_t a, uint16_t b)
+	{
+		return cpu.profileCounts[a] > cpu.profileCounts[b];
+	});
+
+	output << "Executed instructions: " << total << "\n";
+	output << "\nFunctions:\n";
+	output << std::setw(14) << "count" << std::setw(10) << "percent" << "  function\n";
+
+	for (auto& function : byFunction)
+	{
+		output << std::setw(14) << function.second << std::setw(10) << Percent(function.second, total) << "  " << function.first << "\n";
+	}
+
+	output << "\nHottest addresses:\n";
+	output << std::setw(8) << "address" << std::setw(14) << "count" << std::setw(10) << "percent" << "  " << std::left << std::setw(24) << "location" << std::right << "instruction\n";
+
+	for (size_t i = 0; i < addresses.size() && i < PROFILE_TOP_ADDRESSES; i++)
+	{
+		uint16_t address = addresses[i];
+		uint16_t offset;
+		std::string location = SymbolOf(symbols, address, offset);
+
+		std::ostringstream locationText;
+		locationText << location << "+0x" << std::hex << std::uppercase << offset;
+
+		DecodedInstruction instruction;
+		std::string text = "(wrong opcode)";
+
+		// Instruction running past end of memory stopped the program with error
+		//
+		try
+		{
+			if (LoadInstruction(address, instruction))
+			{
+				text = Disassemble(instruction, address + instruction.size);
+			}
+		}
+		catch (EmulatorError&)
+		{
+			text = "(past end of memory)";
+		}
+
+		output << "  0x" << std::hex << std::uppercase << std::setw(4) << std::setfill('0') << address << std::dec << std::setfill(' ');
+		output << std::setw(14) << cpu.profileCounts[address] << std::setw(10) << Percent(cpu.profileCounts[address], total) << "  ";
+		output << std::left << std::setw(24) << locationText.str() << std::right << text << "\n";
+	}
+
+	if (!output.good())
+	{
+		RaiseError("Error writing " + outputFile);
+	}
+}
\ No newline at end of file
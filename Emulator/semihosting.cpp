@@ -0,0 +1,237 @@
+#include "devices.h"
+#include "cpu.h"
+#include <chrono>
+
+uint16_t ReadWord(CpuState& cpu, uint16_t address);
+void WriteWord(CpuState& cpu, uint16_t address, uint16_t value);
+void MaterializeFlags(CpuState& cpu);
+void InvalidateDecodeCache(CpuState& cpu, uint16_t address);
+void StopRun(CpuState& cpu, StopReason reason);
+
+// Longest path guest may give to open, with terminating zero
+//
+#define SEMIHOST_MAX_PATH 256
+
+// Buffer must not wrap around end of memory
+//
+bool IsGuestBuffer(uint16_t buffer, uint16_t length)
+{
+	return (uint32_t)buffer + length <= MEMORY_SIZE;
+}
+
+FILE* GetSemihostFile(CpuState& cpu, uint16_t handle)
+{
+	if (handle < SEMIHOST_FIRST_FILE || (size_t)(handle - SEMIHOST_FIRST_FILE) >= cpu.semihost.files.size())
+	{
+		return nullptr;
+	}
+
+	return cpu.semihost.files[handle - SEMIHOST_FIRST_FILE];
+}
+
+uint16_t SemihostWrite(CpuState& cpu, uint16_t handle, uint16_t buffer, uint16_t length)
+{
+	if (!IsGuestBuffer(buffer, length))
+	{
+		return SEMIHOST_ERROR;
+	}
+
+	FILE* file = GetSemihostFile(cpu, handle);
+
+	if (handle == SEMIHOST_STDOUT || handle == SEMIHOST_STDERR)
+	{
+		if (cpu.terminal.isDisconnected)
+		{
+			return length;
+		}
+
+		// Whatever guest wrote through terminal comes first
+		//
+		FlushTerminal(cpu);
+
+		// Stdout goes where terminal output goes, so that batch keeps it with its program
+		//
+		if (handle == SEMIHOST_STDOUT)
+		{
+			std::ostream& output = *cpu.terminal.hostOutput;
+
+			output.write((const char*)&cpu.memory[buffer], length);
+			output.flush();
+
+			return output.good() ? length : 0;
+		}
+
+		file = stderr;
+	}
+
+	if (file == nullptr)
+	{
+		return SEMIHOST_ERROR;
+	}
+
+	size_t written = std::fwrite(&cpu.memory[buffer], 1, length, file);
+	std::fflush(file);
+
+	return written;
+}
+
+// Bytes read are stored like WriteMemory() stores them, devices are not notified
+//
+uint16_t SemihostRead(CpuState& cpu, uint16_t handle, uint16_t buffer, uint16_t length)
+{
+	FILE* file = GetSemihostFile(cpu, handle);
+
+	if (file == nullptr || !IsGuestBuffer(buffer, length))
+	{
+		return SEMIHOST_ERROR;
+	}
+
+	for (uint32_t i = buffer; i < (uint32_t)buffer + length; i++)
+	{
+		if (cpu.watchedBytes[i] & CODE_BYTE)
+		{
+			InvalidateDecodeCache(cpu, i);
+		}
+	}
+
+	return std::fread(&cpu.memory[buffer], 1, length, file);
+}
+
+uint16_t SemihostOpen(CpuState& cpu, uint16_t pathAddress, uint16_t mode)
+{
+	const char* modes[] = { "rb", "wb", "ab" };
+
+	if (mode > SEMIHOST_OPEN_APPEND)
+	{
+		return SEMIHOST_ERROR;
+	}
+
+	std::string path;
+
+	for (uint32_t address = pathAddress; cpu.memory[address] != 0; address++)
+	{
+		if (address == MEMORY_SIZE - 1 || path.size() == SEMIHOST_MAX_PATH - 1)
+		{
+			return SEMIHOST_ERROR;
+		}
+
+		path += (char)cpu.memory[address];
+	}
+
+	std::vector<FILE*>& files = cpu.semihost.files;
+
+	if (files.size() >= SEMIHOST_ERROR - SEMIHOST_FIRST_FILE)
+	{
+		return SEMIHOST_ERROR;
+	}
+
+	FILE* file = std::fopen(path.c_str(), modes[mode]);
+
+	if (file == nullptr)
+	{
+		return SEMIHOST_ERROR;
+	}
+
+	// Handles of closed files are given again
+	//
+	size_t index = std::find(files.begin(), files.end(), nullptr) - files.begin();
+
+	if (index == files.size())
+	{
+		files.push_back(file);
+	}
+	else
+	{
+		files[index] = file;
+	}
+
+	return index + SEMIHOST_FIRST_FILE;
+}
+
+uint16_t SemihostClose(CpuState& cpu, uint16_t handle)
+{
+	FILE* file = GetSemihostFile(cpu, handle);
+
+	if (file == nullptr)
+	{
+		return SEMIHOST_ERROR;
+	}
+
+	cpu.semihost.files[handle - SEMIHOST_FIRST_FILE] = nullptr;
+
+	return std::fclose(file) == 0 ? 0 : SEMIHOST_ERROR;
+}
+
+// Host time makes run depend on when it happens, replayed runs see different values
+//
+uint16_t SemihostTime(CpuState& cpu, uint16_t block)
+{
+	uint64_t milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+
+	for (int i = 1; i <= 3; i++)
+	{
+		WriteWord(cpu, block + i * 2, milliseconds & 0xFFFF);
+		milliseconds >>= 16;
+	}
+
+	return 0;
+}
+
+void HandleSemihostRequest(CpuState& cpu)
+{
+	uint16_t block = cpu.regs[1];
+	uint16_t operation = ReadWord(cpu, block);
+	uint16_t arguments[3];
+
+	for (int i = 0; i < 3; i++)
+	{
+		arguments[i] = ReadWord(cpu, block + (i + 1) * 2);
+	}
+
+	uint16_t result = SEMIHOST_ERROR;
+
+	switch (operation)
+	{
+	case SEMIHOST_WRITE:
+		result = SemihostWrite(cpu, arguments[0], arguments[1], arguments[2]);
+		break;
+	case SEMIHOST_READ:
+		result = SemihostRead(cpu, arguments[0], arguments[1], arguments[2]);
+		break;
+	case SEMIHOST_OPEN:
+		result = SemihostOpen(cpu, arguments[0], arguments[1]);
+		break;
+	case SEMIHOST_CLOSE:
+		result = SemihostClose(cpu, arguments[0]);
+		break;
+	case SEMIHOST_TIME:
+		result = SemihostTime(cpu, block);
+		break;
+	case SEMIHOST_EXIT:
+		// Processor stays stopped, same as after halt
+		//
+		cpu.semihost.exitCode = arguments[0];
+		cpu.haltInstruction = true;
+		StopRun(cpu, STOP_EXIT);
+		MaterializeFlags(cpu);
+		FlushTerminal(cpu);
+		result = 0;
+		break;
+	}
+
+	cpu.regs[0] = result;
+}
+
+void CloseSemihostFiles(CpuState& cpu)
+{
+	for (FILE* file : cpu.semihost.files)
+	{
+		if (file != nullptr)
+		{
+			std::fclose(file);
+		}
+	}
+
+	cpu.semihost.files.clear();
+}
\ No newline at end of file
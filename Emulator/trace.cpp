@@ -0,0 +1,98 @@
+#include "trace.h"
+#include <cstring>
+#include <fstream>
+
+#if defined(__unix__)
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+TraceRing::TraceRing(size_t capacity, const std::string& outputFile)
+	: mRecords(capacity), mNext(0), mTotal(0), mOutputFile(outputFile)
+{
+}
+
+#if defined(__unix__)
+bool WriteAll(int file, const void* data, size_t size)
+{
+	const char* bytes = (const char*)data;
+
+	while (size != 0)
+	{
+		ssize_t written = write(file, bytes, size);
+
+		if (written <= 0)
+		{
+			return false;
+		}
+
+		bytes += written;
+		size -= written;
+	}
+
+	return true;
+}
+#endif
+
+bool TraceRing::Dump() const
+{
+	TraceFileHeader header;
+	memcpy(header.magic, TRACE_MAGIC, 4);
+	header.version = TRACE_VERSION;
+	header.recordSize = sizeof(TraceRecord);
+	header.totalRecords = mTotal;
+	header.recordCount = mTotal < mRecords.size() ? mTotal : mRecords.size();
+
+	// Oldest record is the one to be overwritten next, unless ring is not full yet
+	//
+	size_t oldest = mTotal < mRecords.size() ? 0 : mNext;
+	size_t tail = header.recordCount - oldest;
+
+	const char* records = (const char*)mRecords.data();
+
+#if defined(__unix__)
+	int file = open(mOutputFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (file < 0)
+	{
+		return false;
+	}
+
+	bool written = WriteAll(file, &header, sizeof(header)) &&
+		WriteAll(file, records + oldest * sizeof(TraceRecord), tail * sizeof(TraceRecord)) &&
+		WriteAll(file, records, oldest * sizeof(TraceRecord));
+
+	close(file);
+
+	return written;
+#else
+	std::ofstream output(mOutputFile, std::ios::binary | std::ios::out);
+
+	output.write((const char*)&header, sizeof(header));
+	output.write(records + oldest * sizeof(TraceRecord), tail * sizeof(TraceRecord));
+	output.write(records, oldest * sizeof(TraceRecord));
+
+	return output.good();
+#endif
+}
+
+#if defined(__unix__)
+const TraceRing* signalledRing = nullptr;
+
+void DumpTraceOnSignal(int)
+{
+	if (signalledRing != nullptr)
+	{
+		signalledRing->Dump();
+	}
+}
+#endif
+
+void InstallTraceSignalHandler(const TraceRing* ring)
+{
+#if defined(__unix__)
+	signalledRing = ring;
+	signal(SIGUSR1, ring != nullptr ? DumpTraceOnSignal : SIG_DFL);
+#endif
+}
\ No newline at end of file
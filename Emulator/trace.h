@@ -0,0 +1,82 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <string>
+
+// Ring dump written by --trace-ring and read by trace decoder
+//
+#define TRACE_MAGIC "SSTR"
+#define TRACE_VERSION 1
+
+// Low nibble of flags when instruction wrote no register
+//
+#define TRACE_NO_REGISTER 0x0F
+
+// Flag set when address of record is valid
+//
+#define TRACE_MEMORY 0x80
+
+// One executed instruction. Value is new value of written register, or the word
+// stored to memory by instructions which write no register.
+//
+struct TraceRecord
+{
+	uint16_t pc;
+	uint8_t opCode;
+	uint8_t flags;
+	uint16_t value;
+	uint16_t address;
+};
+
+// <magic> <version> <record_size> <total_records> <record_count>, then records from oldest to newest
+//
+struct TraceFileHeader
+{
+	char magic[4];
+	uint16_t version;
+	uint16_t recordSize;
+	uint64_t totalRecords;
+	uint64_t recordCount;
+};
+
+// Preallocated ring of the last executed instructions. Recording only fills in a record,
+// everything else happens when the ring is dumped.
+//
+class TraceRing
+{
+public:
+	TraceRing(size_t capacity, const std::string& outputFile);
+
+	TraceRecord& Next()
+	{
+		TraceRecord& record = mRecords[mNext];
+
+		if (++mNext == mRecords.size())
+		{
+			mNext = 0;
+		}
+
+		mTotal++;
+
+		return record;
+	}
+
+	// Uses only async-signal-safe calls, so it may run from signal handler
+	//
+	bool Dump() const;
+private:
+	std::vector<TraceRecord> mRecords;
+	size_t mNext;
+	uint64_t mTotal;
+
+	std::string mOutputFile;
+};
+
+// SIGUSR1 dumps ring of running program without stopping it
+//
+void InstallTraceSignalHandler(const TraceRing* ring);
+
+#endif
\ No newline at end of file
@@ -24,6 +24,10 @@ std::unordered_map<std::string, std::vector<int8_t>> outputMap;
 //
 std::vector<int8_t> output;
 
+// Address range of each merged section in output, written as segments of program image
+//
+std::vector<std::pair<uint16_t, uint32_t>> segments;
+
 // Change symbols indices to sections so that they point to correct indices in globalSctHdrTab
 //
 void Linker::FixSymbolsSectionIndices()
@@ -179,6 +183,8 @@ void Linker::MergeSections()
 
 		outputed.insert(sectionName);
 
+		size_t segmentStart = output.size();
+
 		// Traverse all sections from all files
 		//
 		for (auto file : filesContent)
@@ -194,6 +200,11 @@ void Linker::MergeSections()
 				output.push_back(byte);
 			}
 		}
+
+		if (output.size() > segmentStart)
+		{
+			segments.push_back({ (uint16_t)segmentStart, (uint32_t)(output.size() - segmentStart) });
+		}
 	}
 }
 
@@ -306,17 +317,32 @@ void Linker::Dump(std::string outputFileName)
 		addr++;
 	}
 
-	// .obj output
+	// Program image
 	// Format
-	// <number_of_bytes> <addr> <byte> <addr> <byte>......
+	// <magic "SSIM"> <version> <entry point> <number_of_segments>
+	// <load_address> <length> <bytes>......
 	//
-	size_t sz = output.size();
-	outputFile.write((char*)&sz, sizeof(size_t));
-	addr = 0x0000;
-	for (int i = 0; i < output.size(); i++, addr++)
+	uint16_t version = IMAGE_VERSION;
+	uint16_t entryPoint = 0;
+	uint16_t segmentCount = segments.size();
+
+	// Processor starts from IVT entry 0
+	//
+	if (output.size() >= 2)
+	{
+		entryPoint = ((uint16_t)output[0] & 0x00FF) | (((uint16_t)output[1] << 8) & 0xFF00);
+	}
+
+	outputFile.write(IMAGE_MAGIC, 4);
+	outputFile.write((char*)&version, sizeof(uint16_t));
+	outputFile.write((char*)&entryPoint, sizeof(uint16_t));
+	outputFile.write((char*)&segmentCount, sizeof(uint16_t));
+
+	for (auto segment : segments)
 	{
-		outputFile.write((char*)&addr, sizeof(uint16_t));
-		outputFile.write((char*)&(output[i]), sizeof(uint8_t));
+		outputFile.write((char*)&segment.first, sizeof(uint16_t));
+		outputFile.write((char*)&segment.second, sizeof(uint32_t));
+		outputFile.write((char*)&output[segment.first], segment.second);
 	}
 }
 
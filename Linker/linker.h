@@ -6,6 +6,11 @@
 #include <vector>
 #include <unordered_map>
 
+// Program image header, emulator still accepts older images made of address/byte pairs
+//
+#define IMAGE_MAGIC "SSIM"
+#define IMAGE_VERSION 1
+
 class Linker
 {
 public:
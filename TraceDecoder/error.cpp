@@ -0,0 +1,7 @@
+#include "error.h"
+
+[[ noreturn ]] void RaiseError(std::string errorMessage)
+{
+	std::cout << errorMessage;
+	exit(-1);
+}
\ No newline at end of file
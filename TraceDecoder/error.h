@@ -0,0 +1,8 @@
+#ifndef _ERROR_H_
+#define _ERROR_H_
+
+#include <string>
+#include <iostream>
+
+[[ noreturn ]] void RaiseError(std::string errorMessage);
+#endif
\ No newline at end of file
@@ -0,0 +1,95 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <cstring>
+#include "error.h"
+#include "../Emulator/trace.h"
+#include "../Emulator/disassembler.h"
+
+void ReadCmdArguments(int argc, char* argv[], std::string& inputFile);
+
+// One line per record: <instruction number> <pc> <mnemonic> [<register>=<value>] [<address>]
+// Stores which write no register show stored value at address.
+//
+void PrintRecord(uint64_t index, const TraceRecord& record)
+{
+	std::cout << std::setw(12) << index << "  " << Hex(record.pc) << "  ";
+	std::cout << std::left << std::setw(6) << Mnemonic(record.opCode) << std::right;
+
+	uint8_t reg = record.flags & 0x0F;
+	bool hasAddress = (record.flags & TRACE_MEMORY) != 0;
+
+	if (reg != TRACE_NO_REGISTER)
+	{
+		std::cout << " " << RegisterName(reg) << "=" << Hex(record.value);
+
+		if (hasAddress)
+		{
+			std::cout << " [" << Hex(record.address) << "]";
+		}
+	}
+	else if (hasAddress)
+	{
+		std::cout << " [" << Hex(record.address) << "]=" << Hex(record.value);
+	}
+
+	std::cout << "\n";
+}
+
+int main(int argc, char* argv[])
+{
+	std::string inputFile = "";
+
+	ReadCmdArguments(argc, argv, inputFile);
+
+	std::ifstream input(inputFile, std::ios::binary | std::ios::in);
+
+	if (!input.is_open())
+	{
+		RaiseError("Error opening " + inputFile);
+	}
+
+	TraceFileHeader header;
+
+	if (!input.read((char*)&header, sizeof(header)) || memcmp(header.magic, TRACE_MAGIC, 4) != 0)
+	{
+		RaiseError("Not a trace file " + inputFile);
+	}
+
+	if (header.version != TRACE_VERSION || header.recordSize != sizeof(TraceRecord))
+	{
+		RaiseError("Unsupported trace version " + std::to_string(header.version) + " in " + inputFile);
+	}
+
+	std::cout << "Last " << header.recordCount << " of " << header.totalRecords << " executed instructions\n";
+
+	uint64_t first = header.totalRecords - header.recordCount;
+
+	for (uint64_t i = 0; i < header.recordCount; i++)
+	{
+		TraceRecord record;
+
+		if (!input.read((char*)&record, sizeof(record)))
+		{
+			RaiseError("Truncated trace " + inputFile);
+		}
+
+		PrintRecord(first + i, record);
+	}
+}
+
+void ReadCmdArguments(int argc, char* argv[], std::string& inputFile)
+{
+	// FORMAT:
+	// ./tracedecoder trace.ring
+	//
+	// Built together with ../Emulator/disassembler.cpp
+	//
+
+	if (argc != 2)
+	{
+		RaiseError("Usage: tracedecoder trace.ring");
+	}
+
+	inputFile = argv[1];
+}
\ No newline at end of file
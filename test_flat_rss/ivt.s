@@ -0,0 +1,8 @@
+# file: ivt.s
+
+.extern isr_reset
+
+.section ivt
+.word isr_reset
+.skip 14
+.end
@@ -0,0 +1,36 @@
+# file: main.s
+# Runs 667 * 25000 * 6 + 4 * 667 + 5 ~ 10^8 instructions, with loads and stores of memory
+# in each pass, then halts with counter in r3.
+
+.global my_start
+
+.section text
+
+my_start:
+  ldr sp, $0xFFEE
+  ldr r0, $667
+  ldr r2, $1
+  ldr r4, $0
+
+outer:
+  ldr r1, $25000
+
+inner:
+  ldr r3, counter
+  add r3, r2
+  str r3, counter
+  sub r1, r2
+  cmp r1, r4
+  jne inner
+
+  sub r0, r2
+  cmp r0, r4
+  jne outer
+
+  halt
+
+.section data
+counter:
+.word 0
+
+.end
@@ -0,0 +1,53 @@
+ASSEMBLER=../assembler
+LINKER=../linker
+EMULATOR=../emulator
+
+${ASSEMBLER} -o ivt.o ivt.s
+${ASSEMBLER} -o isr_reset.o isr_reset.s
+${ASSEMBLER} -o main.o main.s
+
+${LINKER} -hex -o program.hex ivt.o isr_reset.o main.o
+
+# Decoding and executing an instruction allocates nothing, so peak RSS after ~10^8 instructions
+# has to be the one near its start. VmHWM of the running emulator is sampled until it
+# exits, as /usr/bin/time is not everywhere. A leaking emulator is stopped as soon as it grows.
+# Sampling starts a moment later, before that the process may still be the forked shell.
+#
+MAX_GROWTH_KB=1024
+
+${EMULATOR} program.hex &
+PID=$!
+sleep 0.2
+FIRST=""
+LAST=""
+
+while grep -qs '^State:[[:space:]]*[RSD]' /proc/${PID}/status
+do
+  HWM=$(awk '/^VmHWM:/ { print $2 }' /proc/${PID}/status 2>/dev/null)
+
+  if [ -n "${HWM}" ]
+  then
+    FIRST=${FIRST:-${HWM}}
+    LAST=${HWM}
+  fi
+
+  if [ $((LAST - FIRST)) -gt ${MAX_GROWTH_KB} ]
+  then
+    kill ${PID}
+    wait ${PID}
+    echo "RSS grew by $((LAST - FIRST)) kB"
+    exit 1
+  fi
+
+  sleep 0.01
+done
+
+wait ${PID} || exit 1
+
+if [ -z "${FIRST}" ]
+then
+  echo "Emulator exited before its RSS could be read"
+  exit 1
+fi
+
+echo "Peak RSS ${FIRST} kB at start, ${LAST} kB at end"